@@ -145,6 +145,12 @@ void usage(std::ostream &os)
 			"                         not encrypt it. If you want encryption use it together\n"
 			"                         with -e or -c\n");
 	os << _("--noz                    Do not compress the archive.\n");
+	os << _("--zlevel <level>         compression level from 1 (fastest) to 9 (smallest).\n"
+			"                         The default is 9.\n");
+	os << _("--zcodec <codec>         compression codec, either deflate (the default)\n"
+			"                         or lz, which is faster but compresses less.\n");
+	os << _("--dedup                  split the packed files into chunks and store\n"
+			"                         identical chunks only once.\n");
 	os << _("--pack-list              list the files contained in the input file.\n"
 			"                         This may be used together with --de or --dc\n");
 	os << _("--unpack <packed>        unpack from the packed file the other files\n"
@@ -255,7 +261,9 @@ int real_main(int argc, char **argv)
 	bool ringless = false;
 	bool armor = false, wipe_input = false, anonymous = false, dohide = false, doreveal = false;
 	bool pack = false, pack_list = false, unpack = false, unpack_all = false;
-	bool compress = true;
+	bool compress = true, dedup = false;
+	int zlevel = 9;
+	Zcodec zcodec = zcodec_deflate;
 	bool dohidek = false, dorevealk = false;
 	std::string txname, outname, packname, rx2name;
 	int block_size = -1, block_filler = -1;
@@ -506,6 +514,27 @@ int real_main(int argc, char **argv)
 	if (hasopt_long(&argc, argv, "--noz")) {
 		compress = false;
 	}
+	if (hasopt_long(&argc, argv, "--dedup")) {
+		dedup = true;
+	}
+	if (hasopt_long(&argc, argv, "--zlevel", &val)) {
+		char *strend;
+		zlevel = strtoul(val, &strend, 0);
+		if (strend == val || zlevel < 1 || zlevel > 9) {
+			format(std::cout, _("The compression level must be between 1 and 9.\n"));
+			return -1;
+		}
+	}
+	if (hasopt_long(&argc, argv, "--zcodec", &val)) {
+		if (strcmp(val, "deflate") == 0) {
+			zcodec = zcodec_deflate;
+		} else if (strcmp(val, "lz") == 0) {
+			zcodec = zcodec_lz;
+		} else {
+			format(std::cout, _("Unknown compression codec %s.\n"), val);
+			return -1;
+		}
+	}
 	if (hasopt_long(&argc, argv, "--pack-list")) {
 		pack_list = true;
 	}
@@ -717,7 +746,7 @@ int real_main(int argc, char **argv)
 			format(std::cout, _("In need the name of the output file\n"));
 			return -1;
 		}
-		plain_pack(outname.c_str(), argc - 1, argv + 1, compress, verbose);
+		plain_pack(outname.c_str(), argc - 1, argv + 1, compress, verbose, dedup, zlevel, zcodec);
 		return 0;
 	}
 	if (incpack && !symencrypt && !pubencrypt) {
@@ -736,7 +765,7 @@ int real_main(int argc, char **argv)
 				return -1;
 			}
 			sym_pack(outname.c_str(), argc - 1, argv + 1, password,
-			         block_size, block_filler, shifts, compress, verbose);
+			         block_size, block_filler, shifts, compress, verbose, dedup, zlevel, zcodec);
 		} else if (argc == 2 && !outname.empty()) {
 			sym_encrypt(argv[1], outname.c_str(), password, block_size, block_filler, shifts, wipe_input);
 		} else {
@@ -1081,7 +1110,22 @@ show_block (std::cout, "seed", ringless_key.pair.xs.b, 32);
 
 
 	if (key_list_changed) {
-		save_key_file(kl, key_ring, password, !key_file_read);
+		// Append the new keys and certifications to the existing ring.
+		// Write it again if it needs to be corrected, if keys were changed
+		// in other ways or removed or once the file is twice as big as the
+		// keys themselves. Each append to an encrypted ring may add up to a
+		// block of padding, therefore small rings get some slack.
+		std::streamoff size = -1;
+		if (key_file_read && !correct_ring) {
+			try {
+				size = append_key_changes(key_ring, kl, password);
+			} catch (...) {
+				size = -1;
+			}
+		}
+		if (size < 0 || size > 2 * keys_size(kl) + (1 << 16)) {
+			save_key_file(kl, key_ring, password, !key_file_read);
+		}
 	}
 
 	if (pubencrypt || spoof || dohidek) {
@@ -1117,7 +1161,7 @@ show_block (std::cout, "seed", ringless_key.pair.xs.b, 32);
 			}
 			pub_pack(outname.c_str(), argc - 1, argv + 1, sender, 
 					 selected_list, block_size, block_filler, compress, 
-					 verbose, spoof);
+					 verbose, spoof, dedup, zlevel, zcodec);
 		} else if (argc == 2 && !outname.empty()) {
 			if (spoof) {
 				pub_spoof(argv[1], outname.c_str(), sender, selected_list,
@@ -62,6 +62,7 @@ void Blockbuf::init(const Chakey &key, uint64_t n64, size_t block_sz,
 	payload_bytes = 0;
 	first_block = si->pubseekoff(0, std::ios_base::cur, std::ios_base::in);
 	last_block_written = -1;
+	append_block = -1;
 	io = si;
 	writing = false;
 	eof = false;
@@ -339,6 +340,16 @@ bool Blockbuf::flush_current(bool last)
 			}
 		}
 	}
+	if (type == 3 && block_number == append_block) {
+		// The old last block used this nonce already. Nothing more can be
+		// written.
+		error_info = _("The appended data does not fill the last block of the file.");
+		closed = true;
+		if (owner_os) {
+			owner_os->setstate(std::ios_base::badbit);
+		}
+		return true;
+	}
 	krand.get_bytes (&buf[0], block_filler);
 	encrypt_multi((uint8_t*)&buf[0], (uint8_t*)&buf[0], mlen, &type, 1,
 	              keyw, &kaw[0], nka, (nonce64++) + nm);
@@ -418,31 +429,30 @@ void Blockbuf::write_sym_header(std::streambuf *io,
 }
 
 
-void create_hsx (const Cu25519Pair &tx, const Cu25519Ris &rx, const uint8_t symk[33],
-                 std::vector<uint8_t> &out, Chakey *ka, Chacha &krand, bool spoofed=false)
+// Ephemeral key of a handshake. The secret is taken from krand.
+static void gen_ephemeral (Cu25519Sec *es, Cu25519Ell *er, Chacha &krand)
+{
+	Cu25519Mon ep;
+	krand.copy (es->b, 32);
+	cu25519_elligator2_gen (es, &ep, er);
+}
+
+// Write the handshake for the recipient rx. she is the shared secret of the
+// ephemeral key er and shs the one of the static key of tx.
+static void create_hsx (const Cu25519Pair &tx, const Cu25519Ris &rx, const uint8_t symk[33],
+                 const Cu25519Ell &er, const uint8_t she[32], const uint8_t shs[32],
+                 std::vector<uint8_t> &out, Chakey *ka, bool spoofed=false)
 {
 	Symmetric s;
 	s.initialize ("Noise_X_25519_ChaChaPoly_BLAKE2s");
 	s.mix_hash (NULL, 0);   // prologue
 	s.mix_hash (spoofed ? tx.xp.b : rx.b, 32);
-	Cu25519Sec es;
-	Cu25519Mon ep;
-	Cu25519Ell er;
-	krand.copy (es.b, 32);
-	cu25519_elligator2_gen (&es, &ep, &er);
 	out.resize (32);
 	memcpy (&out[0], er.b, 32);
 	s.mix_hash (er.b, 32);
-	uint8_t sh[32];
-	if (spoofed) {
-		cu25519_shared_secret (sh, tx.xp, es);
-	} else {
-		cu25519_shared_secret (sh, rx, es);
-	}
-	s.mix_key (sh, 32);
+	s.mix_key (she, 32);
 	s.encrypt_and_hash (spoofed ? rx.b : tx.xp.b, 32, out);
-	cu25519_shared_secret (sh, rx, tx.xs);
-	s.mix_key (sh, 32);
+	s.mix_key (shs, 32);
 	s.encrypt_and_hash (symk, 33, out);
 	s.split (ka);
 }
@@ -466,7 +476,13 @@ void Blockbuf::write_pub_header (std::streambuf *io, unsigned block_size,
 	kav.resize (rx.size());
 
 	if (spoof) {
-		create_hsx (tx, rx[0], symk, out, &kav[0], krand, true);
+		Cu25519Sec es;
+		Cu25519Ell er;
+		gen_ephemeral (&es, &er, krand);
+		uint8_t she[32], shs[32];
+		cu25519_shared_secret (she, tx.xp, es);
+		cu25519_shared_secret (shs, rx[0], tx.xs);
+		create_hsx (tx, rx[0], symk, er, she, shs, out, &kav[0], true);
 		io->sputn ((char*) &out[0], out.size());
 		for (unsigned i = 1; i < rx.size(); ++i) {
 			char dummy[129];
@@ -475,8 +491,26 @@ void Blockbuf::write_pub_header (std::streambuf *io, unsigned block_size,
 			krand.get_bytes (kav[i].kw, 32);
 		}
 	} else {
-		for (unsigned i = 0; i < rx.size(); ++i) {
-			create_hsx (tx, rx[i], symk, out, &kav[i], krand);
+		// All the shared secrets of all the recipients are computed at once:
+		// the first n with the ephemeral keys and the next n with the static
+		// key of the sender.
+		size_t n = rx.size();
+		std::vector<Cu25519Ris> pts (2*n);
+		std::vector<Cu25519Sec> scs (2*n);
+		std::vector<Cu25519Ell> er (n);
+		for (size_t i = 0; i < n; ++i) {
+			gen_ephemeral (&scs[i], &er[i], krand);
+			pts[i] = pts[n + i] = rx[i];
+			scs[n + i] = tx.xs;
+		}
+		std::vector<uint8_t> shv (2*n*32);
+		uint8_t (*sh)[32] = (uint8_t (*)[32]) &shv[0];
+		std::vector<int> err (2*n);
+		if (cu25519_shared_secret_batch (sh, &pts[0], &scs[0], 2*n, &err[0]) != 0) {
+			throw std::runtime_error (_("Wrong public key shared secret (Ris)."));
+		}
+		for (size_t i = 0; i < n; ++i) {
+			create_hsx (tx, rx[i], symk, er[i], sh[i], sh[n + i], out, &kav[i]);
 			io->sputn ((char*)&out[0], out.size());
 		}
 	}
@@ -723,6 +757,42 @@ void Blockbuf::init_read (std::streambuf *sb, const char *password, int shifts_m
 	set_adr(kw, 1, 0);
 }
 
+void Blockbuf::init_append (std::streambuf *sb, const char *password, int shifts_max)
+{
+	Chakey kw;
+	uint64_t n64;
+	ptrdiff_t bs, bf;
+	if (shifts_max == 0) {
+		shifts_max = default_shifts_max;
+	}
+	krand.reset (password, strlen(password));
+	read_sym_header(sb, password, &kw, &n64, &bs, &bf, &shifts, shifts_max);
+	init(kw, n64, bs, bf, sb);
+	set_adw(&kw, 1);
+
+	// The last block is always shorter than a full one. Decrypt it and
+	// keep its payload in the buffer as the start of the block being
+	// written.
+	std::streamoff file_size = sb->pubseekoff(0, std::ios_base::end, std::ios_base::in);
+	std::streamoff last = (file_size - first_block) / (block_size + mac_size);
+	std::streamoff pos = first_block + last * (block_size + mac_size);
+	sb->pubseekpos (pos, std::ios_base::in);
+	block_number = last;
+	nonce64 = base_nonce64 + last;
+	read_block();
+
+	sb->pubseekpos (pos, std::ios_base::in | std::ios_base::out);
+	block_number = last;
+	nonce64 = base_nonce64 + last;
+	eof = false;
+	setp(&buf[block_filler], &buf[block_size]);
+	pbump(payload_bytes);
+	payload_bytes = 0;
+	last_block_written = last - 1;
+	append_block = last;
+	set_writing();
+}
+
 void Blockbuf::init_read (std::streambuf *sb, const Cu25519Pair &rx,
                           Cu25519Ris *sender, int *nrx)
 {
@@ -757,6 +827,16 @@ void Blockbuf::init_read (std::streambuf *sb, const Cu25519Pair &rx,
 }
 
 
+void Blockbuf::init_read (std::streambuf *sb, const Blockbuf &rhs)
+{
+	if (sb->pubseekpos (rhs.first_block, std::ios_base::in) != rhs.first_block) {
+		throw_rte (_("Cannot seek in the file."));
+	}
+	init(rhs.keyw, rhs.base_nonce64, rhs.block_size, rhs.block_filler, sb);
+	set_adr(rhs.kar, rhs.nka, rhs.ika);
+	shifts = rhs.shifts;
+}
+
 
 void insert_icryptbuf(std::istream &is, Blockbuf *bb)
 {
@@ -837,6 +917,23 @@ void ofstream::open(const char *name, const char *password, ptrdiff_t bs,
 }
 
 
+void ofstream::open_append(const char *name, const char *password, int shifts_max)
+{
+	try {
+		os.clear();
+		bbe.clear();
+		os.open(name, os.binary | os.in | os.out);
+		if (!os) {
+			setstate(badbit);
+			throw_rte (_("Could not open the underlying file for %s."), name);
+		}
+		bbe.init_append(os.rdbuf(), password, shifts_max);
+		bbe.set_owner(this);
+	} catch (...) {
+		throw_nrte (_("Could not open the encrypted file %s for appending."), name);
+	}
+}
+
 void ofstream::open(const char *name, const Cu25519Pair &tx,
                     const std::vector<Cu25519Ris> &rx, ptrdiff_t bs,
                     ptrdiff_t bf)
@@ -949,6 +1046,21 @@ void ifstream::open(const char *name, const char *password, std::nothrow_t, int
 }
 
 
+void ifstream::open(const char *name, const ifstream &rhs)
+{
+	try {
+		is.open(name, is.binary);
+		if (!is) {
+			setstate(badbit);
+			throw_rte (_("Could not open the underlying file %s"), name);
+		}
+		bbe.init_read(is.rdbuf(), rhs.bbe);
+		bbe.set_owner(this);
+	} catch (...) {
+		throw_nrte (_("Cannot open the encrypted file %s"), name);
+	}
+}
+
 void ifstream::open(const char *name, const Cu25519Pair &rx, Cu25519Ris *sender, int *nrx)
 {
 	try {
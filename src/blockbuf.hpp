@@ -65,6 +65,9 @@ class EXPORTFN Blockbuf : public std::streambuf {
 	// block_size bytes.
 	size_t   block_size, block_filler;
 	ptrdiff_t block_number, last_block_written;
+	// When appending, the block that was the last one of the file. It must
+	// not be written again as the last block.
+	ptrdiff_t append_block;
 	size_t   mac_size;
 	ptrdiff_t   payload_bytes;
 	std::streamoff first_block; // Offset in bytes of the first block.
@@ -143,7 +146,21 @@ public:
 	                int ndummies, ptrdiff_t bs, ptrdiff_t bf);
 
 	void init_read (std::streambuf *sb, const char *password, int shift_max=0);
+	// Open an existing file encrypted with the password for appending. The
+	// new data continues the payload of the file.
+	void init_append (std::streambuf *sb, const char *password, int shift_max=0);
+	// Number of bytes that still fit in the block being written.
+	size_t get_room() const { return epptr() - pptr(); }
+	// Position in the payload of the next byte to be written. Unlike
+	// seeking it does not flush the current block.
+	std::streamoff get_write_pos() const {
+		return std::streamoff(block_number) * (block_size - block_filler)
+		       + (pptr() - &buf[block_filler]);
+	}
 	void init_read (std::streambuf *sb, const Cu25519Pair &rx, Cu25519Ris *sender, int *nrx);
+	// Read from sb the same file that rhs is reading. The keys and block
+	// sizes are copied from rhs and the header is not processed again.
+	void init_read (std::streambuf *sb, const Blockbuf &rhs);
 };
 
 
@@ -216,6 +233,15 @@ public:
 	// Alice's claim is credible.
 	void open_spoof(const char *name, const Cu25519Pair &rx,
 	          const Cu25519Ris &txpub, int ndummies, ptrdiff_t bs=-1, ptrdiff_t bf=-1);
+
+	// Open an existing file encrypted with the password and continue
+	// writing at the end of its payload. The last block of the file is
+	// written again as a normal block, which must use a new nonce: before
+	// closing you must write at least block_room() + 1 bytes, otherwise the
+	// stream is set to bad and nothing more is written.
+	void open_append(const char *name, const char *password, int shifts_max=0);
+	size_t block_room() const { return bbe.get_room(); }
+	std::streamoff payload_pos() const { return bbe.get_write_pos(); }
 	void close();
 };
 
@@ -246,6 +272,10 @@ public:
 	void open(const char *name, const char *password, std::nothrow_t, int shifts_max=0);
 	void open(const char *name, const Cu25519Pair &rx, Cu25519Ris *sender, int *nrx);
 	void open(const char *name, const Cu25519Pair &rx, Cu25519Ris *sender, int *nrx, std::nothrow_t);
+	// Open again the file name, which is already open in rhs. The keys of
+	// rhs are reused without asking for the password or key again. This
+	// allows several readers of the same file. Throw on errors.
+	void open(const char *name, const ifstream &rhs);
 	void close();
 	void clear(std::ios_base::iostate = std::ios_base::goodbit);
 };
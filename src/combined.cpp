@@ -711,7 +711,7 @@ int clear_verify (const char *name, Key &signer, std::string *comment, time_t *d
 			unsigned char bh[64];
 			bl.final (bh);
 
-			if (0 != cu25519_verify(sig_prefix, bh, 64, signature, signer.pair.xp)) {
+			if (0 != cu25519_verify (sig_prefix, bh, 64, signature, signer.pair.xp)) {
 				return -1;
 			}
 
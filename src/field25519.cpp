@@ -34,6 +34,7 @@
 
 #include "misc.hpp"
 #include "symmetric.hpp"
+#include "field25519x4.hpp"
 
 namespace amber {  namespace AMBER_SONAME {
 
@@ -221,14 +222,16 @@ std::ostream & operator<< (std::ostream &os, const Fe32 &rhs)
 
 
 // Compute z11 = z¹¹ and res = z ^ (2²⁵² - 2²). Taken from the slides of
-// "Scalar-multiplication algorithms" by Peter Schwabe.
-static void raise_252_2 (Fe &res, Fe &z11, const Fe &z)
+// "Scalar-multiplication algorithms" by Peter Schwabe. It is a template so
+// that it can be used with both Fe and Fe4.
+template <class F>
+static void raise_252_2 (F &res, F &z11, const F &z)
 {
-	Fe t;
-	Fe z2;  // square of z
-	Fe z9;  // z⁹
+	F t;
+	F z2;  // square of z
+	F z9;  // z⁹
 	// In the following z2_x_y means z^(2^x - 2^y)
-	Fe z2_5_0, z2_10_0, z2_20_0, z2_50_0, z2_100_0;
+	F z2_5_0, z2_10_0, z2_20_0, z2_50_0, z2_100_0;
 	// The comments show the exponent.
 	square (z2, z);     // 2
 	square (t, z2);     // 4
@@ -705,6 +708,148 @@ void montgomery_ladder_unchecked (uint8_t res[32], const uint8_t pointx[32], con
 }
 
 
+
+// Four ladders at once.
+
+#ifdef AMBER_FE4
+
+static const Fe32 fe32zero = { { 0 } };
+static const Fe32 fe32one = { { 1 } };
+
+static void invert (Fe4 &res, const Fe4 &z)
+{
+	Fe4 z11, tmp;
+	raise_252_2 (tmp, z11, z);
+	square (tmp, tmp);
+	square (tmp, tmp);
+	square (tmp, tmp);
+	mul (res, tmp, z11);
+}
+
+// Same as the one lane ladder above. Each lane has its own scalar and
+// therefore its own swap mask.
+static void montgomery_ladder (Fe4 &x2, Fe4 &z2, Fe4 &x3, Fe4 &z3, const Fe4 &x1,
+                               const uint8_t *const scalar[4], int startbit)
+{
+	broadcast (x2, fe32one);
+	broadcast (z2, fe32zero);
+	x3 = x1;
+	broadcast (z3, fe32one);
+	Fe4 t1, t2, t3, t4, t5, t6, t7, t8, t9;
+	uint32_t swapped[4] = { 0, 0, 0, 0 };
+	for (int i = startbit; i >= 0; --i) {
+		uint32_t current[4];
+		for (int j = 0; j < 4; ++j) {
+			current[j] = (scalar[j][i/8] >> (i & 7)) & 1;
+		}
+		__m256i flag = lane_mask (current[0] ^ swapped[0], current[1] ^ swapped[1],
+		                          current[2] ^ swapped[2], current[3] ^ swapped[3]);
+		cswap (x2, x3, flag);
+		cswap (z2, z3, flag);
+		for (int j = 0; j < 4; ++j) {
+			swapped[j] = current[j];
+		}
+
+		add_no_reduce (t1, x2, z2);
+		sub (t2, x2, z2);
+		add_no_reduce (t3, x3, z3);
+		sub (t4, x3, z3);
+		square (t6, t1);
+		square (t7, t2);
+		sub (t5, t6, t7);
+		mul (t8, t4, t1);
+		mul (t9, t3, t2);
+		add_no_reduce (x3, t8, t9);
+		square (x3, x3);
+		sub (z3, t8, t9);
+		square (z3, z3);
+		mul (z3, z3, x1);
+		mul (x2, t6, t7);
+		mul_small (z2, t5, 121666);
+		add_no_reduce (z2, z2, t7);
+		mul (z2, z2, t5);
+	}
+
+	__m256i flag = lane_mask (swapped[0], swapped[1], swapped[2], swapped[3]);
+	cswap (x2, x3, flag);
+	cswap (z2, z3, flag);
+}
+
+#endif
+
+void montgomery_ladder_x4 (Fe u[4], Fe z[4], const Fe xp[4],
+                           const uint8_t *const scalar[4], int startbit)
+{
+#ifdef AMBER_FE4
+	Fe32 lanes[4];
+	for (int i = 0; i < 4; ++i) {
+		to_fe32 (lanes[i], xp[i]);
+	}
+	Fe4 x1, x2, z2, x3, z3;
+	pack (x1, lanes[0], lanes[1], lanes[2], lanes[3]);
+	montgomery_ladder (x2, z2, x3, z3, x1, scalar, startbit);
+	unpack (lanes, x2);
+	for (int i = 0; i < 4; ++i) {
+		from_fe32 (u[i], lanes[i]);
+	}
+	unpack (lanes, z2);
+	for (int i = 0; i < 4; ++i) {
+		from_fe32 (z[i], lanes[i]);
+	}
+#else
+	for (int i = 0; i < 4; ++i) {
+		montgomery_ladder (u[i], z[i], xp[i], scalar[i], startbit);
+	}
+#endif
+}
+
+void montgomery_ladder_checked_x4 (int err[4], uint8_t *const res[4],
+                                   const uint8_t *const pointx[4],
+                                   const uint8_t *const scalar[4], int startbit)
+{
+	Fe fb[4], fu[4], fz[4];
+	for (int i = 0; i < 4; ++i) {
+		load (fb[i], pointx[i]);
+	}
+	montgomery_ladder_x4 (fu, fz, fb, scalar, startbit);
+	// Same checks as in montgomery_ladder_checked().
+	for (int i = 0; i < 4; ++i) {
+		Fe fres;
+		mul (fres, fu[i], fz[i]);
+		err[i] = invsqrt (fres, fres);
+		mul (fres, fres, fu[i]);
+		square (fres, fres);
+		reduce_store (res[i], fres);
+	}
+}
+
+void montgomery_ladder_unchecked_x4 (uint8_t *const res[4],
+                                     const uint8_t *const pointx[4],
+                                     const uint8_t *const scalar[4], int startbit)
+{
+#ifdef AMBER_FE4
+	// Keep the inversion in the four lanes too.
+	Fe32 lanes[4];
+	for (int i = 0; i < 4; ++i) {
+		load (lanes[i], pointx[i]);
+	}
+	Fe4 x1, x2, z2, x3, z3;
+	pack (x1, lanes[0], lanes[1], lanes[2], lanes[3]);
+	montgomery_ladder (x2, z2, x3, z3, x1, scalar, startbit);
+	invert (z2, z2);
+	mul (x2, x2, z2);
+	unpack (lanes, x2);
+	for (int i = 0; i < 4; ++i) {
+		reduce_store (res[i], lanes[i]);
+	}
+#else
+	for (int i = 0; i < 4; ++i) {
+		montgomery_ladder_unchecked (res[i], pointx[i], scalar[i], startbit);
+	}
+#endif
+}
+
+
 // Elligator 2
 
 // See https://www.imperialviolet.org/2013/12/25/elligator.html
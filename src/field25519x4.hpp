@@ -0,0 +1,381 @@
+#ifndef AMBER_FIELD25519X4_HPP
+#define AMBER_FIELD25519X4_HPP
+
+/*
+ * Copyright (c) 2017-2019, Pelayo Bernedo.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "field25519.hpp"
+
+// Four lanes of field elements modulo 2²⁵⁵ - 19. This is an internal
+// header. It is included only by the implementation files.
+
+// Each lane uses the same 25.5 bit limbs as Fe32. Limb i of the four lanes
+// is stored in a single 256 bit register, each lane using 64 bits. The
+// multiplication of two limbs uses vpmuludq, which multiplies the lower 32
+// bits of each lane and produces a 64 bit result. Therefore the arithmetic
+// is exactly the same as in Fe32, but four independent operations are
+// performed at once. The limb bounds of Fe32 are also valid here.
+
+// The four lanes are only available if the compiler targets AVX2 (for
+// instance with -march=native on a capable machine). You can disable them
+// by defining AMBER_NO_AVX2. If they are not available AMBER_FE4 will not be
+// defined and the callers must fall back to the one lane code.
+
+#if defined(__AVX2__) && !defined(AMBER_NO_AVX2)
+	#define AMBER_FE4 1
+#endif
+
+#ifdef AMBER_FE4
+
+#include <immintrin.h>
+
+namespace amber {  inline namespace AMBER_SONAME {
+
+struct Fe4 {
+	__m256i v[10];
+};
+
+// A mask with all the bits of the lane set if the corresponding flag is 1
+// and cleared if it is 0. Flags must be either 0 or 1.
+inline __m256i lane_mask (uint32_t f0, uint32_t f1, uint32_t f2, uint32_t f3)
+{
+	return _mm256_set_epi64x (-int64_t(f3), -int64_t(f2), -int64_t(f1), -int64_t(f0));
+}
+
+// Load the four lanes from Fe32 values.
+inline void pack (Fe4 &res, const Fe32 &a, const Fe32 &b, const Fe32 &c, const Fe32 &d)
+{
+	for (int i = 0; i < 10; ++i) {
+		res.v[i] = _mm256_set_epi64x (d.v[i], c.v[i], b.v[i], a.v[i]);
+	}
+}
+
+// Store each lane in out[lane].
+inline void unpack (Fe32 out[4], const Fe4 &f)
+{
+	alignas(32) uint64_t tmp[4];
+	for (int i = 0; i < 10; ++i) {
+		_mm256_store_si256 ((__m256i*)tmp, f.v[i]);
+		out[0].v[i] = tmp[0];
+		out[1].v[i] = tmp[1];
+		out[2].v[i] = tmp[2];
+		out[3].v[i] = tmp[3];
+	}
+}
+
+// Conversion between Fe and the Fe32 used by each lane.
+inline void to_fe32 (Fe32 &res, const Fe &f)
+{
+#if AMBER_LIMB_BITS == 32
+	res = f;
+#else
+	convert (res, f);
+#endif
+}
+
+inline void from_fe32 (Fe &res, const Fe32 &f)
+{
+#if AMBER_LIMB_BITS == 32
+	res = f;
+#else
+	convert (res, f);
+#endif
+}
+
+#if AMBER_LIMB_BITS >= 64
+inline void pack (Fe4 &res, const Fe64 &a, const Fe64 &b, const Fe64 &c, const Fe64 &d)
+{
+	Fe32 l[4];
+	convert (l[0], a);
+	convert (l[1], b);
+	convert (l[2], c);
+	convert (l[3], d);
+	pack (res, l[0], l[1], l[2], l[3]);
+}
+
+inline void unpack (Fe64 out[4], const Fe4 &f)
+{
+	Fe32 l[4];
+	unpack (l, f);
+	for (int i = 0; i < 4; ++i) {
+		convert (out[i], l[i]);
+	}
+}
+#endif
+
+// Set all four lanes to the same value.
+inline void broadcast (Fe4 &res, const Fe32 &a)
+{
+	for (int i = 0; i < 10; ++i) {
+		res.v[i] = _mm256_set1_epi64x (a.v[i]);
+	}
+}
+
+inline void add_no_reduce (Fe4 &res, const Fe4 &a, const Fe4 &b)
+{
+	for (int i = 0; i < 10; ++i) {
+		res.v[i] = _mm256_add_epi64 (a.v[i], b.v[i]);
+	}
+}
+
+// Propagate the carries of h[0..9] into res, as in the Fe32 routines.
+inline void carry (Fe4 &res, const __m256i h[10])
+{
+	const __m256i m25 = _mm256_set1_epi64x (mask25);
+	const __m256i m26 = _mm256_set1_epi64x (mask26);
+	__m256i c = h[0];
+	for (int i = 0; i < 10; i += 2) {
+		if (i != 0) c = _mm256_add_epi64 (c, h[i]);
+		res.v[i] = _mm256_and_si256 (c, m26);
+		c = _mm256_srli_epi64 (c, 26);
+		c = _mm256_add_epi64 (c, h[i+1]);
+		res.v[i+1] = _mm256_and_si256 (c, m25);
+		c = _mm256_srli_epi64 (c, 25);
+	}
+	// c*19 = c*16 + c*2 + c. The carry may exceed 32 bits.
+	__m256i c19 = _mm256_add_epi64 (_mm256_slli_epi64 (c, 4),
+	                      _mm256_add_epi64 (_mm256_slli_epi64 (c, 1), c));
+	c = _mm256_add_epi64 (res.v[0], c19);
+	res.v[0] = _mm256_and_si256 (c, m26);
+	c = _mm256_srli_epi64 (c, 26);
+	res.v[1] = _mm256_add_epi64 (res.v[1], c);
+}
+
+inline void add (Fe4 &res, const Fe4 &a, const Fe4 &b)
+{
+	__m256i h[10];
+	for (int i = 0; i < 10; ++i) {
+		h[i] = _mm256_add_epi64 (a.v[i], b.v[i]);
+	}
+	carry (res, h);
+}
+
+// Perform 4P + a - b. Avoids underflow to negative numbers.
+inline void sub (Fe4 &res, const Fe4 &a, const Fe4 &b)
+{
+	__m256i h[10];
+	h[0] = _mm256_add_epi64 (_mm256_set1_epi64x (four_p0), _mm256_sub_epi64 (a.v[0], b.v[0]));
+	for (int i = 1; i < 10; ++i) {
+		__m256i fm = _mm256_set1_epi64x (i & 1 ? four_mask25 : four_mask26);
+		h[i] = _mm256_add_epi64 (fm, _mm256_sub_epi64 (a.v[i], b.v[i]));
+	}
+	carry (res, h);
+}
+
+// Perform 4P - a.
+inline void negate (Fe4 &res, const Fe4 &a)
+{
+	__m256i h[10];
+	h[0] = _mm256_sub_epi64 (_mm256_set1_epi64x (four_p0), a.v[0]);
+	for (int i = 1; i < 10; ++i) {
+		__m256i fm = _mm256_set1_epi64x (i & 1 ? four_mask25 : four_mask26);
+		h[i] = _mm256_sub_epi64 (fm, a.v[i]);
+	}
+	carry (res, h);
+}
+
+inline __m256i mul4 (__m256i a, __m256i b)
+{
+	return _mm256_mul_epu32 (a, b);
+}
+
+inline __m256i add4 (__m256i a, __m256i b)
+{
+	return _mm256_add_epi64 (a, b);
+}
+
+// Same schedule as mul (Fe32&,...).
+inline void mul (Fe4 &res, const Fe4 &f, const Fe4 &g)
+{
+	const __m256i k19 = _mm256_set1_epi64x (19);
+	const __m256i k38 = _mm256_set1_epi64x (38);
+	__m256i f0 = f.v[0], f1 = f.v[1], f2 = f.v[2], f3 = f.v[3], f4 = f.v[4];
+	__m256i f5 = f.v[5], f6 = f.v[6], f7 = f.v[7], f8 = f.v[8], f9 = f.v[9];
+	__m256i g0 = g.v[0], g1 = g.v[1], g2 = g.v[2], g3 = g.v[3], g4 = g.v[4];
+	__m256i g5 = g.v[5], g6 = g.v[6], g7 = g.v[7], g8 = g.v[8], g9 = g.v[9];
+
+	__m256i f1_2  = _mm256_slli_epi64 (f1, 1);
+	__m256i f1_38 = mul4 (f1, k38);
+	__m256i f2_19 = mul4 (f2, k19);
+	__m256i f3_2  = _mm256_slli_epi64 (f3, 1);
+	__m256i f3_19 = mul4 (f3, k19);
+	__m256i f3_38 = mul4 (f3, k38);
+	__m256i f4_19 = mul4 (f4, k19);
+	__m256i f5_2  = _mm256_slli_epi64 (f5, 1);
+	__m256i f5_19 = mul4 (f5, k19);
+	__m256i f5_38 = mul4 (f5, k38);
+	__m256i f6_19 = mul4 (f6, k19);
+	__m256i f7_2  = _mm256_slli_epi64 (f7, 1);
+	__m256i f7_19 = mul4 (f7, k19);
+	__m256i f7_38 = mul4 (f7, k38);
+	__m256i f8_19 = mul4 (f8, k19);
+	__m256i f9_19 = mul4 (f9, k19);
+	__m256i f9_38 = mul4 (f9, k38);
+
+	__m256i h[10];
+	h[0] = add4 (add4 (add4 (mul4(f0,g0), mul4(f1_38,g9)), add4 (mul4(f2_19,g8), mul4(f3_38,g7))),
+	       add4 (add4 (add4 (mul4(f4_19,g6), mul4(f5_38,g5)), add4 (mul4(f6_19,g4), mul4(f7_38,g3))),
+	             add4 (mul4(f8_19,g2), mul4(f9_38,g1))));
+
+	h[1] = add4 (add4 (add4 (mul4(f0,g1), mul4(f1,g0)), add4 (mul4(f2_19,g9), mul4(f3_19,g8))),
+	       add4 (add4 (add4 (mul4(f4_19,g7), mul4(f5_19,g6)), add4 (mul4(f6_19,g5), mul4(f7_19,g4))),
+	             add4 (mul4(f8_19,g3), mul4(f9_19,g2))));
+
+	h[2] = add4 (add4 (add4 (mul4(f0,g2), mul4(f1_2,g1)), add4 (mul4(f2,g0), mul4(f3_38,g9))),
+	       add4 (add4 (add4 (mul4(f4_19,g8), mul4(f5_38,g7)), add4 (mul4(f6_19,g6), mul4(f7_38,g5))),
+	             add4 (mul4(f8_19,g4), mul4(f9_38,g3))));
+
+	h[3] = add4 (add4 (add4 (mul4(f0,g3), mul4(f1,g2)), add4 (mul4(f2,g1), mul4(f3,g0))),
+	       add4 (add4 (add4 (mul4(f4_19,g9), mul4(f5_19,g8)), add4 (mul4(f6_19,g7), mul4(f7_19,g6))),
+	             add4 (mul4(f8_19,g5), mul4(f9_19,g4))));
+
+	h[4] = add4 (add4 (add4 (mul4(f0,g4), mul4(f1_2,g3)), add4 (mul4(f2,g2), mul4(f3_2,g1))),
+	       add4 (add4 (add4 (mul4(f4,g0), mul4(f5_38,g9)), add4 (mul4(f6_19,g8), mul4(f7_38,g7))),
+	             add4 (mul4(f8_19,g6), mul4(f9_38,g5))));
+
+	h[5] = add4 (add4 (add4 (mul4(f0,g5), mul4(f1,g4)), add4 (mul4(f2,g3), mul4(f3,g2))),
+	       add4 (add4 (add4 (mul4(f4,g1), mul4(f5,g0)), add4 (mul4(f6_19,g9), mul4(f7_19,g8))),
+	             add4 (mul4(f8_19,g7), mul4(f9_19,g6))));
+
+	h[6] = add4 (add4 (add4 (mul4(f0,g6), mul4(f1_2,g5)), add4 (mul4(f2,g4), mul4(f3_2,g3))),
+	       add4 (add4 (add4 (mul4(f4,g2), mul4(f5_2,g1)), add4 (mul4(f6,g0), mul4(f7_38,g9))),
+	             add4 (mul4(f8_19,g8), mul4(f9_38,g7))));
+
+	h[7] = add4 (add4 (add4 (mul4(f0,g7), mul4(f1,g6)), add4 (mul4(f2,g5), mul4(f3,g4))),
+	       add4 (add4 (add4 (mul4(f4,g3), mul4(f5,g2)), add4 (mul4(f6,g1), mul4(f7,g0))),
+	             add4 (mul4(f8_19,g9), mul4(f9_19,g8))));
+
+	h[8] = add4 (add4 (add4 (mul4(f0,g8), mul4(f1_2,g7)), add4 (mul4(f2,g6), mul4(f3_2,g5))),
+	       add4 (add4 (add4 (mul4(f4,g4), mul4(f5_2,g3)), add4 (mul4(f6,g2), mul4(f7_2,g1))),
+	             add4 (mul4(f8,g0), mul4(f9_38,g9))));
+
+	h[9] = add4 (add4 (add4 (mul4(f0,g9), mul4(f1,g8)), add4 (mul4(f2,g7), mul4(f3,g6))),
+	       add4 (add4 (add4 (mul4(f4,g5), mul4(f5,g4)), add4 (mul4(f6,g3), mul4(f7,g2))),
+	             add4 (mul4(f8,g1), mul4(f9,g0))));
+
+	carry (res, h);
+}
+
+inline __m256i dbl4 (__m256i a)
+{
+	return _mm256_slli_epi64 (a, 1);
+}
+
+// Same schedule as square (Fe32&,...).
+inline void square (Fe4 &res, const Fe4 &f)
+{
+	const __m256i k19 = _mm256_set1_epi64x (19);
+	const __m256i k38 = _mm256_set1_epi64x (38);
+	__m256i f0 = f.v[0], f1 = f.v[1], f2 = f.v[2], f3 = f.v[3], f4 = f.v[4];
+	__m256i f5 = f.v[5], f6 = f.v[6], f7 = f.v[7], f8 = f.v[8], f9 = f.v[9];
+
+	__m256i f1_2  = dbl4 (f1);
+	__m256i f1_38 = mul4 (f1, k38);
+	__m256i f2_19 = mul4 (f2, k19);
+	__m256i f3_2  = dbl4 (f3);
+	__m256i f3_19 = mul4 (f3, k19);
+	__m256i f3_38 = mul4 (f3, k38);
+	__m256i f4_19 = mul4 (f4, k19);
+	__m256i f5_19 = mul4 (f5, k19);
+	__m256i f5_38 = mul4 (f5, k38);
+	__m256i f6_19 = mul4 (f6, k19);
+	__m256i f7_19 = mul4 (f7, k19);
+	__m256i f7_38 = mul4 (f7, k38);
+	__m256i f8_19 = mul4 (f8, k19);
+	__m256i f9_38 = mul4 (f9, k38);
+
+	__m256i h[10];
+	h[0] = add4 (add4 (mul4(f0,f0), mul4(f5_38,f5)),
+	             dbl4 (add4 (add4 (mul4(f1_38,f9), mul4(f2_19,f8)),
+	                         add4 (mul4(f3_38,f7), mul4(f4_19,f6)))));
+
+	h[1] = dbl4 (add4 (add4 (add4 (mul4(f0,f1), mul4(f2_19,f9)), add4 (mul4(f3_19,f8), mul4(f4_19,f7))),
+	                   mul4(f5_19,f6)));
+
+	h[2] = add4 (dbl4 (add4 (add4 (add4 (mul4(f0,f2), mul4(f1,f1)), add4 (mul4(f3_38,f9), mul4(f4_19,f8))),
+	                         mul4(f5_38,f7))),
+	             mul4(f6_19,f6));
+
+	h[3] = dbl4 (add4 (add4 (add4 (mul4(f0,f3), mul4(f1,f2)), add4 (mul4(f4_19,f9), mul4(f5_19,f8))),
+	                   mul4(f6_19,f7)));
+
+	h[4] = add4 (dbl4 (add4 (add4 (mul4(f0,f4), mul4(f1_2,f3)), add4 (mul4(f5_38,f9), mul4(f6_19,f8)))),
+	             add4 (mul4(f2,f2), mul4(f7_38,f7)));
+
+	h[5] = dbl4 (add4 (add4 (add4 (mul4(f0,f5), mul4(f1,f4)), add4 (mul4(f2,f3), mul4(f6_19,f9))),
+	                   mul4(f7_19,f8)));
+
+	h[6] = add4 (dbl4 (add4 (add4 (mul4(f0,f6), mul4(f1_2,f5)), add4 (mul4(f2,f4), mul4(f7_38,f9)))),
+	             add4 (mul4(f3_2,f3), mul4(f8_19,f8)));
+
+	h[7] = dbl4 (add4 (add4 (add4 (mul4(f0,f7), mul4(f1,f6)), add4 (mul4(f2,f5), mul4(f3,f4))),
+	                   mul4(f8_19,f9)));
+
+	h[8] = add4 (dbl4 (add4 (add4 (mul4(f0,f8), mul4(f1_2,f7)), add4 (mul4(f2,f6), mul4(f3_2,f5)))),
+	             add4 (mul4(f4,f4), mul4(f9_38,f9)));
+
+	h[9] = dbl4 (add4 (add4 (add4 (mul4(f0,f9), mul4(f1,f8)), add4 (mul4(f2,f7), mul4(f3,f6))),
+	                   mul4(f4,f5)));
+
+	carry (res, h);
+}
+
+// Multiply by a small number that fits in 32 bits.
+inline void mul_small (Fe4 &res, const Fe4 &a, uint32_t bs)
+{
+	const __m256i b = _mm256_set1_epi64x (bs);
+	__m256i h[10];
+	for (int i = 0; i < 10; ++i) {
+		h[i] = mul4 (a.v[i], b);
+	}
+	carry (res, h);
+}
+
+// Swap the lanes of a and b where the mask is set. The mask must be the
+// result of lane_mask().
+inline void cswap (Fe4 &a, Fe4 &b, __m256i mask)
+{
+	for (int i = 0; i < 10; ++i) {
+		__m256i c = _mm256_and_si256 (_mm256_xor_si256 (a.v[i], b.v[i]), mask);
+		a.v[i] = _mm256_xor_si256 (a.v[i], c);
+		b.v[i] = _mm256_xor_si256 (b.v[i], c);
+	}
+}
+
+// res = a in the lanes where mask is set, res = b in the others.
+inline void select (Fe4 &res, const Fe4 &a, const Fe4 &b, __m256i mask)
+{
+	for (int i = 0; i < 10; ++i) {
+		res.v[i] = _mm256_blendv_epi8 (b.v[i], a.v[i], mask);
+	}
+}
+
+}}
+
+#endif
+
+#endif
@@ -33,8 +33,15 @@
 #include <iomanip>
 #include <string.h>
 #include <fstream>
+#include <vector>
+#include <stdexcept>
+#include <list>
+#include <mutex>
+#include <thread>
+#include <algorithm>
 #include "sha2.hpp"
 #include "hasopt.hpp"
+#include "field25519x4.hpp"
 
 namespace amber {   namespace AMBER_SONAME {
 
@@ -698,6 +705,52 @@ inline void select (Edwards &res, const Edwards &p, uint32_t flag)
 	}
 }
 
+// Constant time table scan: res = tab[idx] if idx < n, otherwise res is
+// left unchanged. All the entries are read. It is the same as calling
+// select (res, tab[j], j == idx) for all j, but with AVX2 the entries are
+// handled as 256 bit vectors. The tables should be aligned to 64
+// bytes.
+template <class T>
+inline void select_scan (T &res, const T *tab, int n, uint32_t idx)
+{
+#ifdef AMBER_FE4
+	// T is copied as 64 bit words. The last vector may be partial.
+	enum { words = sizeof(T) / 8, vecs = (words + 3) / 4 };
+	static_assert (sizeof(T) % 8 == 0, "The entry must contain whole words");
+	const __m256i tail = _mm256_cmpgt_epi64 (_mm256_set1_epi64x (words - (vecs - 1)*4),
+	                                         _mm256_setr_epi64x (0, 1, 2, 3));
+	long long *rp = (long long*) &res;
+	__m256i acc[vecs];
+	for (int k = 0; k < vecs - 1; ++k) {
+		acc[k] = _mm256_loadu_si256 ((const __m256i*) (rp + k*4));
+	}
+	acc[vecs - 1] = _mm256_maskload_epi64 (rp + (vecs - 1)*4, tail);
+
+	const __m256i vidx = _mm256_set1_epi32 (idx);
+	for (int j = 0; j < n; ++j) {
+		__m256i mask = _mm256_cmpeq_epi32 (_mm256_set1_epi32 (j), vidx);
+		const long long *tp = (const long long*) &tab[j];
+		for (int k = 0; k < vecs - 1; ++k) {
+			__m256i v = _mm256_loadu_si256 ((const __m256i*) (tp + k*4));
+			acc[k] = _mm256_blendv_epi8 (acc[k], v, mask);
+		}
+		__m256i v = _mm256_maskload_epi64 (tp + (vecs - 1)*4, tail);
+		acc[vecs - 1] = _mm256_blendv_epi8 (acc[vecs - 1], v, mask);
+	}
+
+	for (int k = 0; k < vecs - 1; ++k) {
+		_mm256_storeu_si256 ((__m256i*) (rp + k*4), acc[k]);
+	}
+	_mm256_maskstore_epi64 (rp + (vecs - 1)*4, tail, acc[vecs - 1]);
+#else
+	for (int j = 0; j < n; ++j) {
+		// equal() only works with small values. idx may be any value.
+		uint32_t diff = uint32_t(j) ^ idx;
+		select (res, tab[j], 1 ^ ((diff | (0 - diff)) >> 31));
+	}
+#endif
+}
+
 // Fixed window, 4 bits at a time.
 
 void scalarmult_fw (Edwards &res, const Edwards &p, const uint8_t s[32])
@@ -708,7 +761,7 @@ void scalarmult_fw (Edwards &res, const Edwards &p, const uint8_t s[32])
 	res.z = feone;
 	res.t = fezero;
 
-	Edwards pmul[16];
+	alignas(64) Edwards pmul[16];
 
 	pmul[0] = res;
 	pmul[1] = p;
@@ -738,9 +791,7 @@ void scalarmult_fw (Edwards &res, const Edwards &p, const uint8_t s[32])
 		point_double (res, res);
 		point_double (res, res);
 
-		for (int j = 0; j < 16; ++j) {
-			select (tmp, pmul[j], equal (j, v));
-		}
+		select_scan (tmp, pmul, 16, v);
 		point_add (res, res, tmp);
 
 		v = s[i] & 0xF;
@@ -750,9 +801,7 @@ void scalarmult_fw (Edwards &res, const Edwards &p, const uint8_t s[32])
 		point_double (res, res);
 		point_double (res, res);
 
-		for (int j = 0; j < 16; ++j) {
-			select (tmp, pmul[j], equal (j, v));
-		}
+		select_scan (tmp, pmul, 16, v);
 		point_add (res, res, tmp);
 	}
 }
@@ -760,11 +809,11 @@ void scalarmult_fw (Edwards &res, const Edwards &p, const uint8_t s[32])
 
 
 
+// Same as below but inv is already 1/e.z.
 static
-void edwards_to_precomp (Precomputed &pc, const Edwards &e)
+void edwards_to_precomp (Precomputed &pc, const Edwards &e, const Fe &inv)
 {
-	Fe nx, ny, inv;
-	invert (inv, e.z);
+	Fe nx, ny;
 	mul (nx, e.x, inv);
 	mul (ny, e.y, inv);
 	add (pc.ypx, nx, ny);
@@ -773,6 +822,14 @@ void edwards_to_precomp (Precomputed &pc, const Edwards &e)
 	mul (pc.xy2d, pc.xy2d, edwards_2d);
 }
 
+static
+void edwards_to_precomp (Precomputed &pc, const Edwards &e)
+{
+	Fe inv;
+	invert (inv, e.z);
+	edwards_to_precomp (pc, e, inv);
+}
+
 static
 void edwards_to_summand (Summand &s, const Edwards &e)
 {
@@ -820,7 +877,7 @@ void write_coeffs (std::ostream &os, const Fe &fe)
 void write_base_multiples (const char *name)
 {
 	std::ofstream os(name);
-	os << "static const Precomputed basemult[32][8] = {\n";
+	os << "alignas(64) static const Precomputed basemult[32][8] = {\n";
 	Edwards p;
 	Precomputed pc;
 	uint8_t scalar[32];
@@ -877,25 +934,6 @@ inline int32_t iabs (int32_t x)
 	return a;
 }
 
-// Select the correct multiple and sign. It returns res = smult*16^(i*2)*B
-static void compute_multiple (Precomputed &res, int8_t smult, int i)
-{
-	uint32_t negative = (smult & 0x80) >> 7;    // Only 1 or 0.
-	uint32_t mult = iabs (smult);
-	res = { feone, feone, fezero };  // Zero element.
-	for (int j = 1; j <= 8; ++j) {
-		// Load the multiple corresponding to the absolute value.
-		select (res, basemult[i][j-1], equal (mult, j));
-	}
-	// Compute the negative of the multiple.
-	Precomputed neg;
-	neg.ypx = res.ymx;
-	neg.ymx = res.ypx;
-	negate (neg.xy2d, res.xy2d);
-	// Select the negative one if smult < 0.
-	select (res, neg, negative);
-}
-
 // This is base_point^2²⁵⁶
 
 #if AMBER_LIMB_BITS == 32
@@ -916,36 +954,127 @@ static const Edwards bm = {
 };
 #endif
 
-void scalarbase (Edwards &res, const uint8_t scalar[32])
-{
-	int8_t sc[64];
+// Signed windows of W bits for scalarbase(). The scalar is split into
+// digits of W bits, taking values between -2^(W-1) and 2^(W-1) - 1. Then
+// res = P0 + 2^W*P1, with P0 = d₀*B + d₂*2^(2W)*B + d₄*2^(4W)*B + ... and P1
+// = d₁*B + d₃*2^(2W)*B + d₅*2^(4W)*B + ... We only need to store the
+// multiples 1..2^(W-1) of 2^(2iW)*B. Negative values are treated by
+// obtaining its corresponding positive value and substracting. A wider
+// window needs fewer point additions but a larger table which is scanned in
+// full for each digit.
+template <int W>
+struct Base_window {
+	enum { digits = (256 + W - 1) / W,
+	       rows = (digits + 1) / 2,
+	       entries = 1 << (W - 1) };
+	// Table of rows*entries precomputed points. table()[i*entries + j-1] is
+	// j*2^(2iW)*B.
+	static const Precomputed * table();
+};
 
-	// Store the scalar in sc with 4 bit limbs, taking values between 0 and
-	// 15.
-	for (int i = 0; i < 32; ++i) {
-		sc[2*i]     = scalar[i] & 0xF;
-		sc[2*i + 1] = scalar[i] >> 4;
+// The table with W=4 has been created offline with write_base_multiples().
+template <>
+const Precomputed * Base_window<4>::table()
+{
+	return &basemult[0][0];
+}
+
+// The other tables are computed the first time that they are used. The
+// table is stored in block starting at a 64 byte boundary. A row of
+// 2^(W-1) entries of 120 bytes fills then a whole number of cache lines.
+template <int W>
+static const Precomputed * build_base_table (std::vector<char> &block)
+{
+	typedef Base_window<W> Bw;
+	uintptr_t p = ((uintptr_t) &block[0] + 63) & ~uintptr_t(63);
+	Precomputed *tab = (Precomputed*) p;
+	Edwards base = edwards_base;   // 2^(2iW)*B
+	Edwards mult[Bw::entries];
+	Fe acc[Bw::entries];
+	for (int i = 0; i < Bw::rows; ++i) {
+		mult[0] = base;
+		acc[0] = base.z;
+		for (int j = 1; j < Bw::entries; ++j) {
+			point_add (mult[j], mult[j-1], base);
+			mul (acc[j], acc[j-1], mult[j].z);
+		}
+		// A single inversion for the whole row.
+		Fe inv, zinv;
+		invert (inv, acc[Bw::entries - 1]);
+		for (int j = Bw::entries - 1; j > 0; --j) {
+			mul (zinv, inv, acc[j-1]);
+			mul (inv, inv, mult[j].z);
+			edwards_to_precomp (tab[i*Bw::entries + j], mult[j], zinv);
+		}
+		edwards_to_precomp (tab[i*Bw::entries], mult[0], inv);
+		for (int k = 0; k < 2*W; ++k) {
+			point_double (base, base);
+		}
 	}
+	return tab;
+}
+
+template <int W>
+const Precomputed * Base_window<W>::table()
+{
+	// Initialization of local statics is thread safe.
+	static std::vector<char> block (rows * entries * sizeof(Precomputed) + 63);
+	static const Precomputed *tab = build_base_table<W> (block);
+	return tab;
+}
 
-	// Store the scalar in sc with limbs taking values between -8 and +7.
-	int8_t carry = 0;
-	for (int i = 0; i < 64; ++i) {
-		sc[i] += carry;
-		// Set carry to 1 if sc[i] >= 8
-		carry = (sc[i] + 8) >> 4;
-		// Substract 16 if sc[i] >= 8
-		sc[i] -= carry << 4;
+// Select the correct multiple and sign. It returns res = smult*row[0].
+template <int W>
+static void compute_multiple (Precomputed &res, int32_t smult, const Precomputed *row)
+{
+	uint32_t negative = uint32_t(smult) >> 31;    // Only 1 or 0.
+	uint32_t mult = iabs (smult);
+	res = { feone, feone, fezero };  // Zero element.
+	// Load the multiple corresponding to the absolute value. When mult is
+	// zero mult - 1 does not match any entry.
+	select_scan (res, row, Base_window<W>::entries, mult - 1);
+	// Compute the negative of the multiple.
+	Precomputed neg;
+	neg.ypx = res.ymx;
+	neg.ymx = res.ypx;
+	negate (neg.xy2d, res.xy2d);
+	// Select the negative one if smult < 0.
+	select (res, neg, negative);
+}
+
+// Store the scalar in sc as signed digits of W bits. Return the final
+// carry.
+template <int W>
+static uint32_t recode_base (int32_t sc[], const uint8_t scalar[32])
+{
+	int32_t carry = 0;
+	for (int i = 0; i < Base_window<W>::digits; ++i) {
+		int pos = i * W;
+		uint32_t bits = scalar[pos/8];
+		if (pos/8 + 1 < 32) {
+			bits |= uint32_t(scalar[pos/8 + 1]) << 8;
+		}
+		int32_t d = (bits >> (pos & 7)) & ((1 << W) - 1);
+		d += carry;
+		// Set carry to 1 if d >= 2^(W-1) and substract 2^W.
+		carry = (d + (1 << (W - 1))) >> W;
+		sc[i] = d - (carry << W);
 	}
 	// Carry may still be 1 if we have the most significant bit of the scalar
 	// set. This does not happen in pure X25519/Ed25519 but we allow scalars
-	// of 256 bits. If carry is set we need to add base^2²⁵⁶ at the  end.
+	// of 256 bits. If carry is set we need to add base^2²⁵⁶ at the end. This
+	// can only happen if the digits cover exactly 256 bits. Otherwise the
+	// last digit is too small to produce a carry.
+	return carry;
+}
 
-	// Now compute res = P0 + 16P1, with P0 = sc₀*16⁰B + sc₂*16²B + sc₄*16⁴B
-	// + sc₆*16⁶B + ... + sc₆₂*16⁶²B and P1 = sc₁*16⁰B + sc₃*16²B + sc₅*16⁴B
-	// + sc₇*16⁶B + ... + sc₆₃*16⁶²B. Note that we only need to store the
-	// multiples of 16^i*B where i is even. Furthermore we just store the
-	// positive values. Negative values are treated by obtaining its
-	// corresponding positive value and substracting.
+template <int W>
+static void scalarbase_w (Edwards &res, const uint8_t scalar[32])
+{
+	typedef Base_window<W> Bw;
+	int32_t sc[Bw::digits];
+	uint32_t carry = recode_base<W> (sc, scalar);
+	const Precomputed *tab = Bw::table();
 
 	// Set res to carry * base^2²⁵⁶ as the initial value. Using this initial
 	// value we do not need to do anything else to support 256 bits.
@@ -954,19 +1083,211 @@ void scalarbase (Edwards &res, const uint8_t scalar[32])
 
 	Edwards res1 = edzero;
 	Precomputed tmp;
-	for (int i = 0; i < 32; ++i) {
-		compute_multiple (tmp, sc[i*2], i);
+	for (int i = 0; i < Bw::rows; ++i) {
+		compute_multiple<W> (tmp, sc[i*2], tab + i*Bw::entries);
 		point_add (res, res, tmp);
-		compute_multiple (tmp, sc[i*2 + 1], i);
-		point_add (res1, res1, tmp);
+		if (i*2 + 1 < Bw::digits) {
+			compute_multiple<W> (tmp, sc[i*2 + 1], tab + i*Bw::entries);
+			point_add (res1, res1, tmp);
+		}
+	}
+	for (int k = 0; k < W; ++k) {
+		point_double (res1, res1);  // *2^W
 	}
-	point_double (res1, res1);  // *2
-	point_double (res1, res1);  // *4
-	point_double (res1, res1);  // *8
-	point_double (res1, res1);  // *16
 	point_add (res, res, res1);
 }
 
+#ifndef AMBER_BASE_WINDOW
+	#define AMBER_BASE_WINDOW 4
+#endif
+
+void scalarbase (Edwards &res, const uint8_t scalar[32])
+{
+	scalarbase_w<AMBER_BASE_WINDOW> (res, scalar);
+}
+
+void scalarbase_window (Edwards &res, const uint8_t scalar[32], int w)
+{
+	switch (w) {
+	case 4: scalarbase_w<4> (res, scalar);  break;
+	case 5: scalarbase_w<5> (res, scalar);  break;
+	case 6: scalarbase_w<6> (res, scalar);  break;
+	case 8: scalarbase_w<8> (res, scalar);  break;
+	default:
+		throw std::invalid_argument (_("Unsupported window width for scalarbase."));
+	}
+}
+
+size_t base_table_size (int w)
+{
+	switch (w) {
+	case 4: return Base_window<4>::rows * Base_window<4>::entries * sizeof(Precomputed);
+	case 5: return Base_window<5>::rows * Base_window<5>::entries * sizeof(Precomputed);
+	case 6: return Base_window<6>::rows * Base_window<6>::entries * sizeof(Precomputed);
+	case 8: return Base_window<8>::rows * Base_window<8>::entries * sizeof(Precomputed);
+	}
+	return 0;
+}
+
+
+
+// Four independent base multiplications using the lanes of Fe4.
+
+#ifdef AMBER_FE4
+
+struct Edwards4 {
+	Fe4 x, y, z, t;
+};
+
+struct Precomputed4 {
+	Fe4 ypx, ymx, xy2d;
+};
+
+inline void pack (Edwards4 &res, const Edwards p[4])
+{
+	pack (res.x, p[0].x, p[1].x, p[2].x, p[3].x);
+	pack (res.y, p[0].y, p[1].y, p[2].y, p[3].y);
+	pack (res.z, p[0].z, p[1].z, p[2].z, p[3].z);
+	pack (res.t, p[0].t, p[1].t, p[2].t, p[3].t);
+}
+
+inline void unpack (Edwards out[4], const Edwards4 &e)
+{
+	Fe tmp[4];
+	unpack (tmp, e.x);
+	for (int i = 0; i < 4; ++i) out[i].x = tmp[i];
+	unpack (tmp, e.y);
+	for (int i = 0; i < 4; ++i) out[i].y = tmp[i];
+	unpack (tmp, e.z);
+	for (int i = 0; i < 4; ++i) out[i].z = tmp[i];
+	unpack (tmp, e.t);
+	for (int i = 0; i < 4; ++i) out[i].t = tmp[i];
+}
+
+inline void pack (Precomputed4 &res, const Precomputed p[4])
+{
+	pack (res.ypx, p[0].ypx, p[1].ypx, p[2].ypx, p[3].ypx);
+	pack (res.ymx, p[0].ymx, p[1].ymx, p[2].ymx, p[3].ymx);
+	pack (res.xy2d, p[0].xy2d, p[1].xy2d, p[2].xy2d, p[3].xy2d);
+}
+
+// The same formulae as for Edwards, in four lanes.
+inline void point_add (Edwards4 &res, const Edwards4 &p, const Edwards4 &q)
+{
+	Fe4 a, b, c, d, e, f, g, h, t, d2;
+
+	pack (d2, edwards_2d, edwards_2d, edwards_2d, edwards_2d);
+	sub (a, p.y, p.x);
+	sub (t, q.y, q.x);
+	mul (a, a, t);
+	add_no_reduce (b, p.x, p.y);
+	add_no_reduce (t, q.x, q.y);
+	mul (b, b, t);
+	mul (c, p.t, q.t);
+	mul (c, c, d2);
+	mul (d, p.z, q.z);
+	add_no_reduce (d, d, d);
+	sub (e, b, a);
+	sub (f, d, c);
+	add_no_reduce (g, d, c);
+	add_no_reduce (h, b, a);
+
+	mul (res.x, e, f);
+	mul (res.y, h, g);
+	mul (res.t, e, h);
+	mul (res.z, f, g);
+}
+
+inline void point_add (Edwards4 &res, const Edwards4 &p, const Precomputed4 &q)
+{
+	Fe4 a, b, c, d, e, f, g, h;
+
+	sub (a, p.y, p.x);
+	mul (a, a, q.ymx);
+	add_no_reduce (b, p.x, p.y);
+	mul (b, b, q.ypx);
+	mul (c, p.t, q.xy2d);
+	add_no_reduce (d, p.z, p.z);
+	sub (e, b, a);
+	sub (f, d, c);
+	add_no_reduce (g, d, c);
+	add_no_reduce (h, b, a);
+
+	mul (res.x, e, f);
+	mul (res.y, h, g);
+	mul (res.t, e, h);
+	mul (res.z, f, g);
+}
+
+inline void point_double (Edwards4 &res, const Edwards4 &p)
+{
+	Fe4 a, b, c, h, e, g, f;
+	square (a, p.x);
+	square (b, p.y);
+	square (c, p.z);
+	add (c, c, c);
+	add (h, a, b);
+	add_no_reduce (e, p.x, p.y);
+	square (e, e);
+	sub (e, h, e);
+	sub (g, a, b);
+	add_no_reduce (f, c, g);
+	mul (res.x, e, f);
+	mul (res.y, g, h);
+	mul (res.t, e, h);
+	mul (res.z, f, g);
+}
+
+#endif
+
+
+// Same as scalarbase() in each lane. The table lookups are done one lane at
+// a time, the point arithmetic is done in the four lanes at once.
+void scalarbase_x4 (Edwards res[4], const uint8_t *const scalar[4])
+{
+#ifdef AMBER_FE4
+	typedef Base_window<AMBER_BASE_WINDOW> Bw;
+	int32_t sc[4][Bw::digits];
+	const Precomputed *tab = Bw::table();
+	for (int k = 0; k < 4; ++k) {
+		uint32_t carry = recode_base<AMBER_BASE_WINDOW> (sc[k], scalar[k]);
+		res[k] = edzero;
+		select (res[k], bm, carry);
+	}
+
+	Edwards4 r0, r1;
+	pack (r0, res);
+	Edwards zeros[4] = { edzero, edzero, edzero, edzero };
+	pack (r1, zeros);
+
+	Precomputed tmp[4];
+	Precomputed4 tmp4;
+	for (int i = 0; i < Bw::rows; ++i) {
+		for (int k = 0; k < 4; ++k) {
+			compute_multiple<AMBER_BASE_WINDOW> (tmp[k], sc[k][i*2], tab + i*Bw::entries);
+		}
+		pack (tmp4, tmp);
+		point_add (r0, r0, tmp4);
+		if (i*2 + 1 < Bw::digits) {
+			for (int k = 0; k < 4; ++k) {
+				compute_multiple<AMBER_BASE_WINDOW> (tmp[k], sc[k][i*2 + 1], tab + i*Bw::entries);
+			}
+			pack (tmp4, tmp);
+			point_add (r1, r1, tmp4);
+		}
+	}
+	for (int k = 0; k < AMBER_BASE_WINDOW; ++k) {
+		point_double (r1, r1);
+	}
+	point_add (r0, r0, r1);
+	unpack (res, r0);
+#else
+	for (int k = 0; k < 4; ++k) {
+		scalarbase (res[k], scalar[k]);
+	}
+#endif
+}
+
 
 // Reduce taken from Tweet NaCl.
 
@@ -1369,20 +1690,25 @@ static const Summand base_summands[16] = {
 
 // Variable time res = s1*B + s2*P, where B is the base point.
 
-void scalarmult_wnaf (Edwards &res, const uint8_t s1[32],
-                      const Edwards &p, const uint8_t s2[32])
+// mulp[i] = (2i+1)*p for i in [0,n[.
+static void odd_multiples (Summand mulp[], const Edwards &p, int n)
 {
-	int8_t d1[257], d2[257];
-	compute_naf_window (d1, s1, 6);
-	compute_naf_window (d2, s2, 5);
-
 	Edwards p2;
-	Summand mulp[8];
 	edwards_to_summand (mulp[0], p);
 	point_double (p2, p);
-	for (int i = 1; i < 8; ++i) {
+	for (int i = 1; i < n; ++i) {
 		point_add (mulp[i], mulp[i-1], p2);
 	}
+}
+
+// res = s1*B + s2*P. mulp contains the odd multiples of P as computed by
+// odd_multiples() for a window of w bits, 2^(w-2) entries.
+static void scalarmult_wnaf (Edwards &res, const uint8_t s1[32],
+                             const Summand mulp[], int w, const uint8_t s2[32])
+{
+	int8_t d1[257], d2[257];
+	compute_naf_window (d1, s1, 6);
+	compute_naf_window (d2, s2, w);
 
 	res = edzero;
 	for (int j = 256; j >= 0; --j) {
@@ -1400,6 +1726,14 @@ void scalarmult_wnaf (Edwards &res, const uint8_t s1[32],
 	}
 }
 
+void scalarmult_wnaf (Edwards &res, const uint8_t s1[32],
+                      const Edwards &p, const uint8_t s2[32])
+{
+	Summand mulp[8];
+	odd_multiples (mulp, p, 8);
+	scalarmult_wnaf (res, s1, mulp, 5, s2);
+}
+
 
 
 
@@ -2333,6 +2667,25 @@ void cu25519_sign (const char *prefix, const uint8_t *m, size_t mlen,
 	modL (sig + 32, x);
 }
 
+// rhram = H(prefix0, R, A, m) mod L
+static void verify_hram (uint8_t rhram[32], const char *prefix,
+                         const uint8_t *m, size_t mlen, const uint8_t sig[64],
+                         const Cu25519Ris &A)
+{
+	uint8_t hram[64];
+	blake2b_ctx bs;
+	blake2b_init (&bs, 64, NULL, 0);
+	if (prefix != NULL) {
+		size_t n = strlen (prefix);
+		blake2b_update (&bs, prefix, n + 1);    // Include terminating null to establish a unique prefix.
+	}
+	blake2b_update (&bs, sig, 32);
+	blake2b_update (&bs, A.b, 32);
+	blake2b_update (&bs, m, mlen);
+	blake2b_final (&bs, hram);
+	reduce (rhram, hram);
+}
+
 int cu25519_verify (const char *prefix, const uint8_t *m, size_t mlen,
                     const uint8_t sig[64], const Cu25519Ris &A)
 {
@@ -2347,30 +2700,109 @@ int cu25519_verify (const char *prefix, const uint8_t *m, size_t mlen,
 	}
 	negate (p, p);
 
-	uint8_t hram[64];
-	blake2b_ctx bs;
-	blake2b_init (&bs, 64, NULL, 0);
-	if (prefix != NULL) {
-		size_t n = strlen (prefix);
-		blake2b_update (&bs, prefix, n + 1);    // Include terminating null to establish a unique prefix.
+	uint8_t rhram[32];
+	verify_hram (rhram, prefix, m, mlen, sig, A);
+
+	Edwards newr;
+	// R = SB - hA
+	scalarmult_wnaf (newr, sig + 32, p, rhram);
+	uint8_t newrp[32];
+	edwards_to_ristretto (newrp, newr);
+
+	return crypto_neq (sig, newrp, 32);
+}
+
+
+// Window used for the multiples of the key. 2^6 odd multiples take 10 KB
+// with Fe64. The extra additions to compute them are recovered after a few
+// verifications.
+enum { verifier_window = 8, verifier_mults = 1 << (verifier_window - 2) };
+
+struct Cu25519_verifier::Data {
+	Cu25519Ris key;
+	bool valid;
+	Summand mulp[verifier_mults];   // Odd multiples of -A.
+};
+
+Cu25519_verifier::Cu25519_verifier (const Cu25519Ris &A)
+	: data (new Data)
+{
+	data->key = A;
+	Edwards p;
+	data->valid = ristretto_to_edwards (p, A.b) == 0;
+	if (data->valid) {
+		negate (p, p);
+		odd_multiples (data->mulp, p, verifier_mults);
+	}
+}
+
+Cu25519_verifier::~Cu25519_verifier() {}
+
+const Cu25519Ris & Cu25519_verifier::key() const
+{
+	return data->key;
+}
+
+int Cu25519_verifier::verify (const char *prefix, const uint8_t *m, size_t mlen,
+                              const uint8_t sig[64]) const
+{
+	if (!data->valid || !gt_than (order, sig + 32)) {
+		return -1;
 	}
-	blake2b_update (&bs, sig, 32);
-	blake2b_update (&bs, A.b, 32);
-	blake2b_update (&bs, m, mlen);
-	blake2b_final (&bs, hram);
 
 	uint8_t rhram[32];
-	reduce (rhram, hram);
+	verify_hram (rhram, prefix, m, mlen, sig, data->key);
 
 	Edwards newr;
 	// R = SB - hA
-	scalarmult_wnaf (newr, sig + 32, p, rhram);
+	scalarmult_wnaf (newr, sig + 32, data->mulp, verifier_window, rhram);
 	uint8_t newrp[32];
 	edwards_to_ristretto (newrp, newr);
 
 	return crypto_neq (sig, newrp, 32);
 }
 
+
+// The most recently used verifiers are at the front. The list is short and
+// a linear search is negligible compared to a verification.
+enum { verifier_cache_size = 16 };
+static std::mutex verifier_cache_mtx;
+static std::list<std::shared_ptr<const Cu25519_verifier> > verifier_cache;
+
+int cu25519_verify_cached (const char *prefix, const uint8_t *m, size_t mlen,
+                           const uint8_t sig[64], const Cu25519Ris &A)
+{
+	std::shared_ptr<const Cu25519_verifier> ver;
+	{
+		std::lock_guard<std::mutex> lk(verifier_cache_mtx);
+		auto i = verifier_cache.begin();
+		while (i != verifier_cache.end() && memcmp ((*i)->key().b, A.b, 32) != 0) {
+			++i;
+		}
+		if (i != verifier_cache.end()) {
+			verifier_cache.splice (verifier_cache.begin(), verifier_cache, i);
+			ver = verifier_cache.front();
+		}
+	}
+	if (!ver) {
+		// Build it without holding the lock. Another thread may insert the
+		// same key meanwhile, which only wastes a slot.
+		ver = std::make_shared<const Cu25519_verifier> (A);
+		std::lock_guard<std::mutex> lk(verifier_cache_mtx);
+		verifier_cache.push_front (ver);
+		if (verifier_cache.size() > verifier_cache_size) {
+			verifier_cache.pop_back();
+		}
+	}
+	return ver->verify (prefix, m, mlen, sig);
+}
+
+void clear_verifier_cache()
+{
+	std::lock_guard<std::mutex> lk(verifier_cache_mtx);
+	verifier_cache.clear();
+}
+
 void cu25519_generate_no_mask (const Cu25519Sec &scalar, Cu25519Ris *ris)
 {
 	Edwards p;
@@ -2399,16 +2831,10 @@ void cu25519_generate (Cu25519Sec *scalar, Cu25519Ris *ris)
 // format and Bob uses b*A with A in Montgomery format and both produce the
 // same result. Therefore we can mix Ristretto and Montgomery for DH.
 
-static int ristretto_ladder_imp_checked (uint8_t res[32], const Cu25519Ris &A, const uint8_t scalar[32], int startbit=255)
+// Finish the ladder of ristretto_ladder_imp_checked() and store the affine
+// result of fu/fz.
+static int ristretto_ladder_finish_checked (uint8_t res[32], const Fe &fu, const Fe &fz)
 {
-	// s must be even for valid ristretto encodings.
-	if (A.b[0] & 1) return -1;
-	Fe s2;
-	load (s2, A.b);
-	square (s2, s2);
-	Fe fu, fz;
-	montgomery_ladder (fu, fz, s2, scalar, startbit);
-
 	// We multiply by the cofactor. Therefore the result is the result of
 	// doubling a point. In Montgomery coordinates points which are the
 	// result of doubling have the x coordinate square. The invsqrt will
@@ -2423,6 +2849,25 @@ static int ristretto_ladder_imp_checked (uint8_t res[32], const Cu25519Ris &A, c
 	return err;
 }
 
+static void ristretto_ladder_finish_unchecked (uint8_t res[32], Fe fu, Fe fz)
+{
+	invert (fz, fz);
+	mul (fu, fu, fz);
+	reduce_store (res, fu);
+}
+
+static int ristretto_ladder_imp_checked (uint8_t res[32], const Cu25519Ris &A, const uint8_t scalar[32], int startbit=255)
+{
+	// s must be even for valid ristretto encodings.
+	if (A.b[0] & 1) return -1;
+	Fe s2;
+	load (s2, A.b);
+	square (s2, s2);
+	Fe fu, fz;
+	montgomery_ladder (fu, fz, s2, scalar, startbit);
+	return ristretto_ladder_finish_checked (res, fu, fz);
+}
+
 static void ristretto_ladder_imp_unchecked (uint8_t res[32], const Cu25519Ris &A, const uint8_t scalar[32], int startbit=255)
 {
 	// s must be even for valid ristretto encodings.
@@ -2432,9 +2877,7 @@ static void ristretto_ladder_imp_unchecked (uint8_t res[32], const Cu25519Ris &A
 	square (s2, s2);
 	Fe fu, fz;
 	montgomery_ladder (fu, fz, s2, scalar, startbit);
-	invert (fz, fz);
-	mul (fu, fu, fz);
-	reduce_store (res, fu);
+	ristretto_ladder_finish_unchecked (res, fu, fz);
 }
 
 
@@ -2498,6 +2941,86 @@ void cu25519_shared_secret_cof (uint8_t res[32], const Cu25519Ris &A,
 }
 
 
+// Elements [first, last[ of cu25519_shared_secret_batch(). Four elements
+// at a time go through the four lane ladder. A final group of three is
+// padded with a copy of its first element, which is still faster than three
+// single ladders.
+static void shared_secret_range (uint8_t res[][32], const Cu25519Ris A[],
+                                 const Cu25519Sec scalar[], size_t first,
+                                 size_t last, int err[])
+{
+	size_t i = first;
+	while (last - i >= 3) {
+		size_t idx[4];
+		for (int j = 0; j < 4; ++j) {
+			idx[j] = i + j < last ? i + j : i;
+		}
+		Fe s2[4], fu[4], fz[4];
+		const uint8_t *sc[4];
+		for (int j = 0; j < 4; ++j) {
+			load (s2[j], A[idx[j]].b);
+			square (s2[j], s2[j]);
+			sc[j] = scalar[idx[j]].b;
+		}
+		montgomery_ladder_x4 (fu, fz, s2, sc, 255);
+		int nl = last - i < 4 ? 3 : 4;
+		for (int j = 0; j < nl; ++j) {
+			if (err) {
+				err[i + j] = ristretto_ladder_finish_checked (res[i + j], fu[j], fz[j]);
+				if (A[i + j].b[0] & 1) err[i + j] = -1;
+			} else {
+				ristretto_ladder_finish_unchecked (res[i + j], fu[j], fz[j]);
+			}
+		}
+		i += nl;
+	}
+	for (; i < last; ++i) {
+		if (err) {
+			err[i] = ristretto_ladder_imp_checked (res[i], A[i], scalar[i].b);
+		} else {
+			ristretto_ladder_imp_unchecked (res[i], A[i], scalar[i].b);
+		}
+	}
+}
+
+int cu25519_shared_secret_batch (uint8_t res[][32], const Cu25519Ris A[],
+                                 const Cu25519Sec scalar[], size_t n,
+                                 int err[], unsigned nthreads)
+{
+	size_t ngroups = (n + 3) / 4;
+	if (nthreads == 0) {
+		nthreads = std::thread::hardware_concurrency();
+	}
+	if (nthreads > ngroups) {
+		nthreads = ngroups;
+	}
+	if (nthreads <= 1) {
+		shared_secret_range (res, A, scalar, 0, n, err);
+	} else {
+		// Each thread gets a whole number of groups of four. The calling
+		// thread takes the first share.
+		size_t share = (ngroups + nthreads - 1) / nthreads * 4;
+		std::vector<std::thread> pool;
+		for (size_t first = share; first < n; first += share) {
+			pool.emplace_back (shared_secret_range, res, A, scalar, first,
+			                   std::min (first + share, n), err);
+		}
+		shared_secret_range (res, A, scalar, 0, std::min (share, n), err);
+		for (size_t i = 0; i < pool.size(); ++i) {
+			pool[i].join();
+		}
+	}
+
+	int nfail = 0;
+	if (err) {
+		for (size_t i = 0; i < n; ++i) {
+			if (err[i] != 0) ++nfail;
+		}
+	}
+	return nfail;
+}
+
+
 void cu25519_shared_secret (uint8_t sh[32], const Cu25519Mon &mon,
                             const Cu25519Sec &scalar)
 {
@@ -32,6 +32,7 @@
 #include "field25519.hpp"
 #include "symmetric.hpp"
 #include <string.h>
+#include <memory>
 
 
 namespace amber {  inline namespace AMBER_SONAME {
@@ -143,6 +144,21 @@ EXPORTFN std::ostream & operator<< (std::ostream &os, const Edwards &rhs);
 // time. Works with scalars of 256 bits. Very fast.
 EXPORTFN void scalarbase (Edwards &res, const uint8_t scalar[32]);
 
+// The window width of scalarbase() is selected at build time by defining
+// AMBER_BASE_WINDOW to 4 (the default), 5, 6 or 8. Wider windows need fewer
+// point additions but larger tables. The table for 4 bits is built into the
+// library. The others are computed at the first call. scalarbase_window()
+// uses the given width, independently of AMBER_BASE_WINDOW, and
+// base_table_size() returns the size in bytes of its table. They allow the
+// comparison of the different widths. Unsupported widths throw
+// std::invalid_argument.
+EXPORTFN void scalarbase_window (Edwards &res, const uint8_t scalar[32], int w);
+EXPORTFN size_t base_table_size (int w);
+
+// Four independent base multiplications, res[i] = scalar[i]*B. Constant
+// time. With AVX2 the point arithmetic of the four lanes is done at once.
+EXPORTFN void scalarbase_x4 (Edwards res[4], const uint8_t *const scalar[4]);
+
 // General scalar multiplication with variable base. Constant time. Works
 // with scalars of 256 bits. Simple, but slow.
 EXPORTFN void scalarmult (Edwards &res, const Edwards &p, const uint8_t s[32]);
@@ -395,6 +411,17 @@ cu25519_shared_secret_cof_unchecked (uint8_t res[32], const Cu25519Ris &A,
 EXPORTFN void cu25519_shared_secret_cof (uint8_t res[32], const Cu25519Ris &A,
                                          const Cu25519Sec &scalar);
 
+// Compute n independent shared secrets res[i] = scalar[i]*A[i]. If err is
+// not NULL each element is checked as in cu25519_shared_secret_checked()
+// and its status is stored in err[i]. If err is NULL there are no checks,
+// as in cu25519_shared_secret_unchecked(). Groups of four elements use the
+// four lane ladder and the groups are split among nthreads threads (0
+// selects one per core). Each element is processed in constant time.
+// Return the number of elements that failed the checks.
+EXPORTFN int cu25519_shared_secret_batch (uint8_t res[][32], const Cu25519Ris A[],
+                                          const Cu25519Sec scalar[], size_t n,
+                                          int err[] = NULL, unsigned nthreads = 0);
+
 
 // SIGNATURES
 
@@ -414,6 +441,29 @@ EXPORTFN int cu25519_verify (const char *prefix, const uint8_t *m,
                              size_t mlen, const uint8_t sig[64],
                              const Cu25519Ris &A);
 
+// Verification of many signatures made with the same key A. The constructor
+// decodes A and precomputes a wider window of its multiples. Each verify()
+// is then cheaper than cu25519_verify(). verify() returns the same as
+// cu25519_verify(), which includes failing if A is not a valid point.
+class EXPORTFN Cu25519_verifier {
+	struct Data;
+	std::unique_ptr<Data> data; // pimpl idiom.
+public:
+	explicit Cu25519_verifier (const Cu25519Ris &A);
+	~Cu25519_verifier();
+	int verify (const char *prefix, const uint8_t *m, size_t mlen,
+	            const uint8_t sig[64]) const;
+	const Cu25519Ris & key() const;
+};
+
+// Same as cu25519_verify() but uses a Cu25519_verifier from a small cache
+// of the most recently used keys. Thread safe. clear_verifier_cache()
+// releases the cached keys.
+EXPORTFN int cu25519_verify_cached (const char *prefix, const uint8_t *m,
+                                    size_t mlen, const uint8_t sig[64],
+                                    const Cu25519Ris &A);
+EXPORTFN void clear_verifier_cache();
+
 
 // Verify a ristretto signature using qDSA and Montgomery, no Edwards
 // arithmetic. Return 0 on success.
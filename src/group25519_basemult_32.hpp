@@ -1,4 +1,4 @@
-static const Precomputed basemult[32][8] = {
+alignas(64) static const Precomputed basemult[32][8] = {
  { // 16^0*B
    { // 1*16^0*B
      { 0x18c3b85, 0x124f1bd, 0x1c325f7, 0x037dc60, 0x33e4cb7, 0x03d42c2, 0x1a44c32, 0x14ca4e1, 0x3a33d4b, 0x01f3e74 },
@@ -1,4 +1,4 @@
-static const Precomputed basemult[32][8] = {
+alignas(64) static const Precomputed basemult[32][8] = {
  { // 16^0*B
    { // 1*16^0*B
      { 0x493c6f58c3b85, 0xdf7181c325f7, 0xf50b0b3e4cb7, 0x5329385a44c32, 0x7cf9d3a33d4b,  },
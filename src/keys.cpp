@@ -34,9 +34,24 @@
 #include "misc.hpp"
 #include "hasopt.hpp"
 #include "protobuf.hpp"
+#include "siphash24.hpp"
 #include <time.h>
 #include <algorithm>
+#include <unordered_set>
+#include <thread>
+#include <fstream>
+#include <iomanip>
+#include <iterator>
+#include <memory>
 #include <assert.h>
+#ifndef _WIN32
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <limits.h>
+#endif
 
 namespace amber { namespace AMBER_SONAME {
 
@@ -137,41 +152,70 @@ void list_keys(const Key_list &kl, std::ostream &os, bool pubonly, bool sigs,
 }
 
 
+size_t Cu25519Ris_hash::operator() (const Cu25519Ris &k) const
+{
+	return siphash24 (k.b, 32);
+}
+
+
+void Key_list::rebuild() const
+{
+	index.clear();
+	index.reserve (keys.size());
+	for (size_t i = 0; i < keys.size(); ++i) {
+		// emplace keeps the first key if there are duplicates.
+		index.emplace (keys[i].pair.xp, i);
+	}
+	stale = false;
+}
+
+void Key_list::push_back (const Key &k)
+{
+	keys.push_back (k);
+	if (!stale) {
+		index.emplace (k.pair.xp, keys.size() - 1);
+	}
+	names_stale = true;
+}
+
+const Key * Key_list::find (const Cu25519Ris &pub) const
+{
+	if (stale) {
+		rebuild();
+	}
+	Index::const_iterator i = index.find (pub);
+	return i == index.end() ? NULL : &keys[i->second];
+}
+
+
 // If the key is not present insert it. If it is present and the name is
 // identical then add the signatures that are not already present.
 
 bool insert_key(Key_list &kl, const Key &k, bool force)
 {
-	Key_list::iterator i = kl.begin();
-	Key_list::iterator e = kl.end();
-	while (i != e) {
-		if (memcmp (i->pair.xp.b, k.pair.xp.b, 32) == 0) {
-			if (force) {
-				*i = k;
-			} else if (i->name == k.name) {
-				for (auto j = k.sigs.begin(); j != k.sigs.end(); ++j) {
-					bool found = false;
-					for (auto u = i->sigs.begin(); u != i->sigs.end(); ++u) {
-						if (memcmp(j->signer.b, u->signer.b, 32) == 0) {
-							found = true;
-							break;
-						}
-					}
-					if (!found) {
-						i->sigs.push_back(*j);
-					}
-				}
-			}
-			if (k.secret_avail && !i->secret_avail) {
-				memcpy (i->pair.xs.b, k.pair.xs.b, 32);
-				i->secret_avail = true;
+	Key *i = kl.find (k.pair.xp);
+	if (!i) {
+		kl.push_back(k);
+		return true;
+	}
+	if (force) {
+		*i = k;
+	} else if (i->name == k.name && !k.sigs.empty()) {
+		std::unordered_set<Cu25519Ris, Cu25519Ris_hash, Cu25519Ris_equal> signers;
+		for (auto u = i->sigs.begin(); u != i->sigs.end(); ++u) {
+			signers.insert (u->signer);
+		}
+		for (auto j = k.sigs.begin(); j != k.sigs.end(); ++j) {
+			if (signers.insert (j->signer).second) {
+				i->sigs.push_back(*j);
 			}
-			return false;
 		}
-		++i;
 	}
-	kl.push_back(k);
-	return true;
+	if (k.secret_avail && !i->secret_avail) {
+		memcpy (i->pair.xs.b, k.pair.xs.b, 32);
+		i->secret_avail = true;
+	}
+	return false;
 }
 
 
@@ -237,137 +281,407 @@ bool assign_valid_sigs(Key &key, const std::vector<Signature> &sigs, std::string
 
 
 
-enum { top_key };
+// A key ring is a sequence of top_key records. New keys and new
+// certifications of existing keys may be appended later as more top_key
+// records. top_padding is ignored.
+enum { top_key, top_padding };
 enum { key_pub, key_sec, key_name, key_sig, key_alias, key_time, key_master, key_self_sig };
 enum { key_sig_signer, key_sig_signature };
 
 
 
+// Options for writing a key with Key_schema.
+enum { key_pub_only = 1 };
+
+struct Key_pub_field : Pb_field<key_pub, Protobuf_reader::needed_once> {
+	static bool match (uint32_t tagwt) { return tagwt == maketag (key_pub, length_val); }
+	static void write (Protobuf_writer &pw, const Key &k, unsigned) {
+		pw.write_bytes (key_pub, k.pair.xp.b, 32);
+	}
+	static void read (Protobuf_reader &pr, Key &k, uint32_t, uint64_t val) {
+		if (val != 32) {
+			throw_rte (_("The public key must have 32 bytes. Got %d."), val);
+		}
+		pr.get_bytes (k.pair.xp.b, 32);
+	}
+};
+
+struct Key_sec_field : Pb_field<key_sec, Protobuf_reader::optional_once> {
+	static bool match (uint32_t tagwt) { return tagwt == maketag (key_sec, length_val); }
+	static void write (Protobuf_writer &pw, const Key &k, unsigned opts) {
+		if (k.secret_avail && !(opts & key_pub_only)) {
+			pw.write_bytes (key_sec, k.pair.xs.b, 32);
+		}
+	}
+	static void read (Protobuf_reader &pr, Key &k, uint32_t, uint64_t val) {
+		if (val != 32) {
+			throw_rte (_("The secret key must be 32 bytes long. Got %d."), val);
+		}
+		pr.get_bytes (k.pair.xs.b, 32);
+		k.secret_avail = true;
+	}
+};
+
+struct Sig_signer_field : Pb_field<key_sig_signer, Protobuf_reader::needed_once> {
+	static bool match (uint32_t tagwt) { return tagwt == maketag (key_sig_signer, length_val); }
+	static void write (Protobuf_writer &pw, const Signature &sig, unsigned) {
+		pw.write_bytes (key_sig_signer, sig.signer.b, 32);
+	}
+	static void read (Protobuf_reader &pr, Signature &sig, uint32_t, uint64_t val) {
+		if (val != 32) {
+			throw_rte (_("The signer must be 32 bytes long. Got %d."), val);
+		}
+		pr.get_bytes (sig.signer.b, 32);
+	}
+};
+
+typedef Pb_schema<Signature,
+	Sig_signer_field,
+	Pb_bytes<key_sig_signature, Protobuf_reader::needed_once, Signature, 64, &Signature::signature>
+> Signature_schema;
+
+// The creation time is assumed to be in the POSIX encoding of seconds
+// since 1970-1-1.
+typedef Pb_schema<Key,
+	Key_pub_field,
+	Key_sec_field,
+	Pb_string<key_name, Protobuf_reader::needed_once, Key, &Key::name>,
+	Pb_string<key_alias, Protobuf_reader::optional_once, Key, &Key::alias>,
+	Pb_uint<key_time, Protobuf_reader::optional_many, Key, time_t, &Key::creation_time>,
+	Pb_uint<key_master, Protobuf_reader::needed_once, Key, bool, &Key::master>,
+	Pb_bytes<key_self_sig, Protobuf_reader::needed_once, Key, 64, &Key::self_signature>,
+	Pb_group_list<key_sig, Protobuf_reader::optional_many, Key, Signature, &Key::sigs, Signature_schema>
+> Key_schema;
+
+
 void read_single_key (Protobuf_reader &pr, Key &k, bool recalc)
 {
-	std::vector<Signature> sigs;
-	Signature sig;
-
-	pr.add_requirement (key_pub,      pr.needed_once,
-	                    key_sec,      pr.optional_once,
-	                    key_name,     pr.needed_once,
-	                    key_alias,    pr.optional_once,
-	                    key_master,   pr.needed_once,
-	                    key_self_sig, pr.needed_once,
-	                    key_sig,      pr.optional_many);
 	k.clear();
 	memset(k.pair.xp.b, 0, 32);
 	memset(k.pair.xs.b, 0, 32);
 
-	uint32_t tagwt;
-	uint64_t val;
+	Key_schema::read (pr, k);
 
-	while (pr.read_tagval (&tagwt, &val)) {
-		switch (tagwt) {
-		case maketag (key_pub, length_val):
-			if (val != 32) {
-				throw_rte (_("The public key must have 32 bytes. Got %d."), val);
-			}
-			pr.get_bytes (k.pair.xp.b, 32);
-			break;
+	encode_key (k.pair.xp.b, 32, k.enc, false);
+	if (recalc) {
+		std::vector<Signature> sigs = std::move (k.sigs);
+		k.sigs.clear();
+		assign_valid_sigs(k, sigs, NULL);
+	}
+}
+
+
+
+// A certification to be checked by verify_all_sigs().
+struct Sig_job {
+	const Signature *sig;
+	const uint8_t *hash;
+	size_t key;
+};
+
+// Verifying with a Cu25519_verifier pays off from this number of
+// signatures made by the same signer. group25519_speed shows the setup
+// costing about 35 us and saving 10-15% of a 140 us verification, which
+// breaks even at about three signatures. We leave some margin for slower
+// machines.
+enum { verifier_min_sigs = 6 };
 
-		case maketag (key_sec, length_val):
-			if (val != 32) {
-				throw_rte (_("The secret key must be 32 bytes long. Got %d."), val);
+// Check jobs [first, last[, which are sorted by signer, and store the
+// results in ok.
+static void verify_sig_range (const std::vector<Sig_job> &jobs, size_t first,
+                              size_t last, std::vector<char> &ok)
+{
+	size_t i = first;
+	while (i < last) {
+		const Cu25519Ris &signer = jobs[i].sig->signer;
+		size_t run = i + 1;
+		while (run < last && memcmp (jobs[run].sig->signer.b, signer.b, 32) == 0) {
+			++run;
+		}
+		if (run - i >= verifier_min_sigs) {
+			Cu25519_verifier ver (signer);
+			for (; i < run; ++i) {
+				ok[i] = ver.verify (ksigh, jobs[i].hash, 64, jobs[i].sig->signature) == 0;
 			}
-			pr.get_bytes (k.pair.xs.b, 32);
-			k.secret_avail = true;
-			break;
+		} else {
+			for (; i < run; ++i) {
+				ok[i] = cu25519_verify (ksigh, jobs[i].hash, 64, jobs[i].sig->signature, signer) == 0;
+			}
+		}
+	}
+}
 
-		case maketag(key_name, length_val):
-			k.name.resize(val);
-			pr.get_bytes (&k.name[0], val);
-			break;
+// Cache of the certifications already verified in a plaintext keyring.
+// The file holds a MAC, the digest of the keyring when the cache was
+// written and, for each valid certification, the hash of the key's hash,
+// the signer and the signature. Each entry stands for itself, so the
+// entries remain usable when other keys of the ring change. The MAC key is
+// derived from a random secret that is only readable by the user, so
+// somebody who can change the keyring cannot forge the cache. The files
+// live in $XDG_CACHE_HOME/amber or ~/.cache/amber. Any error just disables
+// the cache.
+class Sig_cache {
+	std::string path;
+	uint8_t mac_key[32];
+	uint8_t digest[32];
+	bool current = false;
+	std::unordered_set<std::string> known;
+
+	bool load_secret (const std::string &dir);
+public:
+	enum { entry_size = 32 };
+	Sig_cache (const std::string &ring, const std::string &contents);
+	~Sig_cache() { crypto_bzero (mac_key, sizeof mac_key); }
+
+	// True if the cache was written for these same keyring contents.
+	bool is_current() const { return current; }
+	bool contains (const std::string &entry) const { return known.count (entry) != 0; }
+	// Replace the cache with these entries.
+	void save (const std::vector<std::string> &entries);
+
+	static std::string entry (const uint8_t hash[64], const Signature &sig);
+};
+
+
+std::string Sig_cache::entry (const uint8_t hash[64], const Signature &sig)
+{
+	Blake2b b (entry_size);
+	b.update (hash, 64);
+	b.update (sig.signer.b, 32);
+	b.update (sig.signature, 64);
+	std::string res (entry_size, 0);
+	b.final (&res[0]);
+	return res;
+}
 
-		case maketag(key_alias, length_val):
-			k.alias.resize (val);
-			pr.get_bytes (&k.alias[0], val);
-			break;
+#ifdef _WIN32
 
-		case maketag(key_time, varint):
-			// We just assume the POSIX encoding of seconds since 1970-1-1.
-			k.creation_time = val;
-			break;
+Sig_cache::Sig_cache (const std::string &, const std::string &) {}
+bool Sig_cache::load_secret (const std::string &) { return false; }
+void Sig_cache::save (const std::vector<std::string> &) {}
 
-		case maketag(key_master, varint):
-			k.master = val;
-			break;
+#else
 
-		case maketag (key_self_sig, length_val):
-			if (val != 64) {
-				throw_rte (_("The self signature must be 64 bytes long. Got %d."), val);
+// Read the secret of the cache, creating it if it does not exist yet, and
+// derive the MAC key from it.
+bool Sig_cache::load_secret (const std::string &dir)
+{
+	std::string name = dir + "/secret";
+	uint8_t secret[32];
+	int fd = open (name.c_str(), O_RDONLY);
+	if (fd < 0) {
+		randombytes_buf (secret, 32);
+		fd = open (name.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0600);
+		if (fd >= 0) {
+			bool ok = write (fd, secret, 32) == 32;
+			ok = close (fd) == 0 && ok;
+			fd = -1;
+			if (!ok) {
+				unlink (name.c_str());
+				return false;
 			}
-			pr.get_bytes (k.self_signature, 64);
-			break;
+		} else {
+			// Another process may have just created it.
+			fd = open (name.c_str(), O_RDONLY);
+		}
+	}
+	if (fd >= 0) {
+		struct stat st;
+		bool ok = fstat (fd, &st) == 0 && st.st_uid == getuid()
+		          && (st.st_mode & 077) == 0 && read (fd, secret, 32) == 32;
+		close (fd);
+		if (!ok) return false;
+	}
+	static const char info[] = "amber keyring cache";
+	blake2b (mac_key, 32, secret, 32, info, sizeof info - 1);
+	crypto_bzero (secret, 32);
+	return true;
+}
 
-		case maketag  (key_sig, group_len):
-			pr.add_requirement (key_sig_signer, pr.needed_once,
-			                    key_sig_signature, pr.needed_once);
-			while (pr.read_tagval (&tagwt, &val)) {
-			switch (tagwt) {
-				case maketag (key_sig_signer, length_val):
-					if (val != 32) {
-						throw_rte (_("The signer must be 32 bytes long. Got %d."), val);
-					}
-					pr.get_bytes (sig.signer.b, 32);
-					break;
 
-				case maketag (key_sig_signature, length_val):
-					if (val != 64) {
-						throw_rte (_("The signature must be 64 bytes long. Got %d."), val);
-					}
-					pr.get_bytes (sig.signature, 64);
-					break;
+Sig_cache::Sig_cache (const std::string &ring, const std::string &contents)
+{
+	std::string dir;
+	const char *xdg = getenv ("XDG_CACHE_HOME");
+	const char *home = getenv ("HOME");
+	if (xdg && *xdg) {
+		dir = xdg;
+	} else if (home && *home) {
+		dir = std::string (home) + "/.cache";
+	} else {
+		return;
+	}
+	mkdir (dir.c_str(), 0700);
+	dir += "/amber";
+	mkdir (dir.c_str(), 0700);
+
+	char real[PATH_MAX];
+	if (realpath (ring.c_str(), real) == NULL) return;
+	if (!load_secret (dir)) return;
+
+	uint8_t id[16];
+	blake2b (id, sizeof id, mac_key, 32, real, strlen (real));
+	std::ostringstream os;
+	os << dir << "/ring-" << std::hex << std::setfill ('0');
+	for (unsigned i = 0; i < sizeof id; ++i) {
+		os << std::setw (2) << unsigned (id[i]);
+	}
+	path = os.str();
+	blake2b (digest, 32, NULL, 0, contents.data(), contents.size());
+
+	std::ifstream is (path.c_str(), is.binary);
+	std::string data ((std::istreambuf_iterator<char> (is)), std::istreambuf_iterator<char>());
+	if (data.size() < 64 || data.size() % entry_size != 0) return;
+	uint8_t mac[32];
+	blake2b (mac, 32, mac_key, 32, data.data() + 32, data.size() - 32);
+	if (crypto_neq (mac, data.data(), 32)) return;
+
+	current = memcmp (digest, data.data() + 32, 32) == 0;
+	for (size_t i = 64; i < data.size(); i += entry_size) {
+		known.insert (data.substr (i, entry_size));
+	}
+}
+
 
-				default:
-					pr.skip (tagwt, val);
+void Sig_cache::save (const std::vector<std::string> &entries)
+{
+	if (path.empty()) return;
+	std::string data (32, 0);
+	data.append ((const char*)digest, 32);
+	for (const std::string &e : entries) {
+		data += e;
+	}
+	blake2b (&data[0], 32, mac_key, 32, data.data() + 32, data.size() - 32);
+
+	// Write a temporary file and rename it so that concurrent readers
+	// always see a whole file.
+	std::ostringstream tmp;
+	tmp << path << '.' << getpid();
+	std::string tmpname = tmp.str();
+	int fd = open (tmpname.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0) return;
+	bool ok = write (fd, data.data(), data.size()) == ssize_t (data.size());
+	ok = close (fd) == 0 && ok;
+	if (!ok || rename (tmpname.c_str(), path.c_str()) != 0) {
+		unlink (tmpname.c_str());
+	}
+}
+
+#endif
+
+
+// Leave in the signature list of each key only the certifications that are
+// valid. All of them are verified at once, grouped by signer and split among
+// the cores. The signatures that remain keep their order. If cache is not
+// NULL the certifications that it contains are not verified again and the
+// cache is updated with the valid ones.
+static void verify_all_sigs (std::vector<Key> &keys, Sig_cache *cache)
+{
+	std::vector<uint8_t> hashes (keys.size() * 64);
+	std::vector<std::vector<char> > keep (keys.size());
+	std::vector<Sig_job> jobs;
+	std::vector<std::string> entries;
+	for (size_t i = 0; i < keys.size(); ++i) {
+		hash_key (keys[i], &hashes[i * 64]);
+		keep[i].resize (keys[i].sigs.size());
+		for (size_t j = 0; j < keys[i].sigs.size(); ++j) {
+			const Signature &sig = keys[i].sigs[j];
+			if (cache) {
+				std::string e = Sig_cache::entry (&hashes[i * 64], sig);
+				if (cache->contains (e)) {
+					keep[i][j] = true;
+					entries.push_back (e);
+					continue;
 				}
 			}
-			sigs.push_back(sig);
-			break;
-
-		default:
-			pr.skip (tagwt, val);
+			jobs.push_back (Sig_job{&sig, &hashes[i * 64], i});
 		}
 	}
-
-	encode_key (k.pair.xp.b, 32, k.enc, false);
-	if (recalc) {
-		assign_valid_sigs(k, sigs, NULL);
+	std::stable_sort (jobs.begin(), jobs.end(), [](const Sig_job &a, const Sig_job &b) {
+		return memcmp (a.sig->signer.b, b.sig->signer.b, 32) < 0;
+	});
+
+	std::vector<char> ok (jobs.size());
+	unsigned nthreads = std::thread::hardware_concurrency();
+	// Do not start a thread for just a few signatures.
+	if (nthreads > jobs.size() / 16) {
+		nthreads = jobs.size() / 16;
+	}
+	if (nthreads <= 1) {
+		verify_sig_range (jobs, 0, jobs.size(), ok);
 	} else {
-		k.sigs = std::move(sigs);
+		size_t share = (jobs.size() + nthreads - 1) / nthreads;
+		std::vector<std::thread> pool;
+		for (size_t first = share; first < jobs.size(); first += share) {
+			pool.emplace_back (verify_sig_range, std::cref (jobs), first,
+			                   std::min (first + share, jobs.size()), std::ref (ok));
+		}
+		verify_sig_range (jobs, 0, std::min (share, jobs.size()), ok);
+		for (size_t i = 0; i < pool.size(); ++i) {
+			pool[i].join();
+		}
 	}
-}
 
+	// Mark the signatures to keep and then compact each list.
+	for (size_t j = 0; j < jobs.size(); ++j) {
+		const Sig_job &job = jobs[j];
+		keep[job.key][job.sig - &keys[job.key].sigs[0]] = ok[j];
+		if (cache && ok[j]) {
+			entries.push_back (Sig_cache::entry (job.hash, *job.sig));
+		}
+	}
+	if (cache && !(cache->is_current() && jobs.empty())) {
+		cache->save (entries);
+	}
+	for (size_t i = 0; i < keys.size(); ++i) {
+		std::vector<Signature> &sigs = keys[i].sigs;
+		size_t n = 0;
+		for (size_t j = 0; j < sigs.size(); ++j) {
+			if (keep[i][j]) {
+				sigs[n++] = sigs[j];
+			}
+		}
+		sigs.resize (n);
+	}
+}
 
 
-int read_keys (std::istream &is, Key_list &kl, bool recalc, bool force)
+static int read_keys (Protobuf_reader &pr, Key_list &kl, bool recalc, bool force,
+                      Sig_cache *cache)
 {
+	std::vector<Key> keys;
 	Key k;
-	int count = 0;
 	uint32_t tagwt;
 	uint64_t val;
 
-	Protobuf_reader pr (&is);
-
-	while (is && !is.eof() && pr.read_tagval (&tagwt, &val, true)) {
+	// Parse everything first so that the signatures can be verified
+	// together.
+	while (pr.read_tagval (&tagwt, &val, true)) {
 		switch (tagwt) {
 		case maketag (top_key, group_len):
-			read_single_key (pr, k, recalc);
-			insert_key (kl, k, force);
-			++count;
+			read_single_key (pr, k, false);
+			keys.push_back (std::move (k));
 			break;
 
 		default:
 			pr.skip (tagwt, val);
 		}
 	}
-	return count;
+	if (recalc) {
+		verify_all_sigs (keys, cache);
+	}
+	for (const Key &key : keys) {
+		insert_key (kl, key, force);
+	}
+	return keys.size();
+}
+
+
+int read_keys (std::istream &is, Key_list &kl, bool recalc, bool force)
+{
+	if (!is) return 0;
+	Protobuf_reader pr (&is);
+	return read_keys (pr, kl, recalc, force, NULL);
 }
 
 
@@ -377,8 +691,10 @@ int read_keys(const std::string &name, Key_list &kl, std::string &password,
               bool recalc, bool force, std::string *errinfo)
 {
 	amber::ifstream isc;
-	std::ifstream isp;
-	std::istream *is;
+	std::string contents;
+	Protobuf_reader pr;
+	bool ok;
+	std::unique_ptr<Sig_cache> cache;
 
 	if (name.size() > 4 && name.compare(name.size() - 4, 4, ".cha") == 0) {
 		if (password.empty()) {
@@ -387,21 +703,31 @@ int read_keys(const std::string &name, Key_list &kl, std::string &password,
 			get_password(os.str().c_str(), password);
 		}
 		isc.open(name.c_str(), password.c_str());
-		is = &isc;
+		ok = bool(isc);
+		pr.set_input (&isc);
 	} else {
-		isp.open(name.c_str(), isp.binary);
-		is = &isp;
-		// We do not trust unencrypted files. We recalc them always.
+		// Parse the contents from memory, without copying each field.
+		std::ifstream ifs(name.c_str(), ifs.binary);
+		ok = bool(ifs);
+		if (ok) {
+			contents.assign (std::istreambuf_iterator<char> (ifs),
+			                 std::istreambuf_iterator<char>());
+			// We do not trust unencrypted files. We recalc them always,
+			// skipping the certifications that we already verified.
+			cache.reset (new Sig_cache (name, contents));
+		}
+		pr.set_input (contents.data(), contents.size());
 		recalc = true;
 	}
 
-	if (!*is) {
+	if (!ok) {
 		if (errinfo) {
 			*errinfo = _("Cannot open the key ring file.");
 			return -1;
 		}
+		return 0;
 	}
-	int count = read_keys (*is, kl, recalc, force);
+	int count = read_keys (pr, kl, recalc, force, cache.get());
 	if (count < 0 || !errinfo->empty()) {
 		if (errinfo) {
 			errinfo->insert(0, _("Error reading keys from the file. "));
@@ -412,30 +738,18 @@ int read_keys(const std::string &name, Key_list &kl, std::string &password,
 
 
 
-void write_key(Protobuf_writer &pw, const Key &key, bool pubonly)
+static void write_key(Protobuf_writer &pw, const Key &key, bool pubonly, unsigned id)
 {
-	pw.start_group (top_key);
-
-	pw.write_bytes (key_pub, key.pair.xp.b, 32);
-	if (key.secret_avail && !pubonly) {
-		pw.write_bytes (key_sec, key.pair.xs.b, 32);
-	}
+	pw.start_group (id);
+	Key_schema::write (pw, key, pubonly ? key_pub_only : 0);
+	pw.end_group();
+}
 
-	pw.write_bytes (key_name, key.name.c_str(), key.name.size());
-	pw.write_bytes (key_alias, key.alias.c_str(), key.alias.size());
-	// We just assume the POSIX encoding of seconds since 1970-1-1.
-	pw.write_uint (key_time, key.creation_time);
-	pw.write_uint (key_master, key.master);
-	pw.write_bytes (key_self_sig, key.self_signature, 64);
 
-	for (unsigned i = 0; i < key.sigs.size(); ++i) {
-		pw.start_group (key_sig);
-		pw.write_bytes (key_sig_signer, key.sigs[i].signer.b, 32);
-		pw.write_bytes (key_sig_signature, key.sigs[i].signature, 64);
-		pw.end_group();
-	}
 
-	pw.end_group();
+void write_key(Protobuf_writer &pw, const Key &key, bool pubonly)
+{
+	write_key (pw, key, pubonly, top_key);
 }
 
 
@@ -459,6 +773,183 @@ void write_keys(std::ostream &os, const Key_list &kl, bool pubonly)
 }
 
 
+// An output buffer that just counts the bytes.
+class Count_buf : public std::streambuf {
+	std::streamsize count = 0;
+protected:
+	int overflow (int ch) override {
+		if (ch != EOF) ++count;
+		return 0;
+	}
+	std::streamsize xsputn (const char *, std::streamsize n) override {
+		count += n;
+		return n;
+	}
+public:
+	std::streamsize size() const { return count; }
+};
+
+std::streamoff keys_size (const Key_list &kl)
+{
+	Count_buf cb;
+	std::ostream os (&cb);
+	Protobuf_writer pw (&os, pw.noseek, 10000);
+	for (const Key &k : kl) {
+		if (k.write_what != Key::discard) {
+			write_key (pw, k, k.write_what == Key::write_pub);
+		}
+	}
+	pw.flush();
+	return cb.size();
+}
+
+
+static bool same_sig (const Signature &a, const Signature &b)
+{
+	return memcmp (a.signer.b, b.signer.b, 32) == 0
+	       && memcmp (a.signature, b.signature, 64) == 0;
+}
+
+// True if the key would be written in the same way, apart from the
+// certifications.
+static bool same_fields (const Key &a, const Key &b)
+{
+	bool sa = a.secret_avail && a.write_what != Key::write_pub;
+	bool sb = b.secret_avail && b.write_what != Key::write_pub;
+	if (sa != sb || (sa && memcmp (a.pair.xs.b, b.pair.xs.b, 32) != 0)) {
+		return false;
+	}
+	return a.name == b.name && a.alias == b.alias
+	       && a.creation_time == b.creation_time && a.master == b.master
+	       && memcmp (a.self_signature, b.self_signature, 64) == 0;
+}
+
+// Return the number of certifications that b adds at the end of those of
+// a, by signers that have not certified a, or -1 if b differs from a in any
+// other way. Reading a top_key record with just the added certifications
+// after a turns it into b, also in older versions.
+static ptrdiff_t added_sigs (const Key &a, const Key &b)
+{
+	if (!same_fields (a, b) || b.sigs.size() < a.sigs.size()) {
+		return -1;
+	}
+	std::unordered_set<Cu25519Ris, Cu25519Ris_hash, Cu25519Ris_equal> signers;
+	for (size_t i = 0; i < a.sigs.size(); ++i) {
+		if (!same_sig (a.sigs[i], b.sigs[i])) {
+			return -1;
+		}
+		signers.insert (a.sigs[i].signer);
+	}
+	for (size_t i = a.sigs.size(); i < b.sigs.size(); ++i) {
+		if (!signers.insert (b.sigs[i].signer).second) {
+			return -1;
+		}
+	}
+	return b.sigs.size() - a.sigs.size();
+}
+
+static const Key * find_written (const Key_list &kl, const Cu25519Ris &pub)
+{
+	const Key *k = kl.find (pub);
+	return k && k->write_what != Key::discard ? k : NULL;
+}
+
+
+// Write top_padding records of exactly n >= 2 bytes in total. They are
+// varints, because older versions skip a length_val by seeking, which the
+// decrypting ifstream does not support.
+static void write_padding (std::ostream &os, size_t n)
+{
+	char tmp[16];
+	while (n > 0) {
+		// Records take from 2 to 10 bytes. Do not leave a single byte.
+		size_t len = n >= 12 ? 10 : n <= 10 ? n : 9;
+		tmp[0] = maketag (top_padding, varint);
+		uint64_t val = len == 2 ? 0 : uint64_t(1) << (7 * (len - 2));
+		write_uleb (val, tmp + 1);
+		os.write (tmp, len);
+		n -= len;
+	}
+}
+
+
+std::streamoff append_key_changes (const std::string &name, const Key_list &kl,
+                                   const std::string &password)
+{
+	bool encrypted = name.size() > 4 && name.compare (name.size() - 4, 4, ".cha") == 0;
+	Key_list old;
+	if (encrypted) {
+		amber::ifstream is (name.c_str(), password.c_str());
+		read_keys (is, old, false, false);
+	} else {
+		std::ifstream is (name.c_str(), is.binary);
+		if (!is) return -1;
+		read_keys (is, old, false, false);
+	}
+
+	// Only records that older versions understand are appended, so that
+	// they still read the ring correctly.
+	for (const Key &k : old) {
+		if (k.write_what != Key::discard && !find_written (kl, k.pair.xp)) {
+			return -1;
+		}
+	}
+	std::ostringstream changes;
+	int count = 0;
+	{
+		Protobuf_writer pw (&changes, pw.noseek, SIZE_MAX);
+		Key tail;
+		for (const Key &k : kl) {
+			if (k.write_what == Key::discard) continue;
+			const Key *o = find_written (old, k.pair.xp);
+			if (!o) {
+				write_key (pw, k, k.write_what == Key::write_pub, top_key);
+				++count;
+				continue;
+			}
+			ptrdiff_t added = added_sigs (*o, k);
+			if (added < 0) {
+				return -1;
+			}
+			if (added > 0) {
+				tail = k;
+				tail.sigs.erase (tail.sigs.begin(), tail.sigs.end() - added);
+				write_key (pw, tail, true, top_key);
+				++count;
+			}
+		}
+		pw.flush();
+	}
+	std::string data = changes.str();
+	if (count == 0) {
+		return 0;
+	}
+
+	std::streamoff size;
+	if (encrypted) {
+		amber::ofstream os;
+		os.open_append (name.c_str(), password.c_str());
+		// The last block of the file must be filled before it is written
+		// again. See ofstream::open_append().
+		size_t pad = os.block_room();
+		if (pad < 2) {
+			pad += os.get_block_size() - os.get_block_filler();
+		}
+		write_padding (os, pad);
+		os.write (data.data(), data.size());
+		size = os.payload_pos();
+		os.close();
+	} else {
+		std::ofstream os (name.c_str(), os.binary | os.app);
+		os.write (data.data(), data.size());
+		size = os.tellp();
+		os.close();
+		if (!os) return -1;
+	}
+	return size;
+}
+
+
 void generate_master_from_secret (const uint8_t priv[32], const char *name, Key *key)
 {
 	key->clear();
@@ -538,28 +1029,104 @@ static bool idmatch(const Key &k, const std::string &name)
 
 
 
-void select_keys(const Key_list &kl, const std::vector<std::string> &names,
-                 Key_list &dst)
+// Split s into the words separated by spaces and call f for each one.
+template <class F>
+static void for_each_word (const std::string &s, F f)
 {
-	std::vector<bool> used(names.size());
-	for (unsigned i = 0; i < used.size(); ++i) used[i] = false;
+	size_t beg = 0;
+	while (beg < s.size()) {
+		size_t end = s.find (' ', beg);
+		if (end == s.npos) end = s.size();
+		if (end > beg) f (s.substr (beg, end - beg));
+		beg = end + 1;
+	}
+}
 
-	Key_list::const_iterator i = kl.begin();
-	Key_list::const_iterator e = kl.end();
-	while (i != e) {
-		for (unsigned j = 0; j < names.size(); ++j) {
-			if (i->enc.find(names[j]) == 0) {
-				if (used[j]) {
-					throw_rte (_("The identifier '%s' matches more than one key"), names[j]);
-				}
-				used[j] = true;
+void Key_list::rebuild_names() const
+{
+	words.clear();
+	encs.clear();
+	encs.reserve (keys.size());
+	for (size_t i = 0; i < keys.size(); ++i) {
+		auto add = [this, i](const std::string &w) {
+			std::vector<size_t> &v = words[w];
+			if (v.empty() || v.back() != i) v.push_back (i);
+		};
+		for_each_word (keys[i].name, add);
+		for_each_word (keys[i].alias, add);
+		encs.push_back (std::make_pair (keys[i].enc, i));
+	}
+	std::sort (encs.begin(), encs.end());
+	names_stale = false;
+}
+
+void Key_list::match (const std::string &id, std::vector<size_t> &out, size_t *enc_matches) const
+{
+	if (names_stale) {
+		rebuild_names();
+	}
+	size_t start = out.size();
+
+	*enc_matches = 0;
+	auto e = std::lower_bound (encs.begin(), encs.end(), std::make_pair (id, size_t(0)));
+	for (; e != encs.end() && e->first.compare (0, id.size(), id) == 0; ++e) {
+		out.push_back (e->second);
+		++*enc_matches;
+	}
+
+	// If id matches then each of its words is a whole word of the name or
+	// the alias. Look up the keys with the first one and check them.
+	std::string first;
+	for_each_word (id, [&first](const std::string &w) {
+		if (first.empty()) first = w;
+	});
+	if (first.empty()) {
+		for (size_t i = 0; i < keys.size(); ++i) {
+			if (idmatch (keys[i].name, id) || idmatch (keys[i].alias, id)) {
+				out.push_back (i);
 			}
-			if (idmatch(*i, names[j])) {
-				dst.push_back(*i);
-				break;
+		}
+	} else {
+		Word_index::const_iterator w = words.find (first);
+		if (w != words.end()) {
+			for (size_t i : w->second) {
+				if (idmatch (keys[i].name, id) || idmatch (keys[i].alias, id)) {
+					out.push_back (i);
+				}
 			}
 		}
-		++i;
+	}
+
+	std::sort (out.begin() + start, out.end());
+	out.erase (std::unique (out.begin() + start, out.end()), out.end());
+}
+
+
+// Put in pos the positions of the keys that match any of the names, in
+// order. If ambiguous is not null throw it as the error message when a name
+// is the prefix of the encoding of several keys.
+static void match_names (const Key_list &kl, const std::vector<std::string> &names,
+                         std::vector<size_t> &pos, const char *ambiguous=NULL)
+{
+	size_t enc_matches;
+	for (unsigned j = 0; j < names.size(); ++j) {
+		kl.match (names[j], pos, &enc_matches);
+		if (ambiguous && enc_matches > 1) {
+			throw_rte (ambiguous, names[j]);
+		}
+	}
+	std::sort (pos.begin(), pos.end());
+	pos.erase (std::unique (pos.begin(), pos.end()), pos.end());
+}
+
+
+void select_keys(const Key_list &kl, const std::vector<std::string> &names,
+                 Key_list &dst)
+{
+	std::vector<size_t> pos;
+	match_names (kl, names, pos, _("The identifier '%s' matches more than one key"));
+	for (size_t i : pos) {
+		dst.push_back (kl[i]);
 	}
 }
 
@@ -567,26 +1134,10 @@ void select_keys(const Key_list &kl, const std::vector<std::string> &names,
 void select_last_keys(const Key_list &kl, const std::vector<std::string> &names,
                       Key_list &dst)
 {
-	std::vector<bool> used(names.size());
-	for (unsigned i = 0; i < used.size(); ++i) used[i] = false;
-
-	Key_list::const_iterator i = kl.begin();
-	Key_list::const_iterator e = kl.end();
-	while (i != e) {
-		for (unsigned j = 0; j < names.size(); ++j) {
-			if (i->enc.find(names[j]) == 0) {
-				if (used[j]) {
-					throw_rte (_("The identifier '%s' matches more than one key"),
-					           names[j]);
-				}
-				used[j] = true;
-			}
-			if (idmatch(*i, names[j]) /*&& !i->master*/) {
-				dst.push_back(*i);
-				break;
-			}
-		}
-		++i;
+	std::vector<size_t> pos;
+	match_names (kl, names, pos, _("The identifier '%s' matches more than one key"));
+	for (size_t i : pos) {
+		dst.push_back (kl[i]);
 	}
 
 	std::sort(dst.begin(), dst.end(), [](const Key &k1, const Key &k2) {
@@ -616,20 +1167,14 @@ void select_last_keys(const Key_list &kl, const std::vector<std::string> &names,
 
 void select_keys(const Key_list &kl, const std::string &name, Key_list &dst)
 {
-	Key_list::const_iterator i = kl.begin();
-	Key_list::const_iterator e = kl.end();
-	bool used = false;
-	while (i != e) {
-		if (i->enc.find(name) == 0) {
-			if (used) {
-				throw_rte (_("The identifier matches more than one key"));
-			}
-			used = true;
-		}
-		if (idmatch(*i, name)) {
-			dst.push_back(*i);
-		}
-		++i;
+	std::vector<size_t> pos;
+	size_t enc_matches;
+	kl.match (name, pos, &enc_matches);
+	if (enc_matches > 1) {
+		throw_rte (_("The identifier matches more than one key"));
+	}
+	for (size_t i : pos) {
+		dst.push_back (kl[i]);
 	}
 }
 
@@ -700,54 +1245,38 @@ void select_recent_one(const Key_list &kl, const std::string &name, Key &key, bo
 
 void change_name(Key_list &kl, const std::vector<std::string> &selected, const char *new_name)
 {
-	Key_list::iterator i = kl.begin();
-	Key_list::iterator e = kl.end();
-	while (i != e) {
-		for (auto j = selected.begin(); j != selected.end(); ++j) {
-			if (idmatch(*i, *j)) {
-				i->name = new_name;
-				uint8_t hash[64];
-				hash_key(*i, hash);
-				cu25519_sign (ksigh, hash, 64, i->pair.xp, i->pair.xs, i->self_signature);
-				break;
-			}
-		}
-		++i;
+	std::vector<size_t> pos;
+	match_names (kl, selected, pos);
+	for (size_t i : pos) {
+		Key &k = kl[i];
+		k.name = new_name;
+		uint8_t hash[64];
+		hash_key(k, hash);
+		cu25519_sign (ksigh, hash, 64, k.pair.xp, k.pair.xs, k.self_signature);
 	}
 }
 
 
 void change_alias(Key_list &kl, const std::vector<std::string> &selected, const char *new_alias)
 {
-	Key_list::iterator i = kl.begin();
-	Key_list::iterator e = kl.end();
-	while (i != e) {
-		for (auto j = selected.begin(); j != selected.end(); ++j) {
-			if (idmatch(*i, *j)) {
-				i->alias = new_alias;
-				break;
-			}
-		}
-		++i;
+	std::vector<size_t> pos;
+	match_names (kl, selected, pos);
+	for (size_t i : pos) {
+		kl[i].alias = new_alias;
 	}
 }
 
 
 void append_alias(Key_list &kl, const std::vector<std::string> &selected, const char *new_alias)
 {
-	Key_list::iterator i = kl.begin();
-	Key_list::iterator e = kl.end();
-	while (i != e) {
-		for (auto j = selected.begin(); j != selected.end(); ++j) {
-			if (idmatch(*i, *j)) {
-				if (!i->alias.empty()) {
-					i->alias.push_back(' ');
-				}
-				i->alias += new_alias;
-				break;
-			}
+	std::vector<size_t> pos;
+	match_names (kl, selected, pos);
+	for (size_t i : pos) {
+		Key &k = kl[i];
+		if (!k.alias.empty()) {
+			k.alias.push_back(' ');
 		}
-		++i;
+		k.alias += new_alias;
 	}
 }
 
@@ -886,15 +1415,7 @@ int remove_signature(Key_list &kl, const char *signer, const std::vector<std::st
 
 const Key * find_key (const Key_list &kl, const Cu25519Ris &pub)
 {
-	Key_list::const_iterator i = kl.begin();
-	Key_list::const_iterator e = kl.end();
-	while (i != e) {
-		if (memcmp(i->pair.xp.b, pub.b, 32) == 0) {
-			return &*i;
-		}
-		++i;
-	}
-	return NULL;
+	return kl.find (pub);
 }
 
 
@@ -973,23 +1494,11 @@ void show_sig_key (const Key_list &kl, const Key &key, Key_encoding kenc)
 
 bool delete_keys(Key_list &kl, const Key_list &selected)
 {
-	bool changed = false;
-	Key_list::iterator i = kl.begin();
-	while (i != kl.end()) {
-		Key_list::const_iterator si = selected.begin();
-		Key_list::const_iterator se = selected.end();
-		while (si != se) {
-			if (memcmp(si->pair.xp.b, i->pair.xp.b, 32) == 0) {
-				Key_list::iterator tmp = i;
-				--i;
-				kl.erase(tmp);
-				changed = true;
-				break;
-			}
-			++si;
-		}
-		++i;
-	}
+	Key_list::iterator e = std::remove_if (kl.begin(), kl.end(), [&selected](const Key &k) {
+		return selected.find (k.pair.xp) != NULL;
+	});
+	bool changed = e != kl.end();
+	kl.erase (e, kl.end());
 	return changed;
 }
 
@@ -32,6 +32,8 @@
 #include "group25519.hpp"
 #include <iostream>
 #include <vector>
+#include <unordered_map>
+#include <string.h>
 
 
 namespace amber {   namespace AMBER_SONAME {
@@ -93,13 +95,113 @@ struct Key {
 };
 
 
+// Hash and comparison of public keys for the unordered containers. The hash
+// is Siphash24 with a random key chosen when the program starts.
+struct EXPORTFN Cu25519Ris_hash {
+	size_t operator() (const Cu25519Ris &k) const;
+};
+struct Cu25519Ris_equal {
+	bool operator() (const Cu25519Ris &a, const Cu25519Ris &b) const {
+		return memcmp (a.b, b.b, 32) == 0;
+	}
+};
+
+
+// A list of keys. It behaves like a std::vector<Key> and it also keeps an
+// index of the keys by their public key, so that find() does not need to
+// scan the list, and an index of the words of the names and aliases and of
+// the encodings, so that match() does not need to either. The index by
+// public key is kept up to date by push_back(). Any other non const access
+// may change or move the keys, therefore it marks the indexes as stale and
+// the next find() or match() rebuilds them. Because of this even the const
+// functions are not safe to call from several threads at the same time.
+class EXPORTFN Key_list {
+	typedef std::unordered_map<Cu25519Ris, size_t, Cu25519Ris_hash, Cu25519Ris_equal> Index;
+	typedef std::unordered_map<std::string, std::vector<size_t> > Word_index;
+	std::vector<Key> keys;
+	mutable Index    index;
+	mutable bool     stale = false;
+	// The keys by each word of their names and aliases and their encodings
+	// in order.
+	mutable Word_index words;
+	mutable std::vector<std::pair<std::string, size_t> > encs;
+	mutable bool     names_stale = false;
+
+	void rebuild() const;
+	void rebuild_names() const;
+	void touch() { stale = names_stale = true; }
+
+public:
+	typedef std::vector<Key>::value_type      value_type;
+	typedef std::vector<Key>::size_type       size_type;
+	typedef std::vector<Key>::reference       reference;
+	typedef std::vector<Key>::const_reference const_reference;
+	typedef std::vector<Key>::iterator        iterator;
+	typedef std::vector<Key>::const_iterator  const_iterator;
+
+	size_type size() const { return keys.size(); }
+	bool empty() const { return keys.empty(); }
+	void reserve (size_type n) { keys.reserve (n); index.reserve (n); }
+	void clear() {
+		keys.clear();
+		index.clear();
+		words.clear();
+		encs.clear();
+		stale = names_stale = false;
+	}
+
+	const_iterator begin() const { return keys.begin(); }
+	const_iterator end() const { return keys.end(); }
+	const_reference operator[] (size_type i) const { return keys[i]; }
+	const_reference front() const { return keys.front(); }
+	const_reference back() const { return keys.back(); }
+
+	iterator begin() { touch(); return keys.begin(); }
+	iterator end() { touch(); return keys.end(); }
+	reference operator[] (size_type i) { touch(); return keys[i]; }
+	reference front() { touch(); return keys.front(); }
+	reference back() { touch(); return keys.back(); }
+	iterator erase (const_iterator pos) { touch(); return keys.erase (pos); }
+	iterator erase (const_iterator first, const_iterator last) {
+		touch();
+		return keys.erase (first, last);
+	}
+	void pop_back() { touch(); keys.pop_back(); }
+	void swap (Key_list &rhs) {
+		keys.swap (rhs.keys);
+		index.swap (rhs.index);
+		words.swap (rhs.words);
+		encs.swap (rhs.encs);
+		std::swap (stale, rhs.stale);
+		std::swap (names_stale, rhs.names_stale);
+	}
+
+	void push_back (const Key &k);
+
+	// Return the first key with the public key pub or NULL. The public key
+	// of the returned key must not be changed. The other fields may be
+	// changed through the non const version, therefore it marks the index
+	// of the names as stale.
+	const Key * find (const Cu25519Ris &pub) const;
+	Key * find (const Cu25519Ris &pub) {
+		names_stale = true;
+		return const_cast<Key*> (static_cast<const Key_list*>(this)->find (pub));
+	}
+
+	// Append to out the positions of the keys that match id, in increasing
+	// order. A key matches if id is a prefix of its encoding or if id is a
+	// sequence of whole words of its name or of its alias. Put in
+	// *enc_matches the number of keys whose encoding starts with id.
+	void match (const std::string &id, std::vector<size_t> &out, size_t *enc_matches) const;
+};
+
+
 // How to show the keys to the user. This is also the format in which raw
 // keys will be read. key16 will encode the key as an hexadecimal listing.
 // key32 will use letters and digits and is insensitive to the case of the
 // letters. key58 uses base 58 encoding: this encoding uses digits and upper
 // and lower case letters. Most programs will interpret a base 58 key as if
 // it were a single word within a text. key64 uses standard base 64 encoding.
-typedef std::vector<Key> Key_list;
 enum Key_encoding { key16, key32, key58, key64 };
 
 
@@ -147,6 +249,21 @@ int read_keys(const std::string &name, Key_list &kl, std::string &password,
 EXPORTFN void write_key(std::ostream &os, const Key &key, bool pubonly);
 EXPORTFN void write_keys(std::ostream &os, const Key_list &kl, bool pubonly);
 
+// Number of bytes that write_keys() would write for kl, not counting the
+// encryption.
+EXPORTFN std::streamoff keys_size(const Key_list &kl);
+
+// Append to the key ring file name the keys of kl that are not in the file
+// and the certifications that kl adds to the keys of the file, instead of
+// writing the whole ring again. Encrypted rings are opened with the
+// password. Return the size of the contents of the file afterwards, which
+// includes all the appended records, or -1 if it could not be written or if
+// kl changes or removes keys of the file in any other way. In that case the
+// ring must be written again with write_keys(). Compare the size with
+// keys_size() to decide when the ring should be compacted.
+EXPORTFN std::streamoff append_key_changes(const std::string &name, const Key_list &kl,
+                                           const std::string &password);
+
 // Generate a new master key with the given name. priv[] contains the random
 // bytes to be used to generate the key. It correctly fills all the fields
 // of key and self signs the key.
@@ -136,6 +136,144 @@ int Cipher::decrypt_padded (const uint8_t *ad, size_t alen,
 	return 0;
 }
 
+
+// Collects the ChaCha20 blocks required by a batch of packets and computes
+// them four at a time. Block bn of packet i uses the nonce first + i. The
+// blocks are passed to fn (i, bn, block) in the same order as they were
+// requested.
+template <class Fn>
+class Block_lanes {
+	const Chakey &key;
+	uint64_t first;
+	Fn &fn;
+	size_t packet[4];
+	uint64_t nonce[4], bn[4];
+	int used;
+	uint8_t out[256];
+public:
+	Block_lanes (const Chakey &k, uint64_t f, Fn &fun)
+		: key(k), first(f), fn(fun), used(0) {}
+	~Block_lanes() { crypto_bzero (out, sizeof out); }
+
+	void add (size_t i, uint64_t b) {
+		packet[used] = i;
+		nonce[used] = first + i;
+		bn[used] = b;
+		if (++used == 4) flush();
+	}
+
+	void flush() {
+		if (used == 0) return;
+		for (int l = used; l < 4; ++l) {
+			nonce[l] = nonce[0];
+			bn[l] = bn[0];
+		}
+		chacha20_x4 (out, key, nonce, bn);
+		for (int l = 0; l < used; ++l) {
+			fn (packet[l], bn[l], out + 64*l);
+		}
+		used = 0;
+	}
+};
+
+
+// Xor the block b >= 1 of the keystream with the corresponding part of
+// in[0..len[.
+static void xor_block (const Cipher_packet &p, size_t len, uint64_t b, const uint8_t *ks)
+{
+	size_t off = (b - 1) * 64;
+	size_t n = len - off < 64 ? len - off : 64;
+	for (size_t j = 0; j < n; ++j) {
+		p.out[off + j] = p.in[off + j] ^ ks[j];
+	}
+}
+
+// The Poly1305 tag of ct[0..clen[ using the first 32 bytes of block zero.
+static void packet_tag (uint8_t tag[16], const uint8_t *block0,
+                        const uint8_t *ad, size_t alen,
+                        const uint8_t *ct, size_t clen)
+{
+	poly1305_context poc;
+	poly1305_init (&poc, block0);
+	if (alen != 0) {
+		poly1305_update (&poc, ad, alen);
+		poly1305_pad16 (&poc, alen);
+	}
+	poly1305_update (&poc, ct, clen);
+	poly1305_pad16 (&poc, clen);
+	poly1305_update (&poc, alen);
+	poly1305_update (&poc, clen);
+	poly1305_finish (&poc, tag);
+}
+
+
+void Cipher::encrypt_batch (Cipher_packet *p, size_t count)
+{
+	auto crypt = [p] (size_t i, uint64_t b, const uint8_t *ks) {
+		xor_block (p[i], p[i].len, b, ks);
+	};
+	Block_lanes<decltype(crypt)> stream (key, n, crypt);
+	for (size_t i = 0; i < count; ++i) {
+		for (uint64_t b = 1; (b - 1) * 64 < p[i].len; ++b) {
+			stream.add (i, b);
+		}
+	}
+	stream.flush();
+
+	// The tags need the complete ciphertext.
+	auto auth = [p] (size_t i, uint64_t, const uint8_t *block0) {
+		packet_tag (p[i].out + p[i].len, block0, p[i].ad, p[i].alen, p[i].out, p[i].len);
+		p[i].status = 0;
+	};
+	Block_lanes<decltype(auth)> tags (key, n, auth);
+	for (size_t i = 0; i < count; ++i) {
+		tags.add (i, 0);
+	}
+	tags.flush();
+
+	n += count;
+}
+
+
+size_t Cipher::decrypt_batch (Cipher_packet *p, size_t count)
+{
+	size_t failed = 0;
+	auto check = [p, &failed] (size_t i, uint64_t, const uint8_t *block0) {
+		size_t mlen = p[i].len - 16;
+		uint8_t tag[16];
+		packet_tag (tag, block0, p[i].ad, p[i].alen, p[i].in, mlen);
+		p[i].status = crypto_neq (tag, p[i].in + mlen, 16) ? -1 : 0;
+		if (p[i].status != 0) ++failed;
+	};
+	Block_lanes<decltype(check)> tags (key, n, check);
+	for (size_t i = 0; i < count; ++i) {
+		if (p[i].len < 16) {
+			p[i].status = -1;
+			++failed;
+		} else {
+			tags.add (i, 0);
+		}
+	}
+	tags.flush();
+
+	// Decrypt only the packets that passed the authentication.
+	auto crypt = [p] (size_t i, uint64_t b, const uint8_t *ks) {
+		xor_block (p[i], p[i].len - 16, b, ks);
+	};
+	Block_lanes<decltype(crypt)> stream (key, n, crypt);
+	for (size_t i = 0; i < count; ++i) {
+		if (p[i].status != 0) continue;
+		for (uint64_t b = 1; (b - 1) * 64 < p[i].len - 16; ++b) {
+			stream.add (i, b);
+		}
+	}
+	stream.flush();
+
+	n += count;
+	return failed;
+}
+
+
 void Cipher::rekey()
 {
 	uint8_t stream[64];
@@ -56,6 +56,22 @@ void hkdf2s (const uint8_t ck[32], const uint8_t *ikm, size_t ilen,
              uint8_t *v1, uint8_t *v2=0, uint8_t *v3=0);
 
 
+// A packet of Cipher::encrypt_batch() or Cipher::decrypt_batch(). When
+// encrypting in[0..len[ is the plaintext and out receives len+16 bytes.
+// When decrypting in[0..len[ is the ciphertext with its tag and out
+// receives len-16 bytes. ad[0..alen[ is the authenticated data. in and out
+// may be the same. status is set to 0 if the packet was processed and to
+// -1 if it failed authentication.
+struct Cipher_packet {
+	const uint8_t *ad;
+	size_t        alen;
+	const uint8_t *in;
+	size_t        len;
+	uint8_t       *out;
+	int           status;
+};
+
+
 // The CipherState object defined in Noise.
 class EXPORTFN Cipher {
 protected:
@@ -83,6 +99,14 @@ public:
 	                      uint8_t *pt /*pt[clen-16]*/) {
 		return decrypt_one (pt, ct, clen, ad, alen, key, n++);
 	}
+	// Encrypt or decrypt count packets with consecutive nonces. The result
+	// is the same as calling encrypt_with_ad() or decrypt_with_ad() for
+	// each packet, but the ChaCha20 blocks of several packets are computed
+	// together and nothing is allocated. decrypt_batch() returns the number
+	// of packets that failed authentication. Their output is not written.
+	void encrypt_batch (Cipher_packet *p, size_t count);
+	size_t decrypt_batch (Cipher_packet *p, size_t count);
+
 	// Create a NoiseSocket traffic block. This will put the length of the
 	// body as a 16 bit big endian at the start of the plaintext and will pad
 	// it with padlen bytes before encrypting. Precondition: plen + padlen +
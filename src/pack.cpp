@@ -37,11 +37,20 @@
 #include "protobuf.hpp"
 #include <iomanip>
 #include <memory>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <unordered_map>
+#include <unordered_set>
+#include <algorithm>
 
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <dirent.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/time.h>
 
 #include "zwrap.hpp"
@@ -50,8 +59,11 @@
 namespace amber {   namespace AMBER_SONAME {
 
 
+#ifdef _WIN32
+
 // Expand directory names into their contents.
-static void expand_file (const char *name, std::vector<std::string> *expanded)
+static void expand_file (const char *name, std::vector<std::string> *expanded,
+                         std::vector<struct stat> *stats)
 {
 	struct stat st;
 	if (stat(name, &st) != 0) {
@@ -71,524 +83,2075 @@ static void expand_file (const char *name, std::vector<std::string> *expanded)
 		while ((de = readdir(dir.get())) != NULL) {
 			if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
 			comp = root + de->d_name;
-			expand_file(comp.c_str(), expanded);
+			expand_file(comp.c_str(), expanded, stats);
 		}
 		expanded->push_back (name);
+		stats->push_back (st);
 	} else if (S_ISREG(st.st_mode)) {
 		expanded->push_back(name);
+		stats->push_back (st);
+	}
+}
+
+// Expand the directories in files[0..nf[ into their contents and put their
+// names in expanded and their stat in stats. The contents of a directory
+// come before the directory itself.
+static void expand_files (int nf, char **files, std::vector<std::string> *expanded,
+                          std::vector<struct stat> *stats)
+{
+	for (int i = 0; i < nf; ++i) {
+		expand_file(files[i], expanded, stats);
+	}
+}
+
+#else
+
+// The directories are read by several threads, because on network or cold
+// file systems the walk is dominated by the latency of each request. Each
+// directory is opened once. Its entries are visited in the order of their
+// inodes, which is close to their order on the disk, and they are examined
+// with fstatat() relative to the directory. The stat of each file is kept
+// so that packing does not need to ask for it again.
+
+enum { walk_threads = 8 };
+
+class Dir_walker {
+	struct Child {
+		std::string name;
+		struct stat st;
+		size_t      dir;         // The node of a directory.
+	};
+	struct Node {
+		std::string        path;   // Ends with '/'.
+		std::vector<Child> children;
+	};
+	std::vector<std::unique_ptr<Node> > nodes;
+	std::vector<size_t> queue;
+	size_t busy = 0;
+	std::mutex mtx;
+	std::condition_variable cv;
+
+	void scan (Node &node);
+	void work();
+	void emit (const Node &node, std::vector<std::string> *expanded,
+	           std::vector<struct stat> *stats);
+	size_t count (const Node &node) const;
+
+public:
+	// Add the directory name to be walked and return its node.
+	size_t add (const std::string &name);
+	// Walk all the added directories.
+	void run();
+	// Append the contents of the node k. The contents of a directory come
+	// before the directory itself.
+	void emit (size_t k, std::vector<std::string> *expanded, std::vector<struct stat> *stats) {
+		emit (*nodes[k], expanded, stats);
+	}
+	// The number of entries that emit(k) will append.
+	size_t count (size_t k) const { return count (*nodes[k]); }
+};
+
+size_t Dir_walker::add (const std::string &name)
+{
+	// Called with mtx held by scan() or before run().
+	std::unique_ptr<Node> node (new Node);
+	node->path = name;
+	if (!node->path.empty() || node->path[node->path.size() - 1] != '/') {
+		node->path += '/';
+	}
+	nodes.push_back (std::move (node));
+	queue.push_back (nodes.size() - 1);
+	return nodes.size() - 1;
+}
+
+void Dir_walker::scan (Node &node)
+{
+	int fd = open (node.path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0) return;
+	// Ensure we close the directory in the presence of exceptions.
+	std::unique_ptr<DIR, int(*)(DIR*)> dir(fdopendir(fd), closedir);
+	if (!dir) {
+		close (fd);
+		return;
+	}
+
+	std::vector<std::pair<ino_t, std::string> > entries;
+	dirent *de;
+	while ((de = readdir(dir.get())) != NULL) {
+		if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
+		entries.push_back (std::make_pair (de->d_ino, std::string (de->d_name)));
+	}
+	std::sort (entries.begin(), entries.end());
+
+	node.children.reserve (entries.size());
+	Child c;
+	for (unsigned i = 0; i < entries.size(); ++i) {
+		if (fstatat (fd, entries[i].second.c_str(), &c.st, 0) != 0) continue;
+		if (!S_ISDIR(c.st.st_mode) && !S_ISREG(c.st.st_mode)) continue;
+		c.name = node.path + entries[i].second;
+		c.dir = 0;
+		if (S_ISDIR(c.st.st_mode)) {
+			std::lock_guard<std::mutex> lk(mtx);
+			c.dir = add (c.name);
+			cv.notify_one();
+		}
+		node.children.push_back (c);
+	}
+}
+
+void Dir_walker::work()
+{
+	std::unique_lock<std::mutex> lk(mtx);
+	for (;;) {
+		cv.wait (lk, [this] { return !queue.empty() || busy == 0; });
+		if (queue.empty()) return;
+		Node &node = *nodes[queue.back()];
+		queue.pop_back();
+		++busy;
+		lk.unlock();
+		scan (node);
+		lk.lock();
+		if (--busy == 0 && queue.empty()) {
+			cv.notify_all();
+		}
+	}
+}
+
+void Dir_walker::run()
+{
+	std::vector<std::thread> pool;
+	for (unsigned i = 1; i < walk_threads; ++i) {
+		pool.push_back (std::thread (&Dir_walker::work, this));
+	}
+	work();
+	for (unsigned i = 0; i < pool.size(); ++i) {
+		pool[i].join();
+	}
+}
+
+void Dir_walker::emit (const Node &node, std::vector<std::string> *expanded,
+                       std::vector<struct stat> *stats)
+{
+	for (unsigned i = 0; i < node.children.size(); ++i) {
+		const Child &c = node.children[i];
+		if (S_ISDIR(c.st.st_mode)) {
+			emit (*nodes[c.dir], expanded, stats);
+		}
+		expanded->push_back (c.name);
+		stats->push_back (c.st);
+	}
+}
+
+size_t Dir_walker::count (const Node &node) const
+{
+	size_t n = node.children.size();
+	for (unsigned i = 0; i < node.children.size(); ++i) {
+		if (S_ISDIR(node.children[i].st.st_mode)) {
+			n += count (*nodes[node.children[i].dir]);
+		}
 	}
+	return n;
 }
 
-static void expand_files(int nf, char **files, std::vector<std::string> *expanded)
+// Expand the directories in files[0..nf[ into their contents and put their
+// names in expanded and their stat in stats. The contents of a directory
+// come before the directory itself.
+static void expand_files (int nf, char **files, std::vector<std::string> *expanded,
+                          std::vector<struct stat> *stats)
 {
+	Dir_walker walker;
+	std::vector<struct stat> top (nf);
+	std::vector<size_t> roots (nf);
+	std::vector<bool> ok (nf);
 	for (int i = 0; i < nf; ++i) {
-		expand_file(files[i], expanded);
+		ok[i] = stat(files[i], &top[i]) == 0
+		        && (S_ISDIR(top[i].st_mode) || S_ISREG(top[i].st_mode));
+		if (ok[i] && S_ISDIR(top[i].st_mode)) {
+			roots[i] = walker.add (files[i]);
+		}
+	}
+	walker.run();
+
+	size_t total = expanded->size() + nf;
+	for (int i = 0; i < nf; ++i) {
+		if (ok[i] && S_ISDIR(top[i].st_mode)) total += walker.count (roots[i]);
+	}
+	expanded->reserve (total);
+	stats->reserve (total);
+	for (int i = 0; i < nf; ++i) {
+		if (!ok[i]) continue;
+		if (S_ISDIR(top[i].st_mode)) {
+			walker.emit (roots[i], expanded, stats);
+		}
+		expanded->push_back (files[i]);
+		stats->push_back (top[i]);
 	}
 }
 
+#endif
+
+
+enum Pack_type { pack_header, pack_file, pack_item, pack_dir, pack_flag, pack_last,
+                 pack_chunk_key, pack_chunk_list, pack_chunk, pack_name_table, pack_name_index };
+enum Item_type { tag_pos, tag_compsz, tag_expsz, tag_name, tag_mode, tag_content, tag_mtime,
+                 tag_chunks, tag_chunk, tag_digest, tag_codec, tag_level, tag_data_pos };
 
-enum Pack_type { pack_header, pack_file, pack_item, pack_dir, pack_flag, pack_last };
-enum Item_type { tag_pos, tag_compsz, tag_expsz, tag_name, tag_mode, tag_content, tag_mtime };
+// Bits of pack_flag. flag_item_codec means that the items and chunks may
+// have their own codec, which overrides the one given by flag_compressed.
+enum { flag_compressed = 1, flag_chunked = 2, flag_indexed = 4, flag_item_codec = 8,
+       flag_known = 15 };
+
+// How the contents of an item or chunk are stored.
+enum Codec { codec_stored, codec_deflate, codec_lz, codec_default = -1 };
 
 // Each Item is a directory entry in the packed archive's central directory.
 // It contains the information about the file's properties and also its
-// position within the packed archive.
+// position within the packed archive. In a chunked archive the contents of
+// the file are the chunks listed in chunks and pos is not used. comp_size
+// is then the size of the chunks that were first stored with this file.
+// Items without a codec use the one given by the flag of the archive. The
+// level is the compression level that was requested.
 struct Item {
 	std::streamoff pos, comp_size, exp_size;
 	uint32_t       mode;
 	std::string    name;
 	uint64_t       mtime_us;                // mtime in μs
+	std::vector<uint32_t> chunks;
+	int            codec, level;
+	void write (Protobuf_writer &pw, unsigned opts) const;
+	void read (Protobuf_reader &pr);
+};
+
+// Options for Item::write(). item_data_pos writes the position with
+// tag_data_pos instead of tag_pos.
+enum { item_data_pos = 1 };
+
+// A chunk of a chunked archive. The digest is the keyed Blake2b of the
+// expanded chunk. Each chunk is compressed on its own.
+struct Chunk {
+	std::streamoff pos, comp_size, exp_size;
+	uint8_t        digest[32];
+	int            codec;
 	void write (Protobuf_writer &pw) const;
 	void read (Protobuf_reader &pr);
 };
 
+// The central directory.
+struct Pack_index {
+	std::vector<Item>  items;
+	std::vector<Chunk> chunks;
+	bool               compressed = false, chunked = false, indexed = false;
+	uint8_t            chunk_key[32] = {};
+	std::streamoff     cendir = 0;
+	std::streamoff     name_table = 0;     // Position of the name table.
+};
 
-void Item::write (Protobuf_writer &pw) const
+// The name of an item as it is stored, without leading dotdots.
+static const char * stored_name (const std::string &name)
 {
-	buffer<char, 300> b;
+	const char *cp = name.c_str();
+	while (cp[0] == '.' && cp[1] == '.' && cp[2] == '/') cp += 3;
+	return cp;
+}
 
-	pw.start_group (pack_item);
 
-	pw.write_uint (tag_pos, pos);
-	pw.write_uint (tag_compsz, comp_size);
-	pw.write_uint (tag_expsz, exp_size);
-	pw.write_uint (tag_mode, mode);
-	pw.write_uint (tag_mtime, mtime_us);
+// The name is written without leading dotdots and must not contain any
+// other dotdots.
+struct Item_name : Pb_string<tag_name, Protobuf_reader::needed_once, Item, &Item::name> {
+	static void write (Protobuf_writer &pw, const Item &x, unsigned) {
+		const char *cp = stored_name (x.name);
+		if (strstr (cp, "../") != 0) {
+			throw_rte (_("Path with .. embedded. This can be a security problem! %s"), x.name);
+		}
+		pw.write_string (tag_name, cp);
+	}
+	static void read (Protobuf_reader &pr, Item &x, uint32_t, uint64_t val) {
+		pr.get_string (x.name, val);
+		if (strstr (x.name.c_str(), "../") != 0) {
+			throw_rte (_("Path with .. embedded. This can be a security problem! %s"), x.name);
+		}
+	}
+};
 
-	// Remove leading dotdots from the written path.
-	const char *cp = name.c_str();
-	while (cp[0] == '.' && cp[1] == '.' && cp[2] == '/') cp += 3;
+// The codec and the level are written only if the item has its own codec.
+template <class T>
+struct Codec_field : Pb_uint<tag_codec, Protobuf_reader::optional_once, T, int, &T::codec> {
+	static void write (Protobuf_writer &pw, const T &x, unsigned) {
+		if (x.codec != codec_default) {
+			pw.write_uint (tag_codec, x.codec);
+		}
+	}
+	static void read (Protobuf_reader &, T &x, uint32_t, uint64_t val) {
+		if (val > codec_lz) {
+			throw_rte (_("Unknown codec %d in the packed archive."), val);
+		}
+		x.codec = val;
+	}
+};
+
+struct Item_level : Pb_uint<tag_level, Protobuf_reader::optional_once, Item, int, &Item::level> {
+	static void write (Protobuf_writer &pw, const Item &x, unsigned) {
+		if (x.codec != codec_default) {
+			pw.write_uint (tag_level, x.level);
+		}
+	}
+};
 
-	if (strstr (cp, "../") != 0) {
-		throw_rte (_("Path with .. embedded. This can be a security problem! %s"), name);
+// Older versions require tag_pos in each item. Archives that they would
+// extract wrongly have the position in tag_data_pos, so that they refuse
+// them. Item::read() checks that one of them is present.
+struct Item_pos : Pb_uint<tag_pos, Protobuf_reader::optional_once, Item, std::streamoff, &Item::pos> {
+	static void write (Protobuf_writer &pw, const Item &x, unsigned opts) {
+		if (!(opts & item_data_pos)) {
+			pw.write_uint (tag_pos, x.pos);
+		}
 	}
+};
 
-	pw.write_string (tag_name, cp);
+struct Item_data_pos : Pb_uint<tag_data_pos, Protobuf_reader::optional_once, Item,
+                               std::streamoff, &Item::pos> {
+	static void write (Protobuf_writer &pw, const Item &x, unsigned opts) {
+		if (opts & item_data_pos) {
+			pw.write_uint (tag_data_pos, x.pos);
+		}
+	}
+};
 
+typedef Pb_schema<Item,
+	Item_pos,
+	Item_data_pos,
+	Pb_uint<tag_compsz, Protobuf_reader::optional_once, Item, std::streamoff, &Item::comp_size>,
+	Pb_uint<tag_expsz, Protobuf_reader::needed_once, Item, std::streamoff, &Item::exp_size>,
+	Pb_uint<tag_mode, Protobuf_reader::needed_once, Item, uint32_t, &Item::mode>,
+	Pb_uint<tag_mtime, Protobuf_reader::needed_once, Item, uint64_t, &Item::mtime_us>,
+	Codec_field<Item>,
+	Item_level,
+	Item_name,
+	Pb_uint_list<tag_chunks, Protobuf_reader::optional_many, Item, uint32_t, &Item::chunks>
+> Item_schema;
+
+typedef Pb_schema<Chunk,
+	Pb_uint<tag_pos, Protobuf_reader::needed_once, Chunk, std::streamoff, &Chunk::pos>,
+	Pb_uint<tag_compsz, Protobuf_reader::needed_once, Chunk, std::streamoff, &Chunk::comp_size>,
+	Pb_uint<tag_expsz, Protobuf_reader::needed_once, Chunk, std::streamoff, &Chunk::exp_size>,
+	Pb_bytes<tag_digest, Protobuf_reader::needed_once, Chunk, 32, &Chunk::digest>,
+	Codec_field<Chunk>
+> Chunk_schema;
+
+
+void Item::write (Protobuf_writer &pw, unsigned opts) const
+{
+	pw.start_group (pack_item);
+	Item_schema::write (pw, *this, opts);
 	pw.end_group();
 }
 
 void Item::read (Protobuf_reader &pr)
 {
-	pos = comp_size = exp_size = 0;
+	pos = -1;
+	comp_size = exp_size = 0;
 	mode = 0;
 	name.clear();
+	chunks.clear();
+	codec = codec_default;
+	level = 0;
+	Item_schema::read (pr, *this);
+	if (pos < 0) {
+		throw_rte (_("Field %d is required."), tag_pos);
+	}
+}
 
-	uint32_t tagwt;
-	uint64_t val;
 
-	pr.add_requirement (tag_pos, pr.needed_once,
-	                    tag_compsz, pr.optional_once,
-	                    tag_expsz, pr.needed_once,
-	                    tag_mode, pr.needed_once,
-	                    tag_name, pr.needed_once,
-	                    tag_mtime, pr.needed_once);
+void Chunk::write (Protobuf_writer &pw) const
+{
+	pw.start_group (pack_chunk);
+	Chunk_schema::write (pw, *this);
+	pw.end_group();
+}
 
-	while (pr.read_tagval (&tagwt, &val)) {
-		switch (tagwt) {
-		case maketag (tag_pos, varint):
-			pos = val;
-			break;
+void Chunk::read (Protobuf_reader &pr)
+{
+	codec = codec_default;
+	Chunk_schema::read (pr, *this);
+}
 
-		case maketag (tag_compsz, varint):
-			comp_size = val;
-			break;
 
-		case maketag (tag_expsz, varint):
-			exp_size = val;
-			break;
+// Content defined chunking with FastCDC. The boundaries depend only on the
+// contents, therefore an insertion or deletion changes only the chunks
+// around it. The gear table is derived from the archive's chunk key. The
+// sizes of the chunks do not tell anything about the contents without the
+// key.
+class Chunker {
+	uint64_t gear[256];
+	uint8_t  key[32];
+public:
+	enum { min_size = 8 * 1024, normal_size = 32 * 1024, max_size = 128 * 1024 };
+
+	explicit Chunker (const uint8_t key[32]);
+	// Return the length of the first chunk of p[0..n[. If no boundary is
+	// found it returns n or max_size, whichever is smaller.
+	size_t cut (const uint8_t *p, size_t n) const;
+	// The keyed digest that identifies a chunk.
+	void digest (uint8_t out[32], const void *p, size_t n) const {
+		blake2b (out, 32, key, 32, p, n);
+	}
+};
 
-		case maketag (tag_mode, varint):
-			mode = val;
-			break;
+Chunker::Chunker (const uint8_t key[32])
+{
+	memcpy (this->key, key, 32);
+	for (unsigned i = 0; i < 256; i += 8) {
+		uint8_t b = i / 8, out[64];
+		blake2b (out, 64, key, 32, &b, 1);
+		for (unsigned j = 0; j < 8; ++j) {
+			gear[i + j] = leget64 (out + 8*j);
+		}
+	}
+}
 
-		case maketag (tag_mtime, varint):
-			mtime_us = val;
-			break;
+size_t Chunker::cut (const uint8_t *p, size_t n) const
+{
+	// More bits are tested before the normal size, so that the sizes
+	// cluster around it.
+	const uint64_t mask_s = 0xFFFF800000000000ULL;     // 17 bits
+	const uint64_t mask_l = 0xFFF8000000000000ULL;     // 13 bits
+
+	if (n <= min_size) return n;
+	if (n > max_size) n = max_size;
+	size_t normal = n < normal_size ? n : size_t(normal_size);
+
+	uint64_t h = 0;
+	size_t i = min_size;
+	for (; i < normal; ++i) {
+		h = (h << 1) + gear[p[i]];
+		if ((h & mask_s) == 0) return i + 1;
+	}
+	for (; i < n; ++i) {
+		h = (h << 1) + gear[p[i]];
+		if ((h & mask_l) == 0) return i + 1;
+	}
+	return n;
+}
 
-		case maketag (tag_name, length_val):
-			name.resize (val);
-			pr.get_bytes (&name[0], val);
-			if (strstr (name.c_str(), "../") != 0) {
-				throw_rte (_("Path with .. embedded. This can be a security problem! %s"), name);
-			}
-			break;
 
-		default:
-			pr.skip (tagwt, val);
-		}
+// Packing runs as a pipeline. The calling thread expands the names and then
+// writes the archive. Worker threads read and compress the files. Each file
+// is a Pack_job. The writer takes the jobs in order and appends the
+// compressed pieces as soon as they are available. Only a limited number of
+// jobs are in flight and each job holds a limited number of bytes. A worker
+// waits for the writer when its job is full. The jobs in flight use a ring
+// of slots that are reused once the writer has finished with them.
+// Therefore the memory use does not depend on the size or number of the
+// files. In a chunked archive each piece is a whole chunk with its digest.
+// The worker decides for each block whether compressing it pays. Data that
+// does not compress, like images or encrypted data, is stored without
+// spending time on it. The workers share a budget of cores. A worker takes
+// one for each job and a large deflated file also borrows the free ones
+// before each batch of its ZWrapper, which compresses it in parallel
+// blocks. Thus a huge file does not keep just one core busy while the
+// other workers have nothing to do.
+
+enum { pack_read = 100000,              // Bytes read from the file at once.
+       pack_probe = 16384,              // Bytes of each block tried first.
+       pack_job_cap = 1 << 20,          // Bytes waiting in a single job.
+       pack_jobs_per_thread = 2,        // Jobs in flight for each worker.
+       pack_default_level = 9,          // Level used by incremental_pack.
+       pack_parallel_size = 16 << 20 }; // Deflate larger files in parallel.
+
+struct Pack_piece {
+	std::vector<char> data;
+	uint64_t exp_size = 0;
+	uint8_t  digest[32];
+	int      codec = codec_stored;
+};
+
+struct Pack_job {
+	size_t index = 0;        // The file of this job.
+	struct stat st;
+	bool stat_ok = false;
+	bool started = false;    // st is valid and the file has been opened.
+	bool done = false;       // All the pieces have been queued.
+	std::deque<Pack_piece> pieces;
+	size_t queued = 0;       // Bytes in pieces.
+	uint64_t exp_size = 0;
+	int codec = codec_stored;
+	std::string error;       // Set if the worker failed.
+};
+
+class Pack_pipeline {
+	const std::vector<std::string> &names;
+	const std::vector<struct stat> &stats;
+	int level;
+	Zcodec zcodec;
+	const Chunker *chunker;
+	std::vector<Pack_job> jobs;  // The slots of the jobs in flight.
+	size_t next = 0;         // Next job for the workers.
+	size_t head = 0;         // Job being written.
+	size_t inflight;
+	unsigned ncores;         // Threads that the pipeline may use.
+	unsigned spare;          // Cores not used by any job.
+	bool stop = false;
+	std::mutex mtx;
+	std::condition_variable cv;
+	std::vector<std::thread> workers;
+
+	Pack_job & slot (size_t i) { return jobs[i % jobs.size()]; }
+	void work();
+	void run_job (size_t i);
+	void push (Pack_job &job, Pack_piece &piece);
+	void push_chunk (Pack_job &job, const char *p, size_t n, int codec);
+	unsigned borrow_cores();
+	void return_cores (unsigned n);
+
+public:
+	// Pack the files names, whose stat is in stats. Compress with zcodec at
+	// the given level, or not at all if the level is 0. If chunker is not
+	// null the files are split into chunks.
+	Pack_pipeline (const std::vector<std::string> &names, const std::vector<struct stat> &stats,
+	               int level, Zcodec zcodec, const Chunker *chunker);
+	int get_level() const { return level; }
+	// The codec of the compressed items and chunks.
+	int get_codec() const { return zcodec == zcodec_lz ? codec_lz : codec_deflate; }
+	~Pack_pipeline();
+
+	// Wait until the job i has been started by a worker and return it. The
+	// codec of a regular file is then known. Jobs must be requested in
+	// order.
+	const Pack_job & wait_start (size_t i);
+	// Move the next piece of job i into piece. Return false when there are
+	// no more pieces. Throws if the worker failed.
+	bool pop (size_t i, Pack_piece &piece);
+	// The writer has finished with job i.
+	void release (size_t i);
+};
+
+
+Pack_pipeline::Pack_pipeline (const std::vector<std::string> &names,
+                              const std::vector<struct stat> &stats, int level,
+                              Zcodec zcodec, const Chunker *chunker)
+	: names(names), stats(stats), level(level), zcodec(zcodec), chunker(chunker)
+{
+	ncores = std::thread::hardware_concurrency();
+	if (ncores == 0) ncores = 1;
+	spare = ncores;
+	unsigned nthreads = ncores;
+	if (nthreads > names.size()) nthreads = names.size();
+	inflight = nthreads * pack_jobs_per_thread;
+	jobs.resize (inflight);
+	for (unsigned i = 0; i < nthreads; ++i) {
+		workers.push_back (std::thread (&Pack_pipeline::work, this));
 	}
 }
 
+Pack_pipeline::~Pack_pipeline()
+{
+	{
+		std::lock_guard<std::mutex> lk(mtx);
+		stop = true;
+	}
+	cv.notify_all();
+	for (unsigned i = 0; i < workers.size(); ++i) {
+		workers[i].join();
+	}
+}
 
-// The packing and unpacking functions know nothing about encryption. They
-// just read and write using a std::istream or std::ostream.
-static
-void pack (std::ostream &os, int nf, char **files, bool compress, bool verbose)
+void Pack_pipeline::work()
 {
-	std::vector<Item> pos;
-	uint64_t count = 0;
-	char buf[100000];
+	for (;;) {
+		size_t i;
+		{
+			std::unique_lock<std::mutex> lk(mtx);
+			cv.wait (lk, [this] {
+				return stop || next >= names.size() || (next < head + inflight && spare > 0);
+			});
+			if (stop || next >= names.size()) return;
+			i = next++;
+			--spare;
+			// The writer has released the previous job of this slot.
+			Pack_job &job = slot (i);
+			job = Pack_job();
+			job.index = i;
+		}
+		try {
+			run_job (i);
+		} catch (std::exception &e) {
+			std::lock_guard<std::mutex> lk(mtx);
+			slot(i).error = e.what();
+			slot(i).started = slot(i).done = true;
+		}
+		return_cores (1);
+	}
+}
 
-	Protobuf_writer pw (&os, pw.seek, 100000);
+// Take all the cores that no job is using.
+unsigned Pack_pipeline::borrow_cores()
+{
+	std::lock_guard<std::mutex> lk(mtx);
+	unsigned n = spare;
+	spare = 0;
+	return n;
+}
 
-	// If the user just decrypts a packed archive then make sure that the
-	// first line shows that it is a binary packed archive
-	static const char header[] = "PACKED ARCHIVE\n\n";
-	pw.write_string (pack_header, header);
-	pw.write_uint (pack_flag, compress);
+void Pack_pipeline::return_cores (unsigned n)
+{
+	{
+		std::lock_guard<std::mutex> lk(mtx);
+		spare += n;
+	}
+	cv.notify_all();
+}
 
+void Pack_pipeline::push (Pack_job &job, Pack_piece &piece)
+{
+	std::unique_lock<std::mutex> lk(mtx);
+	cv.wait (lk, [&] { return stop || job.queued < pack_job_cap; });
+	if (stop) {
+		throw_rte (_("Packing cancelled."));
+	}
+	job.queued += piece.data.size();
+	job.pieces.push_back (Pack_piece());
+	Pack_piece &back = job.pieces.back();
+	back.data.swap (piece.data);
+	back.exp_size = piece.exp_size;
+	back.codec = piece.codec;
+	memcpy (back.digest, piece.digest, 32);
+	lk.unlock();
+	cv.notify_all();
+}
 
-	std::vector<std::string> expanded;
-	expand_files(nf, files, &expanded);
+// Compress p[0..n[ with zcodec at the given level into *out. Return true if
+// this saves at least 1/32 of the size.
+static bool compression_pays (const char *p, size_t n, int level, Zcodec zcodec,
+                              buffer<char, 0> *out)
+{
+	ZWrapper zw (level, zcodec);
+	zw.compress (p, n, out, true);
+	return out->size() + n / 32 < n;
+}
 
-	for (unsigned i = 0; i < expanded.size(); ++i) {
-		Item x;
-		x.name = expanded[i];
-		size_t exp_size = 0;
-		struct stat st;
-		if (stat(x.name.c_str(), &st) == 0) {
-			x.mode = st.st_mode;
-#ifdef _WIN32
-			x.mtime_us = st.st_mtime * 1000000;
-#else
-			x.mtime_us = st.st_mtim.tv_sec * 1000000 + st.st_mtim.tv_nsec/1000;
-#endif
-		} else {
-			x.mode = 0;
-			x.mtime_us = 0;
-		}
-		std::ifstream is;
-		if (S_ISREG(st.st_mode)) {
-			is.open (expanded[i].c_str(), is.binary);
-			if (!is) {
-				throw_rte (_("Error while opening input file %s"), expanded[i]);
+// Queue the chunk p[0..n[. If codec is not codec_stored the chunk is
+// compressed on its own, but it is stored as it is if compression does not
+// pay.
+void Pack_pipeline::push_chunk (Pack_job &job, const char *p, size_t n, int codec)
+{
+	Pack_piece piece;
+	piece.exp_size = n;
+	chunker->digest (piece.digest, p, n);
+	buffer<char, 0> outbuf;
+	if (codec != codec_stored && compression_pays (p, n, level, zcodec, &outbuf)) {
+		piece.codec = codec;
+		piece.data.assign (&outbuf[0], &outbuf[0] + outbuf.size());
+	} else {
+		piece.data.assign (p, p + n);
+	}
+	push (job, piece);
+}
+
+void Pack_pipeline::run_job (size_t i)
+{
+	Pack_job &job = slot (i);
+	const std::string &name = names[i];
+	struct stat st = stats[i];
+	bool stat_ok = true;
+	std::ifstream is;
+	if (S_ISREG(st.st_mode)) {
+		is.open (name.c_str(), is.binary);
+		if (!is) {
+			// The file may have been removed after the walk.
+			stat_ok = stat(name.c_str(), &st) == 0;
+			if (stat_ok) {
+				throw_rte (_("Error while opening input file %s"), name);
 			}
 		}
-
-		buffer<char, sizeof buf> outbuf;
-		ZWrapper zw;
-
-		if (verbose) {
-			std::cout << x.name << '\n';
+	}
+	if (!stat_ok || !S_ISREG(st.st_mode)) {
+		{
+			std::lock_guard<std::mutex> lk(mtx);
+			job.st = st;
+			job.stat_ok = stat_ok;
+			job.started = job.done = true;
 		}
+		cv.notify_all();
+		return;
+	}
 
-		pw.start_group (pack_file);
-		pw.write_string (tag_name, &x.name[0]);
-		pw.write_uint (tag_mode, x.mode);
-
-		size_t start_size = count;
+	std::vector<char> pending (pack_read);
+	is.read (&pending[0], pending.size());
+	pending.resize (is.gcount());
+	uint64_t exp_size = pending.size();
+	bool eof = !is;
+
+	// Each chunk is stored raw if compressing it does not pay. The files
+	// of other archives always use the codec of the archive, because older
+	// versions expand every file of a compressed archive. The blocks of a
+	// deflate stream that do not compress are stored in the stream with
+	// level 0. The lz codec does this by itself.
+	int codec = level > 0 ? get_codec() : codec_stored;
+	Pack_piece piece;
+	buffer<char, 0> outbuf;
+	bool whole = eof && !chunker;
+	if (whole && codec != codec_stored) {
+		if (!compression_pays (pending.data(), pending.size(), level, zcodec, &outbuf)
+		    && zcodec == zcodec_deflate) {
+			outbuf.clear();
+			ZWrapper zw (0, zcodec);
+			zw.compress (pending.data(), pending.size(), &outbuf, true);
+		}
+	}
 
-		if (S_ISREG(st.st_mode)) {
-			pw.start_group (tag_content);
-			pw.flush();
-			x.pos = os.tellp();
+	// The writer needs the codec before the contents.
+	{
+		std::lock_guard<std::mutex> lk(mtx);
+		job.st = st;
+		job.stat_ok = stat_ok;
+		job.codec = codec;
+		job.started = true;
+	}
+	cv.notify_all();
 
-			while (is) {
-				is.read(buf, sizeof buf);
+	if (whole) {
+		piece.codec = codec;
+		if (codec != codec_stored) {
+			piece.data.assign (&outbuf[0], &outbuf[0] + outbuf.size());
+		} else {
+			piece.data.swap (pending);
+		}
+		if (!piece.data.empty()) push (job, piece);
+	} else if (chunker) {
+		// Keep at least max_size bytes in pending so that the chunker
+		// sees the whole range where the next boundary may be.
+		size_t beg = 0;
+		for (;;) {
+			if (!eof && pending.size() - beg < size_t(Chunker::max_size)) {
+				pending.erase (pending.begin(), pending.begin() + beg);
+				beg = 0;
+				size_t have = pending.size();
+				pending.resize (have + pack_read);
+				is.read (&pending[have], pack_read);
+				pending.resize (have + is.gcount());
 				exp_size += is.gcount();
-				if (compress) {
-					zw.compress (buf, is.gcount(), &outbuf);
-					pw.add_bytes (&outbuf[0], outbuf.size());
-					count += outbuf.size();
+				eof = !is;
+				continue;
+			}
+			size_t n = pending.size() - beg;
+			if (n == 0) break;
+			n = chunker->cut ((const uint8_t*)&pending[beg], n);
+			push_chunk (job, &pending[beg], n, codec);
+			beg += n;
+		}
+	} else {
+		ZWrapper zw (level, zcodec);
+		bool parallel = zcodec == zcodec_deflate && st.st_size >= pack_parallel_size
+		                && ncores > 1;
+		if (parallel) {
+			zw.set_threads (ncores);
+		}
+		// Compress with the cores that are free now.
+		auto compress = [&] (const char *p, size_t n, bool finish) {
+			unsigned extra = 0;
+			if (parallel) {
+				extra = borrow_cores();
+				zw.set_threads (1 + extra);
+			}
+			outbuf.clear();
+			zw.compress (p, n, &outbuf, finish);
+			return_cores (extra);
+		};
+		piece.codec = codec;
+		for (;;) {
+			if (codec != codec_stored) {
+				if (zcodec == zcodec_deflate) {
+					// Try the start of the block at the fastest level.
+					size_t n = pending.size() < pack_probe ? pending.size() : size_t(pack_probe);
 					outbuf.clear();
-				} else {
-					pw.add_bytes (buf, is.gcount());
-					count += is.gcount();
+					bool pays = compression_pays (pending.data(), n, 1, zcodec, &outbuf);
+					zw.set_level (pays ? level : 0);
 				}
+				compress (pending.data(), pending.size(), false);
+				piece.data.assign (&outbuf[0], &outbuf[0] + outbuf.size());
+			} else {
+				piece.data.swap (pending);
 			}
-			if (compress) {
-				zw.flush(&outbuf);
-				pw.add_bytes (&outbuf[0], outbuf.size());
-				count += outbuf.size();
-			}
-			pw.end_group (true);
+			if (!piece.data.empty()) push (job, piece);
+			if (eof) break;
+			pending.resize (pack_read);
+			is.read (&pending[0], pending.size());
+			pending.resize (is.gcount());
+			exp_size += is.gcount();
+			eof = !is;
+		}
+		if (codec != codec_stored) {
+			compress (NULL, 0, true);
+			piece.data.assign (&outbuf[0], &outbuf[0] + outbuf.size());
+			if (!piece.data.empty()) push (job, piece);
 		}
-
-		pw.end_group();
-		pw.flush();
-
-		x.comp_size = count - start_size;
-		x.exp_size = exp_size;
-		pos.push_back(x);
 	}
-	count = os.tellp();
-
-	// Now write the central directory
-	int flag = compress ? 1 : 0;
-	pw.write_uint (pack_flag, flag);
 
-	pw.start_group (pack_dir);
-	for (unsigned i = 0; i < pos.size(); ++i) {
-		pos[i].write(pw);
-	}
-	pw.end_group();
-	pw.write_uint64 (pack_last, count);
+	std::lock_guard<std::mutex> lk(mtx);
+	job.exp_size = exp_size;
+	job.done = true;
 }
 
-
-
-void plain_pack (const char *oname, int nf, char **files, bool compress, bool verbose)
+const Pack_job & Pack_pipeline::wait_start (size_t i)
 {
-	std::ofstream os (oname, os.binary);
-	if (!os) {
-		throw_rte (_("Error while opening output file %s"), oname);
+	std::unique_lock<std::mutex> lk(mtx);
+	Pack_job &job = slot (i);
+	cv.wait (lk, [&] { return job.index == i && job.started; });
+	if (!job.error.empty()) {
+		throw std::runtime_error (job.error);
 	}
-	pack (os, nf, files, compress, verbose);
+	return job;
 }
 
-
-void sym_pack (const char *oname, int nf, char **files, std::string &password,
-               int bs, int bf, int shifts, bool compress, bool verbose)
+bool Pack_pipeline::pop (size_t i, Pack_piece &piece)
 {
-	if (password.empty()) {
-		get_password(_("Password for output file: "), password);
-		std::string p2;
-		get_password(_("Repeat the password: "), p2);
-		if (password != p2) {
-			throw_rte(_("The supplied passwords do not match!\n"));
-			return;
-		}
+	Pack_job &job = slot (i);
+	std::unique_lock<std::mutex> lk(mtx);
+	cv.wait (lk, [&] { return !job.pieces.empty() || job.done; });
+	if (!job.error.empty()) {
+		throw std::runtime_error (job.error);
 	}
-	amber::ofstream os(oname, password.c_str(), bs, bf, shifts);
-	if (!os) {
-		throw_rte (_("Error while opening output file %s"), oname);
+	if (job.pieces.empty()) {
+		return false;
 	}
-	pack (os, nf, files, compress, verbose);
+	Pack_piece &front = job.pieces.front();
+	piece.data.swap (front.data);
+	piece.exp_size = front.exp_size;
+	piece.codec = front.codec;
+	memcpy (piece.digest, front.digest, 32);
+	job.pieces.pop_front();
+	job.queued -= piece.data.size();
+	lk.unlock();
+	cv.notify_all();
+	return true;
 }
 
-
-void pub_pack (const char *oname, int nf, char **files, const Key &sender,
-               const Key_list &rx, int bs, int bf, bool compress, bool verbose, bool spoof)
+void Pack_pipeline::release (size_t i)
 {
-	std::vector<Cu25519Ris> curx(rx.size());
-	for (unsigned i = 0; i < rx.size(); ++i) curx[i] = rx[i].pair.xp;
-	amber::ofstream os;
-	if (spoof) {
-		os.open_spoof(oname, sender.pair, curx[0], curx.size() - 1, bs, bf);
-	} else {
-		os.open(oname, sender.pair, curx, bs, bf);
-	}
-	if (!os) {
-		throw_rte (_("Error while opening output file %s"), oname);
+	{
+		std::lock_guard<std::mutex> lk(mtx);
+		head = i + 1;
 	}
-	pack (os, nf, files, compress, verbose);
+	cv.notify_all();
 }
 
 
+// The chunks already stored in the archive, by digest.
+typedef std::unordered_map<std::string, uint32_t> Chunk_map;
 
-static void read_index (std::istream &is, std::vector<Item> &index, bool *compressed,
-                        std::streamoff *cendir=NULL)
+static void set_stat (Item &x, bool stat_ok, const struct stat &st)
 {
-	index.clear();
-	is.seekg (-8, is.end);
-	char buf[8];
-	is.read (buf, 8);
-	if (is.gcount() != 8) {
-		throw_rte (_("Cannot read the last 8 bytes of the file."));
+	if (stat_ok) {
+		x.mode = st.st_mode;
+#ifdef _WIN32
+		x.mtime_us = st.st_mtime * 1000000;
+#else
+		x.mtime_us = st.st_mtim.tv_sec * 1000000 + st.st_mtim.tv_nsec/1000;
+#endif
+	} else {
+		x.mode = 0;
+		x.mtime_us = 0;
 	}
+}
 
-	std::streamoff pos = leget64 (buf);
-	is.seekg(pos, is.beg);
-	if (!is) {
-		throw_rte (_("Cannot seek in the file."));
+// Write the file of job i of pipe as a pack_file group and fill x. The
+// chunks of a chunked archive that are not yet in known are stored and
+// added to ix.chunks and known.
+static void write_file (Protobuf_writer &pw, std::ostream &os, Pack_pipeline &pipe,
+                        size_t i, Item &x, Pack_index &ix, Chunk_map &known, bool verbose)
+{
+	const Pack_job &job = pipe.wait_start (i);
+	const struct stat &st = job.st;
+	set_stat (x, job.stat_ok, st);
+	x.pos = x.comp_size = x.exp_size = 0;
+	x.chunks.clear();
+
+	if (verbose) {
+		std::cout << x.name << '\n';
 	}
 
-	if (cendir) {
-		*cendir = pos;
+	pw.start_group (pack_file);
+	pw.write_string (tag_name, &x.name[0]);
+	pw.write_uint (tag_mode, x.mode);
+	pw.write_uint (tag_mtime, x.mtime_us);
+	if (job.stat_ok && S_ISREG(st.st_mode) && !ix.chunked) {
+		// Needed to unpack from a stream.
+		pw.write_uint (tag_codec, job.codec);
 	}
 
-	Protobuf_reader pr (&is);
+	Pack_piece piece;
+	if (job.stat_ok && S_ISREG(st.st_mode) && ix.chunked) {
+		while (pipe.pop (i, piece)) {
+			std::string dg ((const char*)piece.digest, 32);
+			Chunk_map::const_iterator it = known.find (dg);
+			if (it != known.end()) {
+				x.chunks.push_back (it->second);
+				continue;
+			}
+			Chunk c;
+			pw.start_group (tag_chunk);
+			pw.flush();
+			c.pos = os.tellp();
+			pw.add_bytes (&piece.data[0], piece.data.size());
+			pw.end_group (true);
+			c.comp_size = piece.data.size();
+			c.exp_size = piece.exp_size;
+			c.codec = piece.codec;
+			memcpy (c.digest, piece.digest, 32);
+			x.chunks.push_back (ix.chunks.size());
+			known[dg] = ix.chunks.size();
+			ix.chunks.push_back (c);
+			x.comp_size += c.comp_size;
+		}
+	} else if (job.stat_ok && S_ISREG(st.st_mode)) {
+		pw.start_group (tag_content);
+		pw.flush();
+		x.pos = os.tellp();
 
-	Item x;
-	uint32_t tagwt;
+		while (pipe.pop (i, piece)) {
+			pw.add_bytes (&piece.data[0], piece.data.size());
+			x.comp_size += piece.data.size();
+		}
+		pw.end_group (true);
+	}
+
+	pw.end_group();
+	pw.flush();
+
+	x.exp_size = job.exp_size;
+	x.codec = job.codec;
+	x.level = job.codec == codec_deflate ? pipe.get_level() : 0;
+	pipe.release (i);
+}
+
+// Older versions extract each file by inflating it if bit 0 of the flag is
+// set and by copying it otherwise. They ignore the chunks and the codecs.
+static bool old_readable (const Pack_index &ix)
+{
+	if (ix.chunked) return false;
+	int codec = ix.compressed ? codec_deflate : codec_stored;
+	for (const Item &x : ix.items) {
+		if (S_ISREG(x.mode) && x.codec != codec_default && x.codec != codec) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static int pack_flags (const Pack_index &ix)
+{
+	return (ix.compressed ? flag_compressed : 0) | (ix.chunked ? flag_chunked : 0)
+	       | flag_indexed | flag_item_codec;
+}
+
+
+// The name table follows the pack_dir group of the central directory. It
+// lets the reader find an item by name without reading the whole directory.
+// It contains the number of items n, then n+1 entries of 16 bytes and then
+// the names. The entries are sorted by the name and then by the position of
+// the item. Each entry has the position in the stream of the pack_item group
+// and the offset of its name within the names. The last entry has only the
+// total size of the names. The name of the entry k is the range between
+// the offsets of the entries k and k+1. All the numbers are in little
+// endian order. The position of the table is stored as pack_name_index just
+// before pack_last.
+
+enum { name_entry_size = 16 };
+
+static void write_name_table (Protobuf_writer &pw, std::ostream &os, const Pack_index &ix,
+                              const std::vector<std::streamoff> &item_pos)
+{
+	const std::vector<Item> &items = ix.items;
+	std::vector<uint32_t> order (items.size());
+	for (unsigned i = 0; i < order.size(); ++i) order[i] = i;
+	std::stable_sort (order.begin(), order.end(), [&items](uint32_t a, uint32_t b) {
+		return strcmp (stored_name (items[a].name), stored_name (items[b].name)) < 0;
+	});
+
+	pw.start_group (pack_name_table);
+	pw.flush();
+	uint64_t table = os.tellp();
+
+	char buf[name_entry_size];
+	leput64 (buf, items.size());
+	pw.add_bytes (buf, 8);
+	uint64_t off = 0;
+	for (unsigned i = 0; i < order.size(); ++i) {
+		leput64 (buf, item_pos[order[i]]);
+		leput64 (buf + 8, off);
+		pw.add_bytes (buf, name_entry_size);
+		off += strlen (stored_name (items[order[i]].name));
+	}
+	leput64 (buf, 0);
+	leput64 (buf + 8, off);
+	pw.add_bytes (buf, name_entry_size);
+	for (unsigned i = 0; i < order.size(); ++i) {
+		const char *cp = stored_name (items[order[i]].name);
+		pw.add_bytes (cp, strlen(cp));
+	}
+	pw.end_group (true);
+
+	pw.write_uint64 (pack_name_index, table);
+}
+
+// Write the central directory with the items and chunks of ix.
+static void write_cendir (Protobuf_writer &pw, std::ostream &os, const Pack_index &ix)
+{
+	pw.flush();
+	uint64_t count = os.tellp();
+
+	pw.write_uint (pack_flag, pack_flags (ix));
+
+	// Record where each item starts for the name table.
+	std::vector<std::streamoff> item_pos (ix.items.size());
+	unsigned opts = old_readable (ix) ? 0 : item_data_pos;
+	pw.start_group (pack_dir);
+	for (unsigned i = 0; i < ix.items.size(); ++i) {
+		pw.flush();
+		item_pos[i] = os.tellp();
+		ix.items[i].write (pw, opts);
+	}
+	pw.end_group();
+
+	// The chunks come after the items so that older versions reach the
+	// items and refuse them instead of stopping at the chunk list.
+	if (ix.chunked) {
+		pw.write_bytes (pack_chunk_key, ix.chunk_key, 32);
+		pw.start_group (pack_chunk_list);
+		for (unsigned i = 0; i < ix.chunks.size(); ++i) {
+			ix.chunks[i].write (pw);
+		}
+		pw.end_group();
+	}
+	write_name_table (pw, os, ix, item_pos);
+	pw.write_uint64 (pack_last, count);
+}
+
+
+// The packing and unpacking functions know nothing about encryption. They
+// just read and write using a std::istream or std::ostream. If dedup is set
+// the files are split into chunks and each distinct chunk is stored once.
+// The compressed files or chunks use zcodec.
+static
+void pack (std::ostream &os, int nf, char **files, bool compress, bool verbose,
+           bool dedup, int zlevel, Zcodec zcodec)
+{
+	if (zlevel < 1 || zlevel > 9) {
+		throw std::invalid_argument (_("The compression level must be between 1 and 9."));
+	}
+	Pack_index ix;
+	ix.compressed = compress;
+	ix.chunked = dedup;
+	std::unique_ptr<Chunker> chunker;
+	if (dedup) {
+		randombytes_buf (ix.chunk_key, 32);
+		chunker.reset (new Chunker (ix.chunk_key));
+	}
+	Chunk_map known;
+
+	Protobuf_writer pw (&os, pw.seek, 100000);
+
+	// If the user just decrypts a packed archive then make sure that the
+	// first line shows that it is a binary packed archive
+	static const char header[] = "PACKED ARCHIVE\n\n";
+	pw.write_string (pack_header, header);
+	pw.write_uint (pack_flag, pack_flags (ix));
+
+
+	std::vector<std::string> expanded;
+	std::vector<struct stat> stats;
+	expand_files(nf, files, &expanded, &stats);
+
+	Pack_pipeline pipe (expanded, stats, compress ? zlevel : 0, zcodec, chunker.get());
+
+	ix.items.resize (expanded.size());
+	for (unsigned i = 0; i < expanded.size(); ++i) {
+		ix.items[i].name = expanded[i];
+		write_file (pw, os, pipe, i, ix.items[i], ix, known, verbose);
+	}
+
+	write_cendir (pw, os, ix);
+}
+
+
+
+void plain_pack (const char *oname, int nf, char **files, bool compress, bool verbose,
+                 bool dedup, int zlevel, Zcodec zcodec)
+{
+	std::ofstream os (oname, os.binary);
+	if (!os) {
+		throw_rte (_("Error while opening output file %s"), oname);
+	}
+	pack (os, nf, files, compress, verbose, dedup, zlevel, zcodec);
+}
+
+
+void sym_pack (const char *oname, int nf, char **files, std::string &password,
+               int bs, int bf, int shifts, bool compress, bool verbose, bool dedup,
+               int zlevel, Zcodec zcodec)
+{
+	if (password.empty()) {
+		get_password(_("Password for output file: "), password);
+		std::string p2;
+		get_password(_("Repeat the password: "), p2);
+		if (password != p2) {
+			throw_rte(_("The supplied passwords do not match!\n"));
+			return;
+		}
+	}
+	amber::ofstream os(oname, password.c_str(), bs, bf, shifts);
+	if (!os) {
+		throw_rte (_("Error while opening output file %s"), oname);
+	}
+	pack (os, nf, files, compress, verbose, dedup, zlevel, zcodec);
+}
+
+
+void pub_pack (const char *oname, int nf, char **files, const Key &sender,
+               const Key_list &rx, int bs, int bf, bool compress, bool verbose, bool spoof,
+               bool dedup, int zlevel, Zcodec zcodec)
+{
+	std::vector<Cu25519Ris> curx(rx.size());
+	for (unsigned i = 0; i < rx.size(); ++i) curx[i] = rx[i].pair.xp;
+	amber::ofstream os;
+	if (spoof) {
+		os.open_spoof(oname, sender.pair, curx[0], curx.size() - 1, bs, bf);
+	} else {
+		os.open(oname, sender.pair, curx, bs, bf);
+	}
+	if (!os) {
+		throw_rte (_("Error while opening output file %s"), oname);
+	}
+	pack (os, nf, files, compress, verbose, dedup, zlevel, zcodec);
+}
+
+
+
+// Read the central directory. If items is false the pack_dir group is not
+// read and ix.items is left empty. The items can then be found with a
+// Name_table if ix.indexed is set.
+static void read_index (std::istream &is, Pack_index &ix, bool items=true)
+{
+	ix.items.clear();
+	ix.chunks.clear();
+	ix.compressed = ix.chunked = ix.indexed = false;
+	ix.name_table = 0;
+
+	// The position of the name table, if present, comes just before the
+	// position of the central directory.
+	char buf[18];
+	is.seekg (-18, is.end);
+	if (is) {
+		is.read (buf, 18);
+	}
+	if (!is || is.gcount() != 18) {
+		is.clear();
+		is.seekg (-8, is.end);
+		is.read (buf + 10, 8);
+		if (is.gcount() != 8) {
+			throw_rte (_("Cannot read the last 8 bytes of the file."));
+		}
+	} else if (uint8_t(buf[0]) == maketag (pack_name_index, fixed64)) {
+		ix.name_table = leget64 (buf + 1);
+	}
+
+	std::streamoff pos = leget64 (buf + 10);
+	is.seekg(pos, is.beg);
+	if (!is) {
+		throw_rte (_("Cannot seek in the file."));
+	}
+
+	ix.cendir = pos;
+
+	// If all the items are needed read the whole directory at once and
+	// parse it from memory. The names are then copied straight from the
+	// buffer.
+	std::string dir;
+	Protobuf_reader pr;
+	if (items) {
+		is.seekg (0, is.end);
+		std::streamoff end = is.tellg();
+		is.seekg (pos, is.beg);
+		if (!is || end < pos) {
+			throw_rte (_("Cannot seek in the file."));
+		}
+		dir.resize (end - pos);
+		is.read (&dir[0], dir.size());
+		if (size_t(is.gcount()) != dir.size()) {
+			throw_rte (_("Cannot read the central directory."));
+		}
+		pr.set_input (dir.data(), dir.size());
+	} else {
+		pr.set_input (&is);
+	}
+
+	Item x;
+	Chunk c;
+	uint32_t tagwt;
 	uint64_t val;
 	bool more = true;
+	bool dir_read = false, chunks_read = false;
 
 	while (more && pr.read_tagval (&tagwt, &val)) {
 		switch (tagwt) {
 		case maketag (pack_flag, varint):
-			*compressed = val & 1;
+			if (val & ~uint64_t(flag_known)) {
+				throw_rte (_("Unknown packed archive format."));
+			}
+			ix.compressed = val & flag_compressed;
+			ix.chunked = val & flag_chunked;
+			ix.indexed = val & flag_indexed;
+			if (ix.indexed && ix.name_table == 0) {
+				throw_rte (_("The packed archive has no name table."));
+			}
 			break;
 
-		case maketag (pack_dir, group_len):
+		case maketag (pack_chunk_key, length_val):
+			if (val != 32) {
+				throw_rte (_("Wrong size of the chunk key."));
+			}
+			pr.get_bytes (ix.chunk_key, 32);
+			break;
+
+		case maketag (pack_chunk_list, group_len):
 			while (pr.read_tagval (&tagwt, &val)) {
 				switch (tagwt) {
-				case maketag (pack_item, group_len):
-					x.read (pr);
-					index.push_back (x);
+				case maketag (pack_chunk, group_len):
+					c.read (pr);
+					ix.chunks.push_back (c);
 					break;
 
 				default:
 					pr.skip (tagwt, val);
 				}
 			}
-			more = false;
+			chunks_read = true;
+			more = !dir_read;
 			break;
 
-		default:
-			pr.skip (tagwt, val);
+		case maketag (pack_dir, group_len):
+			if (!items) {
+				pr.skip (tagwt, val);
+			} else {
+				while (pr.read_tagval (&tagwt, &val)) {
+					switch (tagwt) {
+					case maketag (pack_item, group_len):
+						x.read (pr);
+						ix.items.push_back (x);
+						break;
+
+					default:
+						pr.skip (tagwt, val);
+					}
+				}
+			}
+			dir_read = true;
+			more = ix.chunked && !chunks_read;
+			break;
+
+		default:
+			pr.skip (tagwt, val);
+		}
+	}
+
+	for (const Item &y : ix.items) {
+		for (unsigned i = 0; i < y.chunks.size(); ++i) {
+			if (y.chunks[i] >= ix.chunks.size()) {
+				throw_rte (_("The packed archive refers to a missing chunk."));
+			}
+		}
+	}
+}
+
+// This is C90/C++98 compliant. The one below is C99/C++11.
+static const char time_format[] = "%Y-%m-%d %H:%M:%S %z";
+//static const char time_format[] = "%F %T %z";
+
+static void pack_list (std::istream &is)
+{
+	Pack_index ix;
+	read_index (is, ix);
+	const std::vector<Item> &index = ix.items;
+
+	if (ix.compressed) {
+		std::cout << _("Compressed packed file\n");
+	}
+	if (ix.chunked) {
+		format (std::cout, _("Deduplicated packed file with %d chunks\n"), ix.chunks.size());
+	}
+	std::cout << _("Comp. sz   Exp. sz   Mode         MTime              Name\n");
+	std::streamoff comp_total = 0, exp_total = 0;
+	for (unsigned i = 0; i < index.size(); ++i) {
+		char tb[100];
+		time_t ts = index[i].mtime_us / 1000000;
+		strftime (tb, sizeof tb, time_format , localtime(&ts));
+		format (std::cout, "%8u %9u %06o %s  %s\n", index[i].comp_size,
+		        index[i].exp_size, index[i].mode, tb, index[i].name);
+		comp_total += index[i].comp_size;
+		exp_total += index[i].exp_size;
+	}
+	format(std::cout, _("Compressed size: %d    Expanded size: %d\n"),
+	        comp_total, exp_total);
+}
+
+
+void plain_pack_list (const char *iname)
+{
+	std::ifstream is(iname, is.binary);
+	if (!is) {
+		throw_rte (_("Error while opening input file %s"), iname);
+	}
+	pack_list (is);
+}
+
+
+void sym_pack_list (const char *iname, std::string &password, int shifts_max)
+{
+	if (password.empty()) {
+		get_password(_("Password for packed file: "), password);
+	}
+	amber::ifstream is(iname, password.c_str(), shifts_max);
+	if (!is) {
+		throw_rte (_("Error while opening input file %s"), iname);
+	}
+	pack_list (is);
+}
+
+
+void pub_pack_list (const char *iname, const Key &rx, Cu25519Ris *sender, int *nrx)
+{
+	amber::ifstream is(iname, rx.pair, sender, nrx);
+	if (!is) {
+		throw_rte (_("Error while opening input file %s"), iname);
+	}
+	pack_list (is);
+}
+
+
+static void make_paths (const char *name)
+{
+	if (*name == 0) return;
+
+	const char *beg = name;
+	const char *end = name + 1;
+	std::string path;
+
+	while (*end) {
+		while (*end && *end != '/') ++end;
+		if (*end != '/') return;
+		path.append (beg, end);
+#ifdef _WIN32
+		mkdir (path.c_str());
+#else
+		mkdir (path.c_str(), 0755);
+#endif      
+		path.append ("/");
+		beg = end + 1;
+		end = beg;
+	}
+}
+
+#ifdef _WIN32
+#define utimes(n,t)
+#endif
+
+// Set the mode and mtime of the unpacked file or directory.
+static void set_metadata (const Item &x)
+{
+	chmod(x.name.c_str(), x.mode & 0777);
+	timeval tv[2];
+	tv[0].tv_sec = x.mtime_us/1000000;
+	tv[0].tv_usec = x.mtime_us % 1000000;
+	tv[1] = tv[0];
+	utimes (x.name.c_str(), tv);
+}
+
+// The codec of an item or chunk.
+static int stored_codec (int codec, const Pack_index &ix)
+{
+	if (codec == codec_default) {
+		return ix.compressed ? codec_deflate : codec_stored;
+	}
+	return codec;
+}
+
+// Reads exactly n bytes into buf or throws.
+typedef std::function<void(char *buf, size_t n)> Read_fn;
+
+// Write to os comp_size bytes obtained from read, expanding them if they are
+// compressed with codec. Return the number of bytes written.
+static std::streamoff expand_stored (const Read_fn &read, std::streamoff comp_size, int codec,
+                                     std::ostream &os)
+{
+	char buf[10000];
+
+	bool compressed = codec != codec_stored;
+	ZWrapper zw (9, codec == codec_lz ? zcodec_lz : zcodec_deflate);
+	buffer<char, sizeof(buf) * 2> outbuf;
+	std::streamoff written = 0;
+
+	std::streamoff pending = comp_size;
+	while (pending > 0) {
+		long toread = pending > std::streamoff(sizeof(buf)) ? sizeof(buf) : pending;
+		read (buf, toread);
+
+		if (compressed) {
+			if (zw.expand(buf, toread, &outbuf) != 0) {
+				throw_rte (_("The compressed data in the packed archive is damaged."));
+			}
+			os.write(&outbuf[0], outbuf.size());
+			written += outbuf.size();
+			outbuf.clear();
+		} else {
+			os.write(buf, toread);
+			written += toread;
+		}
+		pending -= toread;
+	}
+
+	if (compressed) {
+		if (zw.flush(&outbuf) != 0 || !zw.finished()) {
+			throw_rte (_("The compressed data in the packed archive is damaged."));
+		}
+		os.write(&outbuf[0], outbuf.size());
+		written += outbuf.size();
+	}
+	return written;
+}
+
+// Write to os the comp_size bytes stored at pos, expanding them if they are
+// compressed with codec.
+static void copy_stored (std::istream &src, std::streamoff pos, std::streamoff comp_size,
+                         int codec, std::ostream &os)
+{
+	src.seekg(pos);
+	if (!src) {
+		throw_rte (_("Cannot seek in the source file."));
+	}
+	expand_stored ([&src](char *buf, size_t n) {
+		src.read(buf, n);
+		if (size_t(src.gcount()) != n) {
+			throw_rte (_("Cannot read from the input file."));
+		}
+	}, comp_size, codec, os);
+}
+
+static void unpack_file (std::istream &src, const Item &x, const Pack_index &ix, bool console)
+{
+	std::ostream *pos;
+	std::ofstream fos;
+	if (console) {
+		pos = &std::cout;
+	} else {
+		if (S_ISDIR(x.mode)) {
+			std::string ts = x.name + "/.";
+			make_paths (ts.c_str());
+			set_metadata (x);
+			// These times will be preseved only if no further files are
+			// written to the directory.
+			return;
+		}
+
+		fos.open(x.name.c_str(), fos.binary);
+		if (!fos) {
+			make_paths(x.name.c_str());
+			fos.open(x.name.c_str(), fos.binary);
+			if (!fos)
+			throw_rte (_("Cannot create the file %s"), x.name);
+		}
+		pos = &fos;
+	}
+
+	if (ix.chunked) {
+		for (unsigned i = 0; i < x.chunks.size(); ++i) {
+			const Chunk &c = ix.chunks[x.chunks[i]];
+			copy_stored (src, c.pos, c.comp_size, stored_codec (c.codec, ix), *pos);
+		}
+	} else {
+		copy_stored (src, x.pos, x.comp_size, stored_codec (x.codec, ix), *pos);
+	}
+
+	if (pos == &fos) {
+		fos.close();
+		set_metadata (x);
+	}
+}
+
+
+// Each worker of unpack_items() reads the archive through its own stream,
+// which is created by a Reopen function.
+typedef std::function<std::unique_ptr<std::istream>()> Reopen;
+
+// Unpack the items. When writing to the console the items are written in
+// order. Otherwise the files are shared among worker threads, each one with
+// its own stream from reopen. The directories are created first and their
+// mode and mtime are set at the end, after all the files in them have been
+// written. If verbose, announce is called before unpacking each item.
+static void unpack_items (std::istream &is, const std::vector<const Item*> &items,
+                          const Pack_index &ix, bool console, bool verbose,
+                          void (*announce)(const Item&), const Reopen &reopen)
+{
+	unsigned nthreads = std::thread::hardware_concurrency();
+	if (nthreads > items.size()) nthreads = items.size();
+	if (console || nthreads <= 1 || !reopen) {
+		for (unsigned i = 0; i < items.size(); ++i) {
+			if (verbose) announce (*items[i]);
+			unpack_file (is, *items[i], ix, console);
+		}
+		return;
+	}
+
+	std::vector<const Item*> files;
+	for (unsigned i = 0; i < items.size(); ++i) {
+		if (S_ISDIR(items[i]->mode)) {
+			std::string ts = items[i]->name + "/.";
+			make_paths (ts.c_str());
+		} else {
+			files.push_back (items[i]);
+		}
+	}
+
+	// The readers are opened here because reopen may use is.
+	std::vector<std::unique_ptr<std::istream> > readers;
+	readers.push_back (std::unique_ptr<std::istream>());
+	for (unsigned i = 1; i < nthreads; ++i) {
+		readers.push_back (reopen());
+	}
+
+	std::mutex mtx;
+	size_t next = 0;
+	std::string error;
+	auto work = [&](std::istream &src) {
+		for (;;) {
+			const Item *x;
+			{
+				std::lock_guard<std::mutex> lk(mtx);
+				if (next >= files.size() || !error.empty()) return;
+				x = files[next++];
+				if (verbose) announce (*x);
+			}
+			try {
+				unpack_file (src, *x, ix, false);
+			} catch (std::exception &e) {
+				std::lock_guard<std::mutex> lk(mtx);
+				if (error.empty()) error = e.what();
+			}
+		}
+	};
+
+	std::vector<std::thread> pool;
+	for (unsigned i = 1; i < nthreads; ++i) {
+		pool.push_back (std::thread (work, std::ref (*readers[i])));
+	}
+	work (is);
+	for (unsigned i = 0; i < pool.size(); ++i) {
+		pool[i].join();
+	}
+	if (!error.empty()) {
+		throw std::runtime_error (error);
+	}
+
+	for (unsigned i = 0; i < items.size(); ++i) {
+		if (S_ISDIR(items[i]->mode)) {
+			if (verbose) announce (*items[i]);
+			set_metadata (*items[i]);
+		}
+	}
+}
+
+// Reopen functions for the plain and encrypted archives.
+static Reopen reopen_plain (const char *packed)
+{
+	return [packed]() {
+		std::unique_ptr<std::istream> p (new std::ifstream (packed, std::ios_base::binary));
+		if (!*p) {
+			throw_rte (_("Error while opening input file %s"), packed);
+		}
+		return p;
+	};
+}
+
+static Reopen reopen_encrypted (const char *packed, const amber::ifstream &is)
+{
+	return [packed, &is]() {
+		std::unique_ptr<amber::ifstream> p (new amber::ifstream);
+		p->open (packed, is);
+		return std::unique_ptr<std::istream> (p.release());
+	};
+}
+
+
+static void announce_name (const Item &x)
+{
+	std::cout << x.name << '\n';
+}
+
+// Binary search in the name table of an indexed archive. Each probe reads
+// one entry and one name from the stream.
+class Name_table {
+	std::istream &is;
+	std::streamoff table, names;
+	uint64_t count;
+
+public:
+	Name_table (std::istream &is, const Pack_index &ix);
+	uint64_t size() const { return count; }
+	// Get the name and the position of the item of the entry k.
+	void get (uint64_t k, std::string &name, std::streamoff *item_pos);
+	// The first entry whose name is not less than name.
+	uint64_t lower_bound (const std::string &name);
+	// Read the item at item_pos.
+	void read_item (std::streamoff item_pos, const Pack_index &ix, Item &x);
+};
+
+Name_table::Name_table (std::istream &is, const Pack_index &ix)
+	: is(is), table(ix.name_table + 8)
+{
+	char buf[8];
+	is.seekg (ix.name_table);
+	is.read (buf, 8);
+	if (is.gcount() != 8) {
+		throw_rte (_("Cannot read the name table."));
+	}
+	count = leget64 (buf);
+	names = table + (count + 1) * name_entry_size;
+}
+
+void Name_table::get (uint64_t k, std::string &name, std::streamoff *item_pos)
+{
+	char buf[2 * name_entry_size];
+	is.seekg (table + k * name_entry_size);
+	is.read (buf, sizeof buf);
+	if (is.gcount() != sizeof buf) {
+		throw_rte (_("Cannot read the name table."));
+	}
+	*item_pos = leget64 (buf);
+	uint64_t beg = leget64 (buf + 8);
+	uint64_t end = leget64 (buf + name_entry_size + 8);
+	if (end < beg || end - beg > 0x10000) {
+		throw_rte (_("The name table is corrupt."));
+	}
+	name.resize (end - beg);
+	is.seekg (names + beg);
+	is.read (&name[0], name.size());
+	if (size_t(is.gcount()) != name.size()) {
+		throw_rte (_("Cannot read the name table."));
+	}
+}
+
+uint64_t Name_table::lower_bound (const std::string &name)
+{
+	uint64_t lo = 0, hi = count;
+	std::string probe;
+	std::streamoff pos;
+	while (lo < hi) {
+		uint64_t mid = lo + (hi - lo) / 2;
+		get (mid, probe, &pos);
+		if (probe < name) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+void Name_table::read_item (std::streamoff item_pos, const Pack_index &ix, Item &x)
+{
+	is.seekg (item_pos);
+	if (!is) {
+		throw_rte (_("Cannot seek in the file."));
+	}
+	Protobuf_reader pr (&is);
+	uint32_t tagwt;
+	uint64_t val;
+	if (!pr.read_tagval (&tagwt, &val) || tagwt != maketag (pack_item, group_len)) {
+		throw_rte (_("The name table is corrupt."));
+	}
+	x.read (pr);
+	for (unsigned i = 0; i < x.chunks.size(); ++i) {
+		if (x.chunks[i] >= ix.chunks.size()) {
+			throw_rte (_("The packed archive refers to a missing chunk."));
 		}
 	}
 }
 
-// This is C90/C++98 compliant. The one below is C99/C++11.
-static const char time_format[] = "%Y-%m-%d %H:%M:%S %z";
-//static const char time_format[] = "%F %T %z";
 
-static void pack_list (std::istream &is)
+// Find the requested files or directories in an indexed archive. Only the
+// matching items are read. They are put in the order of the archive.
+static void find_indexed (std::istream &is, Pack_index &ix, int nf, char **files)
 {
-	std::vector<Item> index;
-	bool compressed;
-	read_index (is, index, &compressed);
+	Name_table nt (is, ix);
+	std::vector<std::streamoff> found;
+	std::string name;
+	std::streamoff item_pos;
+	for (int i = 0; i < nf; ++i) {
+		std::string file = files[i];
+		uint64_t k = nt.lower_bound (file);
+		if (k < nt.size()) {
+			nt.get (k, name, &item_pos);
+			if (name == file) {
+				found.push_back (item_pos);
+			}
+		}
+		// The contents of a directory follow the entries that are equal to
+		// the prefix dir/.
+		file += '/';
+		for (k = nt.lower_bound (file); k < nt.size(); ++k) {
+			nt.get (k, name, &item_pos);
+			if (name.compare (0, file.size(), file) != 0) break;
+			found.push_back (item_pos);
+		}
+	}
+	std::sort (found.begin(), found.end());
+	found.erase (std::unique (found.begin(), found.end()), found.end());
 
-	if (compressed) {
-		std::cout << _("Compressed packed file\n");
+	ix.items.resize (found.size());
+	for (unsigned i = 0; i < found.size(); ++i) {
+		nt.read_item (found[i], ix, ix.items[i]);
 	}
-	std::cout << _("Comp. sz   Exp. sz   Mode         MTime              Name\n");
-	std::streamoff comp_total = 0, exp_total = 0;
-	for (unsigned i = 0; i < index.size(); ++i) {
-		char tb[100];
-		time_t ts = index[i].mtime_us / 1000000;
-		strftime (tb, sizeof tb, time_format , localtime(&ts));
-		format (std::cout, "%8u %9u %06o %s  %s\n", index[i].comp_size,
-		        index[i].exp_size, index[i].mode, tb, index[i].name);
-		comp_total += index[i].comp_size;
-		exp_total += index[i].exp_size;
+}
+
+static void unpack (std::istream &is, int nf, char **files, bool verbose, bool console,
+                    const Reopen &reopen)
+{
+	Pack_index ix;
+	read_index (is, ix, false);
+	if (ix.indexed) {
+		find_indexed (is, ix, nf, files);
+		std::vector<const Item*> items (ix.items.size());
+		for (unsigned j = 0; j < ix.items.size(); ++j) {
+			items[j] = &ix.items[j];
+		}
+		unpack_items (is, items, ix, console, verbose, announce_name, reopen);
+		return;
 	}
-	format(std::cout, _("Compressed size: %d    Expanded size: %d\n"),
-	        comp_total, exp_total);
+
+	read_index (is, ix);
+	const std::vector<Item> &index = ix.items;
+
+	std::vector<const Item*> items;
+	for (int i = 0; i < nf; ++i) {
+		size_t flen = strlen(files[i]);
+		for (unsigned j = 0; j < index.size(); ++j) {
+			if (index[j].name == files[i]) {
+				items.push_back (&index[j]);
+				break;
+			} else if (strncmp(index[j].name.c_str(), files[i], flen) == 0 && index[j].name[flen] == '/') {
+				items.push_back (&index[j]);
+			}
+		}
+	}
+	unpack_items (is, items, ix, console, verbose, announce_name, reopen);
 }
 
 
-void plain_pack_list (const char *iname)
+// Unpacking from a stream that cannot seek, like a pipe. The pack_file
+// groups are extracted as they arrive. The central directory at the end is
+// then used to check them and to set the mode and mtime. Files that were
+// replaced by an incremental pack are overwritten by their later version
+// and the files that are not in the directory any more are removed. The
+// contents of chunked archives are only described by the directory,
+// therefore they cannot be unpacked in this way.
+
+// A read only streambuf that reads from src in large blocks and keeps track
+// of the position. It can seek forward by reading, which is all that
+// Protobuf_reader::skip() needs.
+class Forward_buf : public std::streambuf {
+	std::streambuf *src;
+	char buf[65536];
+	std::streamoff count;     // Bytes read from src.
+
+protected:
+	int_type underflow();
+	pos_type seekoff (off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which);
+
+public:
+	Forward_buf (std::streambuf *src) : src(src), count(0) { setg (buf, buf, buf); }
+};
+
+Forward_buf::int_type Forward_buf::underflow()
 {
-	std::ifstream is(iname, is.binary);
-	if (!is) {
-		throw_rte (_("Error while opening input file %s"), iname);
+	std::streamsize n = src->sgetn (buf, sizeof buf);
+	if (n <= 0) {
+		return traits_type::eof();
 	}
-	pack_list (is);
+	count += n;
+	setg (buf, buf, buf + n);
+	return traits_type::to_int_type (buf[0]);
 }
 
-
-void sym_pack_list (const char *iname, std::string &password, int shifts_max)
+Forward_buf::pos_type Forward_buf::seekoff (off_type off, std::ios_base::seekdir dir,
+                                            std::ios_base::openmode which)
 {
-	if (password.empty()) {
-		get_password(_("Password for packed file: "), password);
+	if (dir != std::ios_base::cur || off < 0 || !(which & std::ios_base::in)) {
+		return pos_type (off_type (-1));
 	}
-	amber::ifstream is(iname, password.c_str(), shifts_max);
-	if (!is) {
-		throw_rte (_("Error while opening input file %s"), iname);
+	while (off > 0) {
+		if (gptr() == egptr() && traits_type::eq_int_type (underflow(), traits_type::eof())) {
+			return pos_type (off_type (-1));
+		}
+		off_type n = egptr() - gptr();
+		if (n > off) n = off;
+		gbump (n);
+		off -= n;
 	}
-	pack_list (is);
+	return pos_type (count - (egptr() - gptr()));
 }
 
+// A pack_file group as found in the stream. pos is the position of the
+// contents or -1 if there are none.
+struct Stream_file {
+	std::string    name;
+	std::streamoff pos, exp_size;
+	bool           extracted;
+};
 
-void pub_pack_list (const char *iname, const Key &rx, Cu25519Ris *sender, int *nrx)
+// True if name is one of files[0..nf[ or is within one of them. nf < 0 means
+// all the files.
+static bool selected (const std::string &name, int nf, char **files)
 {
-	amber::ifstream is(iname, rx.pair, sender, nrx);
-	if (!is) {
-		throw_rte (_("Error while opening input file %s"), iname);
+	if (nf < 0) return true;
+	for (int i = 0; i < nf; ++i) {
+		size_t flen = strlen(files[i]);
+		if (name.compare (0, flen, files[i]) == 0 && (name.size() == flen || name[flen] == '/')) {
+			return true;
+		}
 	}
-	pack_list (is);
+	return false;
 }
 
-
-static void make_paths (const char *name)
+// Read the pack_file group and extract it if it is selected.
+static void unpack_stream_file (Protobuf_reader &pr, std::istream &is, uint64_t flags,
+                                int nf, char **files, bool verbose, bool console,
+                                Stream_file &f)
 {
-	if (*name == 0) return;
+	uint32_t tagwt;
+	uint64_t val;
+	Item x;
+	x.mode = 0;
+	x.mtime_us = 0;
+	int codec = codec_default;
+	f.pos = -1;
+	f.exp_size = 0;
+	f.extracted = false;
 
-	const char *beg = name;
-	const char *end = name + 1;
-	std::string path;
+	while (pr.read_tagval (&tagwt, &val)) {
+		switch (tagwt) {
+		case maketag (tag_name, length_val):
+			pr.get_string (x.name, val);
+			if (strstr (x.name.c_str(), "../") != 0) {
+				throw_rte (_("Path with .. embedded. This can be a security problem! %s"), x.name);
+			}
+			break;
 
-	while (*end) {
-		while (*end && *end != '/') ++end;
-		if (*end != '/') return;
-		path.append (beg, end);
-#ifdef _WIN32
-		mkdir (path.c_str());
-#else
-		mkdir (path.c_str(), 0755);
-#endif      
-		path.append ("/");
-		beg = end + 1;
-		end = beg;
-	}
-}
+		case maketag (tag_mode, varint):
+			x.mode = val;
+			break;
 
-#ifdef _WIN32
-#define utimes(n,t)
-#endif
+		case maketag (tag_mtime, varint):
+			x.mtime_us = val;
+			break;
 
-static void unpack_file (std::istream &src, const Item &x, bool compressed, bool console)
-{
-	std::ostream *pos;
-	std::ofstream fos;
-	if (console) {
-		pos = &std::cout;
-	} else {
-		if (S_ISDIR(x.mode)) {
-			std::string ts = x.name + "/.";
-			make_paths (ts.c_str());
-			chmod(x.name.c_str(), x.mode & 0777);
-			timeval tv[2];
-			tv[0].tv_sec = x.mtime_us/1000000;
-			tv[0].tv_usec = x.mtime_us % 1000000;
-			tv[1] = tv[0];
-			utimes (x.name.c_str(), tv);
-			// These times will be preseved only if no further files are
-			// written to the directory.
-			return;
+		case maketag (tag_codec, varint):
+			if (val > codec_lz) {
+				throw_rte (_("Unknown codec %d in the packed archive."), val);
+			}
+			codec = val;
+			break;
+
+		case maketag (tag_content, length_val): {
+			f.pos = is.tellg();
+			if (!selected (x.name, nf, files)) {
+				pr.skip (tagwt, val);
+				break;
+			}
+			if (codec == codec_default) {
+				if (flags & flag_item_codec) {
+					throw_rte (_("The codec of %s is unknown. Unpack the archive from a file."),
+					           x.name);
+				}
+				codec = flags & flag_compressed ? codec_deflate : codec_stored;
+			}
+			if (verbose) announce_name (x);
+			std::ofstream fos;
+			if (!console) {
+				fos.open (x.name.c_str(), fos.binary);
+				if (!fos) {
+					make_paths (x.name.c_str());
+					fos.open (x.name.c_str(), fos.binary);
+					if (!fos)
+					throw_rte (_("Cannot create the file %s"), x.name);
+				}
+			}
+			f.exp_size = expand_stored ([&pr](char *buf, size_t n) { pr.get_bytes (buf, n); },
+			                            val, codec, console ? std::cout : fos);
+			f.extracted = true;
+			break;
 		}
 
-		fos.open(x.name.c_str(), fos.binary);
-		if (!fos) {
-			make_paths(x.name.c_str());
-			fos.open(x.name.c_str(), fos.binary);
-			if (!fos)
-			throw_rte (_("Cannot create the file %s"), x.name);
+		default:
+			pr.skip (tagwt, val);
 		}
-		pos = &fos;
 	}
-	src.seekg(x.pos);
-	if (!src) {
-		throw_rte (_("Cannot seek in the source file."));
-	}
-	char buf[10000];
 
-	ZWrapper zw;
-	buffer<char, sizeof(buf) * 2> outbuf;
-
-	std::streamoff pending = x.comp_size;
-	while (src.good() && pending > 0) {
-		long toread = pending > std::streamoff(sizeof(buf)) ? sizeof(buf) : pending;
-		src.read(buf, toread);
-		if (src.gcount() != toread) {
-			throw_rte (_("Cannot read from the input file."));
-		}
+	f.name = x.name;
+	if (!console && f.pos < 0 && S_ISDIR(x.mode) && selected (x.name, nf, files)) {
+		std::string ts = x.name + "/.";
+		make_paths (ts.c_str());
+		f.extracted = true;
+	}
+}
 
-		if (compressed) {
-			zw.expand(buf, toread, &outbuf);
-			pos->write(&outbuf[0], outbuf.size());
-			outbuf.clear();
+// Check the extracted files against the items of the directory and set
+// their metadata.
+static void check_stream (const std::vector<Item> &items, const std::vector<Stream_file> &seen,
+                          int nf, char **files, bool console)
+{
+	std::unordered_map<std::streamoff, size_t> by_pos;
+	std::unordered_map<std::string, size_t> by_name;
+	for (size_t i = 0; i < seen.size(); ++i) {
+		if (seen[i].pos >= 0) {
+			by_pos[seen[i].pos] = i;
 		} else {
-			pos->write(buf, toread);
+			by_name[seen[i].name] = i;
 		}
-		pending -= toread;
 	}
 
-	if (compressed) {
-		zw.flush(&outbuf);
-		pos->write(&outbuf[0], outbuf.size());
+	std::vector<bool> current (seen.size());
+	std::unordered_set<std::string> names;
+	for (unsigned i = 0; i < items.size(); ++i) {
+		const Item &x = items[i];
+		if (!selected (x.name, nf, files)) continue;
+		names.insert (x.name);
+		if (!S_ISREG(x.mode)) {
+			auto it = by_name.find (x.name);
+			if (it != by_name.end()) current[it->second] = true;
+			continue;
+		}
+		auto it = by_pos.find (x.pos);
+		if (it == by_pos.end()) {
+			throw_rte (_("The contents of %s are missing from the packed archive."), x.name);
+		}
+		if (seen[it->second].exp_size != x.exp_size) {
+			throw_rte (_("The size of %s does not match the central directory."), x.name);
+		}
+		current[it->second] = true;
 	}
+	if (console) return;
 
-	if (pos == &fos) {
-		fos.close();
-		chmod(x.name.c_str(), x.mode & 0777);
-		timeval tv[2];
-		tv[0].tv_sec = x.mtime_us/1000000;
-		tv[0].tv_usec = x.mtime_us % 1000000;
-		tv[1] = tv[0];
-		utimes (x.name.c_str(), tv);
+	for (size_t i = 0; i < seen.size(); ++i) {
+		if (seen[i].extracted && !current[i] && seen[i].pos >= 0
+		    && names.find (seen[i].name) == names.end()) {
+			remove (seen[i].name.c_str());
+		}
+	}
+	for (unsigned i = 0; i < items.size(); ++i) {
+		if (!S_ISDIR(items[i].mode) && selected (items[i].name, nf, files)) {
+			set_metadata (items[i]);
+		}
+	}
+	for (unsigned i = 0; i < items.size(); ++i) {
+		if (S_ISDIR(items[i].mode) && selected (items[i].name, nf, files)) {
+			set_metadata (items[i]);
+		}
 	}
 }
 
-
-static void unpack (std::istream &is, int nf, char **files, bool verbose, bool console)
+// Unpack from src front to back. nf < 0 means all the files.
+static void unpack_stream (std::istream &src, int nf, char **files, bool verbose, bool console)
 {
-	std::vector<Item> index;
-	bool compressed;
-	read_index (is, index, &compressed);
+	Forward_buf fb (src.rdbuf());
+	std::istream is (&fb);
+	Protobuf_reader pr (&is);
+	uint32_t tagwt;
+	uint64_t val;
+	uint64_t flags = 0;
+	bool have_flags = false, in_dir = false, done = false;
+	std::vector<Item> items;
+	std::vector<Stream_file> seen;
+	Item x;
 
-	for (int i = 0; i < nf; ++i) {
-		size_t flen = strlen(files[i]);
-		for (unsigned j = 0; j < index.size(); ++j) {
-			if (index[j].name == files[i]) {
-				if (verbose) {
-					std::cout << index[j].name << '\n';
-				}
-				unpack_file (is, index[j], compressed, console);
-				break;
-			} else if (strncmp(index[j].name.c_str(), files[i], flen) == 0 && index[j].name[flen] == '/') {
-				if (verbose) {
-					std::cout << index[j].name << '\n';
+	while (!done && pr.read_tagval (&tagwt, &val)) {
+		switch (tagwt) {
+		case maketag (pack_flag, varint):
+			if (val & ~uint64_t(flag_known)) {
+				throw_rte (_("Unknown packed archive format."));
+			}
+			if (val & flag_chunked) {
+				throw_rte (_("A deduplicated packed archive cannot be unpacked from a stream."));
+			}
+			// The central directory starts with the flag again.
+			in_dir = have_flags;
+			have_flags = true;
+			flags = val;
+			break;
+
+		case maketag (pack_file, group_len):
+			if (!have_flags || in_dir) {
+				throw_rte (_("Unknown packed archive format."));
+			}
+			seen.push_back (Stream_file());
+			unpack_stream_file (pr, is, flags, nf, files, verbose, console, seen.back());
+			break;
+
+		case maketag (pack_dir, group_len):
+			while (pr.read_tagval (&tagwt, &val)) {
+				if (tagwt == maketag (pack_item, group_len)) {
+					x.read (pr);
+					items.push_back (x);
+				} else {
+					pr.skip (tagwt, val);
 				}
-				unpack_file (is, index[j], compressed, console);
 			}
+			break;
+
+		case maketag (pack_last, fixed64):
+			done = true;
+			break;
+
+		default:
+			pr.skip (tagwt, val);
 		}
 	}
+	if (!done) {
+		throw_rte (_("The packed archive is truncated."));
+	}
+	check_stream (items, seen, nf, files, console);
+}
+
+// Open the archive for plain_unpack() and plain_unpack_all(). Return false if
+// it must be read as a stream from *in.
+static bool open_seekable (const char *packed, std::ifstream &is, std::istream **in)
+{
+	if (strcmp (packed, "-") == 0) {
+		*in = &std::cin;
+		return false;
+	}
+	is.open (packed, is.binary);
+	if (!is) {
+		throw_rte (_("Error while opening input file %s"), packed);
+	}
+	*in = &is;
+	if (is.seekg (0, is.end)) {
+		is.seekg (0, is.beg);
+		return true;
+	}
+	is.clear();
+	return false;
 }
 
 
 void plain_unpack (const char *packed, int nf, char **files,
                    bool verbose, bool console)
 {                  
-	std::ifstream is(packed, is.binary);
-	if (!is) {
-		throw_rte (_("Error while opening input file %s"), packed);
+	std::ifstream is;
+	std::istream *in;
+	if (open_seekable (packed, is, &in)) {
+		unpack (is, nf, files, verbose, console, reopen_plain (packed));
+	} else {
+		unpack_stream (*in, nf, files, verbose, console);
 	}
-	unpack (is, nf, files, verbose, console);
 }
 
 
@@ -602,7 +2165,7 @@ void sym_unpack (const char *packed, int nf, char **files,
 	if (!is) {
 		throw_rte (_("Error while opening input file %s"), packed);
 	}
-	unpack (is, nf, files, verbose, console);
+	unpack (is, nf, files, verbose, console, reopen_encrypted (packed, is));
 }
 
 
@@ -613,34 +2176,40 @@ void pub_unpack (const char *packed, int nf, char **files, const Key &rx,
 	if (!is) {
 		throw_rte(_("Error while opening input file %s"), packed);
 	}
-	unpack (is, nf, files, verbose, console);
+	unpack (is, nf, files, verbose, console, reopen_encrypted (packed, is));
 }
 
 
-static void unpack_all (std::istream &is, bool verbose, bool console)
+static void announce_sizes (const Item &x)
+{
+	format(std::cout, _("unpacking %s  (%d / %d bytes)\n"),
+	    x.name, x.comp_size, x.exp_size);
+}
+
+static void unpack_all (std::istream &is, bool verbose, bool console, const Reopen &reopen)
 {
-	std::vector<Item> index;
-	bool compressed;
-	read_index (is, index, &compressed);
+	Pack_index ix;
+	read_index (is, ix);
+	const std::vector<Item> &index = ix.items;
 
+	std::vector<const Item*> items (index.size());
 	for (unsigned j = 0; j < index.size(); ++j) {
-		if (verbose) {
-			format(std::cout, _("unpacking %s  (%d / %d bytes)\n"),
-			    index[j].name, index[j].comp_size, index[j].exp_size);
-		}
-		unpack_file (is, index[j], compressed, console);
+		items[j] = &index[j];
 	}
+	unpack_items (is, items, ix, console, verbose, announce_sizes, reopen);
 }
 
 
 
 void plain_unpack_all(const char *packed, bool verbose, bool console)
 {
-	std::ifstream is(packed, is.binary);
-	if (!is) {
-		throw_rte (_("Error while opening input file %s"), packed);
+	std::ifstream is;
+	std::istream *in;
+	if (open_seekable (packed, is, &in)) {
+		unpack_all (is, verbose, console, reopen_plain (packed));
+	} else {
+		unpack_stream (*in, -1, NULL, verbose, console);
 	}
-	unpack_all (is, verbose, console);
 }
 
 
@@ -654,7 +2223,7 @@ void sym_unpack_all(const char *packed, std::string &password, bool verbose,
 	if (!is) {
 		throw_rte (_("Error while opening input file %s"), packed);
 	}
-	unpack_all (is, verbose, console);
+	unpack_all (is, verbose, console, reopen_encrypted (packed, is));
 }
 
 
@@ -665,127 +2234,81 @@ void pub_unpack_all (const char *packed, const Key &rx,
 	if (!is) {
 		throw_rte (_("Error while opening input file %s"), packed);
 	}
-	unpack_all (is, verbose, console);
+	unpack_all (is, verbose, console, reopen_encrypted (packed, is));
 }
 
 static
 void incremental_pack (std::fstream &fs, int nf, char **files, bool verbose)
 {
-	std::vector<Item> old_index;
-	bool compressed;
-	std::streamoff cendir;
-	read_index (fs, old_index, &compressed, &cendir);
-
-
-	std::vector<Item> pos;
-	uint64_t count = 0;
-	char buf[100000];
-
-	fs.seekp (cendir, fs.beg);
+	Pack_index ix;
+	read_index (fs, ix);
+
+	// Find the old entries by name. If a name appears more than once the
+	// first entry is used.
+	std::unordered_map<std::string, const Item*> old_names (ix.items.size());
+	for (unsigned j = 0; j < ix.items.size(); ++j) {
+		old_names.insert (std::make_pair (ix.items[j].name, &ix.items[j]));
+	}
 
-	Protobuf_writer pw (&fs, pw.seek, 100000);
+	// The new files of a chunked archive share the chunks already stored.
+	std::unique_ptr<Chunker> chunker;
+	if (ix.chunked) {
+		chunker.reset (new Chunker (ix.chunk_key));
+	}
+	Chunk_map known (ix.chunks.size());
+	for (unsigned j = 0; j < ix.chunks.size(); ++j) {
+		known.insert (std::make_pair (std::string ((const char*)ix.chunks[j].digest, 32), j));
+	}
 
 	std::vector<std::string> expanded;
-	expand_files(nf, files, &expanded);
-
+	std::vector<struct stat> stats;
+	expand_files(nf, files, &expanded, &stats);
+
+	// Keep the old entries that are unchanged. The other files go through
+	// the pipeline.
+	std::vector<Item> pos (expanded.size());
+	std::vector<bool> found (expanded.size());
+	std::vector<std::string> changed;
+	std::vector<struct stat> changed_stats;
 	for (unsigned i = 0; i < expanded.size(); ++i) {
-		Item x;
+		Item &x = pos[i];
 		x.name = expanded[i];
-		size_t exp_size = 0;
-		struct stat st;
-		if (stat(x.name.c_str(), &st) == 0) {
-			x.mode = st.st_mode;
-			x.exp_size = st.st_size;
-#ifdef _WIN32
-			x.mtime_us = st.st_mtime * 1000000;
-#else
-			x.mtime_us = st.st_mtim.tv_sec * 1000000 + st.st_mtim.tv_nsec/1000;
-#endif
-		} else {
-			x.mode = 0;
-			x.exp_size = 0;
-			x.mtime_us = 0;
-		}
+		set_stat (x, true, stats[i]);
+		x.exp_size = stats[i].st_size;
 
-		bool found = false;
-		for (unsigned j = 0; j < old_index.size(); ++j) {
-			if (old_index[j].name == x.name && old_index[j].mtime_us >= x.mtime_us
-					&& old_index[j].mode == x.mode && old_index[j].exp_size == x.exp_size) {
+		auto old = old_names.find (x.name);
+		if (old != old_names.end()) {
+			const Item &ox = *old->second;
+			if (ox.mtime_us >= x.mtime_us && ox.mode == x.mode && ox.exp_size == x.exp_size) {
 				// Skip existing file.
-				x = old_index[j];
-				found = true;
-				break;
+				x = ox;
+				found[i] = true;
 			}
 		}
+		if (!found[i]) {
+			changed.push_back (x.name);
+			changed_stats.push_back (stats[i]);
+		}
+	}
 
-		if (!found) {
-			std::ifstream is;
-			if (S_ISREG(st.st_mode)) {
-				is.open (expanded[i].c_str(), is.binary);
-				if (!is) {
-					throw_rte (_("Error while opening input file %s"), expanded[i]);
-				}
-			}
-
-			buffer<char, sizeof buf> outbuf;
-			ZWrapper zw;
-
-			if (verbose) {
-				std::cout << x.name << '\n';
-			}
-
-			pw.start_group (pack_file);
-			pw.write_string (tag_name, &x.name[0]);
-			pw.write_uint (tag_mode, x.mode);
-
-			size_t start_size = count;
-
-			if (S_ISREG(st.st_mode)) {
-				pw.start_group (tag_content);
-				pw.flush();
-				x.pos = fs.tellp();
-
-				while (is) {
-					is.read(buf, sizeof buf);
-					exp_size += is.gcount();
-					if (compressed) {
-						zw.compress (buf, is.gcount(), &outbuf);
-						pw.add_bytes (&outbuf[0], outbuf.size());
-						count += outbuf.size();
-						outbuf.clear();
-					} else {
-						pw.add_bytes (buf, is.gcount());
-						count += is.gcount();
-					}
-				}
-				if (compressed) {
-					zw.flush(&outbuf);
-					pw.add_bytes (&outbuf[0], outbuf.size());
-					count += outbuf.size();
-				}
-				pw.end_group (true);
-			}
+	// read_index() reads until the end of the file and leaves the eofbit and
+	// failbit set. Clear them or the seek and all the later writes fail.
+	fs.clear();
+	fs.seekp (ix.cendir, fs.beg);
 
-			pw.end_group();
-			pw.flush();
+	Protobuf_writer pw (&fs, pw.seek, 100000);
 
-			x.comp_size = count - start_size;
-			x.exp_size = exp_size;
+	Pack_pipeline pipe (changed, changed_stats, ix.compressed ? pack_default_level : 0,
+	                    zcodec_deflate, chunker.get());
+	size_t job = 0;
+	for (unsigned i = 0; i < expanded.size(); ++i) {
+		if (!found[i]) {
+			write_file (pw, fs, pipe, job++, pos[i], ix, known, verbose);
 		}
-		pos.push_back(x);
 	}
-	count = fs.tellp();
-
-	// Now write the central directory
-	int flag = compressed ? 1 : 0;
-	pw.write_uint (pack_flag, flag);
 
-	pw.start_group (pack_dir);
-	for (unsigned i = 0; i < pos.size(); ++i) {
-		pos[i].write(pw);
-	}
-	pw.end_group();
-	pw.write_uint64 (pack_last, count);
+	ix.items.swap (pos);
+	write_cendir (pw, fs, ix);
 }
 
 
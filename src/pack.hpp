@@ -33,6 +33,7 @@
 
 #include "soname.hpp"
 #include "keys.hpp"
+#include "zwrap.hpp"
 
 
 // Packed archives.
@@ -40,18 +41,27 @@
 namespace amber {   namespace AMBER_SONAME {
 
 
-// Pack files without encryption.
+// Pack files without encryption. If dedup is set the files are split into
+// content defined chunks and each distinct chunk is stored only once. If
+// compress is set the files are compressed with the level zlevel, from 1
+// (fastest) to 9 (smallest) using zcodec. zcodec_lz ignores the level.
+// Files that do not compress well are stored without compression.
 EXPORTFN
-void plain_pack (const char *oname, int nf, char **files, bool compress, bool verbose);
+void plain_pack (const char *oname, int nf, char **files, bool compress, bool verbose,
+                 bool dedup=false, int zlevel=9, Zcodec zcodec=zcodec_deflate);
 
 // List all the files in iname.
 EXPORTFN void plain_pack_list (const char *iname);
 
-// Extract the given files.
+// Extract the given files. If packed is "-" the archive is read from the
+// standard input. An archive that cannot seek, like a pipe, is unpacked
+// sequentially and checked against the central directory at the end.
+// Chunked archives cannot be unpacked in this way.
 EXPORTFN
 void plain_unpack (const char *packed, int nf, char **files, bool verbose,
                    bool console);
 
+// Same for all the files.
 EXPORTFN
 void plain_unpack_all (const char *packed, bool verbose, bool console);
 
@@ -59,10 +69,13 @@ void plain_unpack_all (const char *packed, bool verbose, bool console);
 // Pack the files files[0..nf[ into the file oname. Pass the password, the
 // block size and block filler size. Shifts is the shifts parameter for
 // scrypt_blake2s. Set verbose to true to output information while packing.
-// If the password is empty then the program will prompt the user.
+// If the password is empty then the program will prompt the user. Set dedup
+// to store the identical chunks of the files only once. zlevel and zcodec
+// are the compression level and codec.
 EXPORTFN
 void sym_pack(const char *oname, int nf, char **files, std::string &password,
-              int bs, int bf, int shifts, bool compress, bool verbose);
+              int bs, int bf, int shifts, bool compress, bool verbose,
+              bool dedup=false, int zlevel=9, Zcodec zcodec=zcodec_deflate);
 
 // List the files that are stored in the archive iname. If the password is
 // empty then the program will prompt the user.
@@ -94,11 +107,14 @@ void sym_unpack_all (const char *packed, std::string &password, bool verbose,
 // block size to be used for the encryption. bf is the block filler size to
 // be used. Set verbose to display additional information while packing. Set
 // spoof to create an archive that looks like if it was encrypted by the
-// first recipient for the sender.
+// first recipient for the sender. Set dedup to store the identical chunks of
+// the files only once. zlevel and zcodec are the compression level and
+// codec.
 EXPORTFN
 void pub_pack(const char *oname, int nf, char **files, const Key &sender,
               const Key_list &rx, int bs, int bf, bool compress,
-              bool verbose, bool spoof);
+              bool verbose, bool spoof, bool dedup=false, int zlevel=9,
+              Zcodec zcodec=zcodec_deflate);
 
 // Pass the decryption key in rx. It will list the contents of the archive
 // and put in sender the public key of the sender.
@@ -29,7 +29,9 @@
 #include <string.h>
 #include <type_traits>
 #include <map>
+#include <deque>
 #include "hasopt.hpp"
+#include "misc.hpp"
 
 
 namespace amber {   namespace AMBER_SONAME {
@@ -68,23 +70,95 @@ struct Protobuf_writer::Data {
 	// Number of bytes to write on each call to the underlying stream.
 	enum { chunk_size = 5000 };
 
+	// The buffer is a sequence of spans stored in fixed size segments.
+	// Closing a group with a header in an earlier span splits that span
+	// around the unused reserved bytes instead of moving everything that
+	// follows. Only the bytes of the last span, which are fewer than
+	// segment_size, are ever moved.
+	enum { segment_size = 8192 };
+	struct Span {
+		char    *p;
+		size_t  n;
+		size_t  seg;       // Sequence number of the segment holding it.
+	};
+	std::deque<std::unique_ptr<char[]>> segments, spare;
+	size_t              seg_base;      // Sequence number of segments.front().
+	size_t              seg_used;      // Bytes used in segments.back().
+	std::deque<Span>    spans;
+	size_t              span_base;     // Number of spans already flushed.
+	size_t              buffered;      // Bytes held in spans.
+	std::vector<char>   flat;          // Returned by get_buffer().
+
 	struct Pending {
 		std::streamoff pos;
 		int            reserved_bytes;
 		unsigned       id;
+		size_t         span;       // Span holding the header.
+		char           *header;    // The header while it is in the buffer.
 	};
-	std::stack<Pending> pending;
+	std::vector<Pending> pending;
 	std::streamoff      current;       // Current position in logical stream.
 	std::ostream        *os;
-	std::vector<char>   buffer;
 	std::streamoff      buffer_base;   // Position of the buffer in the logical stream.
 	Group               gt;
 	bool                use_group_len;
 
 	Data (std::ostream *osp) : os(osp) {}
+
+	// Return room for n <= segment_size contiguous bytes at the end of the
+	// buffer.
+	char * append (size_t n);
+	// Remove the spans from the front and release the unused segments.
+	void pop_spans (size_t count);
 };
 
 
+char * Protobuf_writer::Data::append (size_t n)
+{
+	bool new_span = spans.empty();
+	if (segments.empty() || seg_used + n > segment_size) {
+		if (spare.empty()) {
+			segments.emplace_back (new char[segment_size]);
+		} else {
+			segments.push_back (std::move (spare.back()));
+			spare.pop_back();
+		}
+		seg_used = 0;
+		new_span = true;
+	}
+	char *p = segments.back().get() + seg_used;
+	seg_used += n;
+	buffered += n;
+	if (new_span) {
+		Span sp = { p, n, seg_base + segments.size() - 1 };
+		spans.push_back (sp);
+	} else {
+		spans.back().n += n;
+	}
+	return p;
+}
+
+
+void Protobuf_writer::Data::pop_spans (size_t count)
+{
+	for (size_t i = 0; i < count; ++i) {
+		buffered -= spans.front().n;
+		spans.pop_front();
+	}
+	span_base += count;
+	if (segments.empty()) return;
+	// Keep the last segment: it may still receive bytes.
+	size_t first_used = spans.empty() ? seg_base + segments.size() - 1 : spans.front().seg;
+	while (seg_base < first_used) {
+		if (spare.size() < 4) {
+			spare.push_back (std::move (segments.front()));
+		}
+		segments.pop_front();
+		++seg_base;
+	}
+}
+
+
 Protobuf_writer::Protobuf_writer (std::ostream *os, Group gt, size_t buffer_size)
 	: data (new Data(os))
 {
@@ -93,13 +167,14 @@ Protobuf_writer::Protobuf_writer (std::ostream *os, Group gt, size_t buffer_size
 	data->buffer_base = 0;
 	data->gt          = gt;
 	data->use_group_len = true;
+	data->seg_base = data->seg_used = 0;
+	data->span_base = data->buffered = 0;
 
 	if (data->max_size < 2u * data->chunk_size) {
 		data->max_size = 2 * data->chunk_size;
 	}
 }
 
-
 Protobuf_writer::~Protobuf_writer()
 {
 	flush();
@@ -115,13 +190,39 @@ void Protobuf_writer::use_group_len (bool flag)
 	data->use_group_len = flag;
 }
 
-void Protobuf_writer::flush_buffer (size_t nbytes)  
+// Write at least nbytes from the front of the buffer with one write per
+// span. A group header is never split: end_group() must find it either
+// wholly in the stream or wholly in the buffer.
+void Protobuf_writer::flush_buffer (size_t nbytes)
 {
-	if (data->os) {
-		data->os->write (&data->buffer[0], nbytes);
-		data->buffer.erase (data->buffer.begin(), data->buffer.begin() + nbytes);
-		data->buffer_base += nbytes;
+	if (!data->os) return;
+
+	for (const auto &pd : data->pending) {
+		std::streamoff start = pd.pos - data->buffer_base;
+		std::streamoff end = start + pd.reserved_bytes;
+		if (start < std::streamoff(nbytes) && end > std::streamoff(nbytes)) {
+			nbytes = end;
+		}
+	}
+
+	size_t count = 0, written = 0;
+	while (written < nbytes && count < data->spans.size()) {
+		Data::Span &sp = data->spans[count];
+		size_t k = nbytes - written;
+		if (k < sp.n) {
+			data->os->write (sp.p, k);
+			sp.p += k;
+			sp.n -= k;
+			data->buffered -= k;
+			written += k;
+			break;
+		}
+		data->os->write (sp.p, sp.n);
+		written += sp.n;
+		++count;
 	}
+	data->pop_spans (count);
+	data->buffer_base += written;
 }
 
 
@@ -129,19 +230,35 @@ void Protobuf_writer::add_bytes (const char *bytes, size_t n)
 {
 	data->current += n;
 
-	if (n > data->max_size) {
-		flush_buffer (data->buffer.size());
+	if (n > data->max_size && data->os) {
+		flush_buffer (data->buffered);
 		data->os->write (bytes, n);
 		data->buffer_base = data->current;
 		return;
 	}
 
-	size_t loc = data->buffer.size();
-	data->buffer.resize (loc + n);
-	memcpy (&data->buffer[0] + loc, bytes, n);
+	if (!data->spans.empty() && data->seg_used + n <= Data::segment_size) {
+		// Common case: the bytes fit at the end of the last span.
+		memcpy (data->segments.back().get() + data->seg_used, bytes, n);
+		data->seg_used += n;
+		data->buffered += n;
+		data->spans.back().n += n;
+		n = 0;
+	}
+
+	while (n > 0) {
+		size_t room = Data::segment_size - data->seg_used;
+		if (data->segments.empty() || room == 0) {
+			room = Data::segment_size;
+		}
+		size_t k = n < room ? n : room;
+		memcpy (data->append (k), bytes, k);
+		bytes += k;
+		n -= k;
+	}
 
-	if (data->buffer.size() > data->max_size) {
-		flush_buffer (data->buffer.size() - data->max_size + data->chunk_size);
+	if (data->buffered > data->max_size) {
+		flush_buffer (data->buffered - data->max_size + data->chunk_size);
 	}
 }
 
@@ -178,10 +295,18 @@ void Protobuf_writer::start_group (unsigned id)
 	mark.pos = data->current;
 	mark.reserved_bytes = nw + max_res_space;
 	mark.id = id;
-	add_bytes (tag, nw + max_res_space);
-	data->pending.push (mark);
+	mark.header = data->append (mark.reserved_bytes);
+	memcpy (mark.header, tag, mark.reserved_bytes);
+	mark.span = data->span_base + data->spans.size() - 1;
+	data->current += mark.reserved_bytes;
+	data->pending.push_back (mark);
+
+	if (data->buffered > data->max_size) {
+		flush_buffer (data->buffered - data->max_size + data->chunk_size);
+	}
 }
 
+
 Wire_type Protobuf_writer::end_group (bool opaque)
 {
 	Wire_type res;
@@ -194,12 +319,14 @@ Wire_type Protobuf_writer::end_group (bool opaque)
 	}
 
 	if (!data->pending.empty()) {
-		Data::Pending top = data->pending.top();
+		Data::Pending top = data->pending.back();
 		if (top.pos < data->buffer_base) {
 			std::streampos pos = data->os->tellp();
 			bool seek_ok = false;
 			if (data->gt != noseek) {
-				data->os->seekp (top.pos);
+				// The stream is at buffer_base. The writer may have started
+				// at any position of the stream, not only at its beginning.
+				data->os->seekp (pos + std::streamoff(top.pos - data->buffer_base));
 				if (data->os) {
 					seek_ok = true;
 				} else {
@@ -229,29 +356,40 @@ Wire_type Protobuf_writer::end_group (bool opaque)
 					buf[i] |= 0x80;
 				}
 				data->os->write (buf, top.reserved_bytes);
-				if (top.pos + top.reserved_bytes > data->buffer_base) {
-					size_t nerase = top.pos + top.reserved_bytes - data->buffer_base;
-					data->buffer.erase (data->buffer.begin(), data->buffer.begin() + nerase);
-					data->buffer_base += nerase;
-				}
 				data->os->seekp (pos);
 			}
 		} else {
 			// The block header is still in the buffer.
-			ptrdiff_t local_pos = top.pos - data->buffer_base;
+			size_t ix = top.span - data->span_base;
+			Data::Span &sp = data->spans[ix];
 			ptrdiff_t n = data->current - top.pos - top.reserved_bytes;
 			char buf[20];
 			int count = write_uleb ((top.id << 3) | (opaque ? length_val : group_len), buf);
 			count += write_uleb (n, buf + count);
-			memcpy (&data->buffer[0] + local_pos, buf, count);
+			memcpy (top.header, buf, count);
 			if (count < top.reserved_bytes) {
-				data->buffer.erase (data->buffer.begin() + local_pos + count,
-				                    data->buffer.begin() + local_pos + top.reserved_bytes);
-				data->current -= top.reserved_bytes - count;
+				size_t gap = top.reserved_bytes - count;
+				size_t head = top.header - sp.p + count;
+				size_t tail = sp.n - head - gap;
+				if (ix + 1 == data->spans.size()) {
+					memmove (sp.p + head, sp.p + head + gap, tail);
+					sp.n -= gap;
+					data->seg_used -= gap;
+				} else {
+					// Any pending group starts before this one, so no
+					// pending span index changes.
+					Data::Span rest = { sp.p + head + gap, tail, sp.seg };
+					sp.n = head;
+					if (tail != 0) {
+						data->spans.insert (data->spans.begin() + ix + 1, rest);
+					}
+				}
+				data->buffered -= gap;
+				data->current -= gap;
 			}
 		}
 
-		data->pending.pop();
+		data->pending.pop_back();
 	}
 	return res;
 }
@@ -269,11 +407,7 @@ void Protobuf_writer::end_all_groups()
 
 void Protobuf_writer::flush()
 {
-	if (data->os) {
-		data->os->write (&data->buffer[0], data->buffer.size());
-		data->buffer_base += data->buffer.size();
-		data->buffer.clear();
-	}
+	flush_buffer (data->buffered);
 }
 
 
@@ -427,7 +561,12 @@ void Protobuf_writer::write_bytes (unsigned id, const void *buf, size_t n)
 
 const std::vector<char> & Protobuf_writer::get_buffer() const
 {
-	return data->buffer;
+	data->flat.clear();
+	data->flat.reserve (data->buffered);
+	for (const auto &sp : data->spans) {
+		data->flat.insert (data->flat.end(), sp.p, sp.p + sp.n);
+	}
+	return data->flat;
 }
 
 
@@ -446,6 +585,8 @@ struct Protobuf_reader::Data {
 		std::map<uint32_t, Req> reqs;
 	};
 	std::stack<Block> scopes;
+	// Bytes returned by get_view() when reading from a stream.
+	std::vector<char> view;
 };
 
 
@@ -500,8 +641,83 @@ void Protobuf_reader::set_input (const char *buf, size_t n)
 }
 
 
+// Decode a LEB128 from the 8 bytes at p without looping over each byte.
+// The first byte without the continuation bit ends the number: isolate its
+// top bit, turn it into a mask of the bytes that belong to the number and
+// then join the 7 bit groups with three shift and mask steps. Return the
+// number of bytes used or 0 if the number is longer than 8 bytes.
+static inline unsigned decode_uleb8 (const char *p, uint64_t *v)
+{
+	uint64_t x = leget64 (p);
+	uint64_t stop = ~x & 0x8080808080808080ull;
+	if (stop == 0) return 0;
+
+	uint64_t mask = ((stop & (0 - stop)) << 1) - 1;
+	x &= mask & 0x7F7F7F7F7F7F7F7Full;
+	x = (x & 0x007F007F007F007Full) | ((x & 0x7F007F007F007F00ull) >> 1);
+	x = (x & 0x00003FFF00003FFFull) | ((x & 0x3FFF00003FFF0000ull) >> 2);
+	x = (x & 0x000000000FFFFFFFull) | ((x & 0x0FFFFFFF00000000ull) >> 4);
+	*v = x;
+	// Each byte of the number has its low bit set in the mask. Add them up.
+	return ((mask & 0x0101010101010101ull) * 0x0101010101010101ull) >> 56;
+}
+
+// Decode a LEB128 from [*p,lim) one byte at a time. Used for numbers
+// longer than 8 bytes and near the end of the buffer.
+static uint64_t decode_uleb (const char **p, const char *lim)
+{
+	uint64_t val = 0;
+	unsigned shifts = 0;
+	const char *q = *p;
+	while (q < lim) {
+		int ch = (unsigned char) *q++;
+		if (shifts >= 63) {
+			if ((shifts == 63 && (ch & 0x7E)) || (shifts > 63 && (ch & 0x7F))) {
+				throw std::out_of_range ("Reading a LEB128 that has more than 64 bits.");
+			}
+		}
+		val |= uint64_t(ch & 0x7F) << shifts;
+		shifts += 7;
+		if ((ch & 0x80) == 0) {
+			*p = q;
+			return val;
+		}
+	}
+	throw std::length_error (_("Truncated LEB128 in a packed array"));
+}
+
+
+size_t Protobuf_reader::decode_packed (const char **p, const char *lim,
+                                       uint64_t *vals, size_t nmax)
+{
+	const char *q = *p;
+	size_t n = 0;
+	while (n < nmax && lim - q >= 8) {
+		unsigned len = decode_uleb8 (q, &vals[n]);
+		if (len == 0) break;
+		q += len;
+		++n;
+	}
+	while (n < nmax && q < lim) {
+		vals[n++] = decode_uleb (&q, lim);
+	}
+	*p = q;
+	return n;
+}
+
+
 uint64_t Protobuf_reader::read_uleb()
 {
+	if (!data->is && data->plim - data->pbuf >= 8) {
+		uint64_t val;
+		unsigned len = decode_uleb8 (data->pbuf, &val);
+		if (len != 0 && std::streamoff(len) <= data->limit - data->current) {
+			data->pbuf += len;
+			data->current += len;
+			return val;
+		}
+	}
+
 	uint64_t val = 0;
 	unsigned shifts = 0;
 	if (data->is) {
@@ -638,6 +854,32 @@ void Protobuf_reader::get_bytes (void *buf, std::streamoff n)
 }
 
 
+const char * Protobuf_reader::get_view (std::streamoff n)
+{
+	if (n < 0 || n > data->limit - data->current) {
+		throw std::length_error (_("Trying to read beyond the limit"));
+	}
+	if (data->is) {
+		data->view.resize (n);
+		get_bytes (data->view.data(), n);
+		return data->view.data();
+	}
+	if (n > data->plim - data->pbuf) {
+		throw_rte (_("Cannot read from the input"));
+	}
+	const char *p = data->pbuf;
+	data->pbuf += n;
+	data->current += n;
+	return p;
+}
+
+
+bool Protobuf_reader::reads_memory() const
+{
+	return data->is == 0;
+}
+
+
 void Protobuf_reader::skip (uint32_t tagwt, uint64_t val)
 {
 	uint32_t t;
@@ -655,12 +897,23 @@ void Protobuf_reader::skip (uint32_t tagwt, uint64_t val)
 	case group_len:
 		if (data->is) {
 			data->is->seekg (val, data->is->cur);
-		} else if (data->pbuf + val < data->plim) {
+		} else if (val <= uint64_t(data->plim - data->pbuf)) {
 			data->pbuf += val;
 		} else {
 			throw_rte (_("Trying to skip beyond the input."));
 		}
 		data->current += val;
+		// read_tagval() pushed a scope for the group, which ends here.
+		// Otherwise the next read_tagval() would return false.
+		if ((tagwt & 7) == group_len && !data->scopes.empty()
+		    && data->scopes.top().limit == data->current) {
+			data->scopes.pop();
+			if (!data->scopes.empty()) {
+				data->limit = data->scopes.top().limit;
+			} else {
+				data->limit = std::numeric_limits<decltype(data->limit)>::max();
+			}
+		}
 		break;
 
 	case group_start:
@@ -762,7 +1015,7 @@ bool Protobuf_reader::read_tagval (uint32_t *tagwt, uint64_t *val, bool top_leve
 		break;
 	}
 
-	if (!data->scopes.empty()) {
+	if (!data->scopes.empty() && !data->scopes.top().reqs.empty()) {
 		auto req = data->scopes.top().reqs.find (*tagwt >> 3);
 		if (req != data->scopes.top().reqs.end()) {
 			req->second.count++;
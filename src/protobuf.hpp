@@ -36,6 +36,7 @@
 #include <stack>
 #include <limits>
 #include <memory>
+#include <string>
 
 namespace amber { namespace AMBER_SONAME {
 
@@ -144,7 +145,7 @@ public:
 		while (v != end) {
 			write_packed_uint (*v++);
 		}
-		if (end_group() != length_val) {
+		if (end_group (true) != length_val) {
 			throw_rte (_("Packed array is too long"));
 		}
 	}
@@ -164,7 +165,7 @@ public:
 		while (v != end) {
 			write_packed_int (*v++);
 		}
-		if (end_group() != length_val) {
+		if (end_group (true) != length_val) {
 			throw_rte (_("Packed array is too long"));
 		}
 	}
@@ -187,7 +188,7 @@ public:
 		while (v != end) {
 			write_packed_uint32 (*v++);
 		}
-		if (end_group() != length_val) {
+		if (end_group (true) != length_val) {
 			throw_rte (_("Packed array is too long"));
 		}
 	}
@@ -200,7 +201,7 @@ public:
 		while (v != end) {
 			write_packed_uint64 (*v++);
 		}
-		if (end_group() != length_val) {
+		if (end_group (true) != length_val) {
 			throw_rte (_("Packed array is too long"));
 		}
 	}
@@ -223,7 +224,7 @@ public:
 		while (v != end) {
 			write_packed_float (*v++);
 		}
-		if (end_group() != length_val) {
+		if (end_group (true) != length_val) {
 			throw_rte (_("Packed array is too long"));
 		}
 	}
@@ -233,7 +234,7 @@ public:
 		while (v != end) {
 			write_packed_double (*v++);
 		}
-		if (end_group() != length_val) {
+		if (end_group (true) != length_val) {
 			throw_rte (_("Packed array is too long"));
 		}
 	}
@@ -259,7 +260,8 @@ public:
 	// Flush to stream.
 	void flush ();
 
-	// Get a reference to the buffer.
+	// Get a copy of the buffered bytes. The reference is valid until the
+	// next call.
 	const std::vector<char> & get_buffer() const;
 };
 
@@ -283,6 +285,8 @@ class EXPORTFN Protobuf_reader {
 	std::unique_ptr<Data> data;
 
 	void check_requirements();
+	static size_t decode_packed (const char **p, const char *lim,
+	                             uint64_t *vals, size_t nmax);
 
 public:
 	Protobuf_reader();
@@ -313,6 +317,28 @@ public:
 	// Just get the bytes without endianness conversion.
 	void get_bytes (void *buf, std::streamoff n);
 
+	// Consume the next n bytes and return a pointer to them. When reading
+	// from memory the pointer is into the buffer passed to the constructor
+	// or to set_input() and nothing is copied. When reading from a stream
+	// the bytes are copied into an internal buffer, which is valid until
+	// the next call to get_view().
+	const char * get_view (std::streamoff n);
+	// Store the next n bytes in s. Unlike resize() and get_bytes() the
+	// bytes are copied just once.
+	void get_string (std::string &s, std::streamoff n) {
+		const char *p = get_view (n);
+		s.assign (p, n);
+	}
+	// True if the input is a memory buffer.
+	bool reads_memory() const;
+
+	// Read a packed array of ULEB128 or ZLEB128 values. n is the length in
+	// bytes returned by read_tagval() together with the length_val wire
+	// type. The values are stored with *out++ and the number of values is
+	// returned. The whole array is decoded in one pass from get_view().
+	template <class Iter> size_t read_packed_uint (Iter out, uint64_t n);
+	template <class Iter> size_t read_packed_int (Iter out, uint64_t n);
+
 	// Skip the current item.
 	void skip (uint32_t tagwt, uint64_t val);
 
@@ -458,6 +484,214 @@ void Protobuf_reader::read_int (Wire_type wt, I *i)
 }
 
 
+template <class Iter>
+size_t Protobuf_reader::read_packed_uint (Iter out, uint64_t n)
+{
+	const char *p = get_view (n);
+	const char *lim = p + n;
+	uint64_t tmp[64];
+	size_t count = 0;
+
+	while (p < lim) {
+		size_t got = decode_packed (&p, lim, tmp, 64);
+		for (size_t i = 0; i < got; ++i) {
+			*out++ = tmp[i];
+		}
+		count += got;
+	}
+	return count;
+}
+
+
+template <class Iter>
+size_t Protobuf_reader::read_packed_int (Iter out, uint64_t n)
+{
+	const char *p = get_view (n);
+	const char *lim = p + n;
+	uint64_t tmp[64];
+	size_t count = 0;
+
+	while (p < lim) {
+		size_t got = decode_packed (&p, lim, tmp, 64);
+		for (size_t i = 0; i < got; ++i) {
+			*out++ = u2zleb (tmp[i]);
+		}
+		count += got;
+	}
+	return count;
+}
+
+
+
+// Compile time schemas. The fields of a struct are listed once as a
+// Pb_schema and the writer and the reader are generated from the list.
+// Each field is a class with the id, the requirement, a match() that
+// accepts the wire tags of the field and static write() and read()
+// functions. Pb_uint, Pb_uint_list, Pb_string, Pb_bytes and Pb_group_list
+// describe the common members. Other fields derive from them or from
+// Pb_field and provide their own functions. Fields are written in the
+// order of the list. The opts argument of write() is passed unchanged to
+// every field.
+//
+// When reading, unknown tags are skipped. The requirements are checked
+// with a bitmask with one bit per field instead of add_requirement().
+// Therefore a schema may have at most 64 fields.
+
+template <unsigned Id, Protobuf_reader::Requirement R>
+struct Pb_field {
+	static const unsigned id = Id;
+	static const Protobuf_reader::Requirement req = R;
+};
+
+// An integer member of type M written as ULEB128.
+template <unsigned Id, Protobuf_reader::Requirement R, class T, class M, M T::*Ptr>
+struct Pb_uint : Pb_field<Id, R> {
+	static bool match (uint32_t tagwt) { return tagwt == maketag (Id, varint); }
+	static void write (Protobuf_writer &pw, const T &t, unsigned) {
+		pw.write_uint (Id, t.*Ptr);
+	}
+	static void read (Protobuf_reader &, T &t, uint32_t, uint64_t val) {
+		t.*Ptr = M(val);
+	}
+};
+
+// A vector of integers, each one written as a ULEB128 field.
+template <unsigned Id, Protobuf_reader::Requirement R, class T, class E, std::vector<E> T::*Ptr>
+struct Pb_uint_list : Pb_field<Id, R> {
+	static bool match (uint32_t tagwt) { return tagwt == maketag (Id, varint); }
+	static void write (Protobuf_writer &pw, const T &t, unsigned) {
+		for (const auto &e : t.*Ptr) {
+			pw.write_uint (Id, e);
+		}
+	}
+	static void read (Protobuf_reader &, T &t, uint32_t, uint64_t val) {
+		(t.*Ptr).push_back (E(val));
+	}
+};
+
+// A std::string member.
+template <unsigned Id, Protobuf_reader::Requirement R, class T, std::string T::*Ptr>
+struct Pb_string : Pb_field<Id, R> {
+	static bool match (uint32_t tagwt) { return tagwt == maketag (Id, length_val); }
+	static void write (Protobuf_writer &pw, const T &t, unsigned) {
+		pw.write_bytes (Id, (t.*Ptr).data(), (t.*Ptr).size());
+	}
+	static void read (Protobuf_reader &pr, T &t, uint32_t, uint64_t val) {
+		pr.get_string (t.*Ptr, val);
+	}
+};
+
+// An array of N bytes. Any other length is an error.
+template <unsigned Id, Protobuf_reader::Requirement R, class T, size_t N, uint8_t (T::*Ptr)[N]>
+struct Pb_bytes : Pb_field<Id, R> {
+	static bool match (uint32_t tagwt) { return tagwt == maketag (Id, length_val); }
+	static void write (Protobuf_writer &pw, const T &t, unsigned) {
+		pw.write_bytes (Id, t.*Ptr, N);
+	}
+	static void read (Protobuf_reader &pr, T &t, uint32_t, uint64_t val) {
+		if (val != N) {
+			throw_rte (_("Field %d must be %d bytes long. Got %d."), Id, N, val);
+		}
+		pr.get_bytes (t.*Ptr, N);
+	}
+};
+
+// A vector of embedded groups, each one described by the schema S.
+template <unsigned Id, Protobuf_reader::Requirement R, class T, class E,
+          std::vector<E> T::*Ptr, class S>
+struct Pb_group_list : Pb_field<Id, R> {
+	static bool match (uint32_t tagwt) {
+		return tagwt == maketag (Id, group_len) || tagwt == maketag (Id, length_val);
+	}
+	static void write (Protobuf_writer &pw, const T &t, unsigned opts) {
+		for (const auto &e : t.*Ptr) {
+			pw.start_group (Id);
+			S::write (pw, e, opts);
+			pw.end_group();
+		}
+	}
+	static void read (Protobuf_reader &pr, T &t, uint32_t, uint64_t) {
+		(t.*Ptr).emplace_back();
+		S::read (pr, (t.*Ptr).back());
+	}
+};
+
+
+template <class T, class ... Fields> struct Pb_fields;
+
+template <class T>
+struct Pb_fields<T> {
+	static constexpr uint64_t once_mask = 0;
+	static constexpr uint64_t needed_mask = 0;
+	static void write (Protobuf_writer &, const T &, unsigned) {}
+	static int read (Protobuf_reader &pr, T &, uint32_t tagwt, uint64_t val) {
+		pr.skip (tagwt, val);
+		return -1;
+	}
+	static unsigned id (int) { return 0; }
+};
+
+template <class T, class F, class ... Rest>
+struct Pb_fields<T, F, Rest...> {
+	typedef Pb_fields<T, Rest...> Next;
+	static const int index = sizeof... (Rest);
+	static constexpr uint64_t bit = uint64_t(1) << index;
+	static constexpr uint64_t once_mask = Next::once_mask |
+		(F::req == Protobuf_reader::optional_once || F::req == Protobuf_reader::needed_once ? bit : 0);
+	static constexpr uint64_t needed_mask = Next::needed_mask |
+		(F::req == Protobuf_reader::needed_once || F::req == Protobuf_reader::needed_many ? bit : 0);
+
+	static void write (Protobuf_writer &pw, const T &t, unsigned opts) {
+		F::write (pw, t, opts);
+		Next::write (pw, t, opts);
+	}
+	// Read the field and return its index or -1 if the tag is unknown.
+	static int read (Protobuf_reader &pr, T &t, uint32_t tagwt, uint64_t val) {
+		if (F::match (tagwt)) {
+			F::read (pr, t, tagwt, val);
+			return index;
+		}
+		return Next::read (pr, t, tagwt, val);
+	}
+	static unsigned id (int i) { return i == index ? F::id : Next::id (i); }
+};
+
+
+template <class T, class ... Fields>
+struct Pb_schema {
+	static_assert (sizeof... (Fields) <= 64, "A schema can have at most 64 fields");
+	typedef Pb_fields<T, Fields...> List;
+
+	// Write the fields of t. The caller writes the enclosing group, if any.
+	static void write (Protobuf_writer &pw, const T &t, unsigned opts=0) {
+		List::write (pw, t, opts);
+	}
+
+	// Read the fields until the end of the current group and check the
+	// requirements.
+	static void read (Protobuf_reader &pr, T &t) {
+		uint64_t seen = 0;
+		uint32_t tagwt;
+		uint64_t val;
+		while (pr.read_tagval (&tagwt, &val)) {
+			int i = List::read (pr, t, tagwt, val);
+			if (i < 0) continue;
+			uint64_t bit = uint64_t(1) << i;
+			if (seen & bit & List::once_mask) {
+				throw_rte (_("Field %d can be present only once."), List::id (i));
+			}
+			seen |= bit;
+		}
+		uint64_t missing = List::needed_mask & ~seen;
+		if (missing != 0) {
+			int i = 0;
+			while ((missing & (uint64_t(1) << i)) == 0) ++i;
+			throw_rte (_("Field %d is required."), List::id (i));
+		}
+	}
+};
+
+
 }}
 
 #endif
@@ -4,7 +4,7 @@
 // Update the SONAME of the library whenever the ABI is changed in an incompatible way.
 // This allows the coexistence of several versions of the library within the same
 // executable program. Change it here and in the makefile.
-#define AMBER_SONAME v6
+#define AMBER_SONAME v7
 
 #if defined(_WIN32) || defined(__CYGWIN__)
 	#define EXPORTFN __declspec(dllexport)
@@ -79,6 +79,11 @@ void chacha20 (uint8_t out[64], const Chakey &key, uint64_t n64, uint64_t bn);
 EXPORTFN
 void chacha20 (uint8_t out[64], const uint32_t key[8], uint64_t nonce, uint64_t bn);
 
+// Compute four blocks at once. Block i uses the nonce n64[i] and the block
+// number bn[i] and is stored in out[64*i..64*i+63].
+EXPORTFN
+void chacha20_x4 (uint8_t out[256], const Chakey &key, const uint64_t n64[4], const uint64_t bn[4]);
+
 // Note: HChaCha20 and XChaCha20 are provided for completeness in line with
 // the XSalsa20 paper. However it is much better to use the Noise protocol
 // for the establishment of session keys. Noise just works with 64 bit nonces
@@ -27,11 +27,18 @@
 
 
 
-
 #include "zwrap.hpp"
+#include "misc.hpp"
 #include <stdexcept>
 #include <iostream>
+#include <vector>
 #include <string.h>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <memory>
 
 #include <zlib.h>
 #undef compress
@@ -40,72 +47,300 @@ namespace amber {  namespace AMBER_SONAME {
 
 enum Mode { none, compressing, expanding };
 
+// Each codec derives from Data. ZWrapper checks the mode and the codec does
+// the work. The codec functions return 0 or a zlib error code.
 struct ZWrapper::Data {
-	z_stream zs;
-	int      level;
+	int      level;          // Level for the input that follows.
 	Mode     mode;
 	std::streamoff length;
 	bool     finished;
+	unsigned nthreads;
+	bool     blocks;         // Compress the next stream in blocks.
+	size_t   block_size;
+
+	Data (int lev) : level(lev), mode(none), length(0), finished(false),
+	                 nthreads(1), blocks(false), block_size(1 << 20) {}
+	virtual ~Data() {}
+	virtual Zcodec codec() const = 0;
+	virtual int compress (const unsigned char *buf, size_t n,
+	                      buffer<unsigned char> *res, bool finish) = 0;
+	virtual int expand (const unsigned char *buf, size_t n,
+	                    buffer<unsigned char> *res, bool finish) = 0;
+	// Free the state of the current stream and set the mode to none.
+	virtual void end() = 0;
 };
 
-ZWrapper::ZWrapper(int lev)
-	: ok(true)
+
+// The helper threads that compress the blocks of a stream. They are started
+// with the first batch and kept until the end of the stream.
+class Batch_pool {
+	std::vector<std::thread> threads;
+	std::mutex mtx;
+	std::condition_variable cv;
+	std::function<void()> job;
+	unsigned generation = 0;     // Incremented for each job.
+	unsigned active = 0;         // Helpers that run the job.
+	unsigned running = 0;        // Helpers still running the job.
+	bool stop = false;
+
+	void loop (unsigned index);
+public:
+	~Batch_pool();
+	// Run fn in the calling thread and in nhelpers other threads. Return
+	// when all of them have finished.
+	void run (unsigned nhelpers, const std::function<void()> &fn);
+};
+
+void Batch_pool::loop (unsigned index)
 {
-	pimpl = new Data;
-	pimpl->level = lev;
-	pimpl->mode = none;
-	pimpl->length = 0;
-	pimpl->finished = false;
+	unsigned seen = 0;
+	for (;;) {
+		std::function<void()> fn;
+		{
+			std::unique_lock<std::mutex> lk(mtx);
+			cv.wait (lk, [&] { return stop || generation != seen; });
+			if (stop) return;
+			seen = generation;
+			if (index >= active) continue;
+			fn = job;
+		}
+		fn();
+		std::lock_guard<std::mutex> lk(mtx);
+		if (--running == 0) cv.notify_all();
+	}
 }
 
-ZWrapper::ZWrapper (const ZWrapper &rhs)
+void Batch_pool::run (unsigned nhelpers, const std::function<void()> &fn)
 {
-	pimpl = new Data;
-//    deflateCopy (pimpl->zs, rhs.pimpl->zs);
-	pimpl->level = rhs.pimpl->level;
-	pimpl->mode = none;
-	pimpl->length = rhs.pimpl->length;
-	pimpl->finished = rhs.pimpl->finished;
+	while (threads.size() < nhelpers) {
+		threads.push_back (std::thread (&Batch_pool::loop, this, unsigned(threads.size())));
+	}
+	{
+		std::lock_guard<std::mutex> lk(mtx);
+		job = fn;
+		active = running = nhelpers;
+		++generation;
+	}
+	cv.notify_all();
+	fn();
+	std::unique_lock<std::mutex> lk(mtx);
+	cv.wait (lk, [this] { return running == 0; });
 }
 
-ZWrapper::~ZWrapper()
+Batch_pool::~Batch_pool()
 {
-	if (pimpl->mode == compressing) {
-		deflateEnd (&pimpl->zs);
-	} else if (pimpl->mode == expanding) {
-		inflateEnd (&pimpl->zs);
+	{
+		std::lock_guard<std::mutex> lk(mtx);
+		stop = true;
+	}
+	cv.notify_all();
+	for (unsigned i = 0; i < threads.size(); ++i) {
+		threads[i].join();
 	}
-	delete pimpl;
 }
 
-ZWrapper & ZWrapper::operator= (const ZWrapper &rhs)
+
+struct ZWrapper::Deflate_data : ZWrapper::Data {
+	z_stream zs;
+	// State of the compression in blocks. zs is not used then.
+	bool     in_blocks;
+	std::vector<unsigned char> pending;   // Input not yet compressed.
+	std::vector<unsigned char> dict;      // The last bytes of the input.
+	uLong    check;                       // Adler-32 of the input so far.
+	int      used_level;                  // Level of zs or of pending.
+	std::unique_ptr<Batch_pool> pool;
+
+	Deflate_data (int lev) : Data(lev), in_blocks(false), used_level(lev) {}
+	~Deflate_data() { end(); }
+	Zcodec codec() const { return zcodec_deflate; }
+	int compress (const unsigned char *buf, size_t n, buffer<unsigned char> *res, bool finish);
+	int expand (const unsigned char *buf, size_t n, buffer<unsigned char> *res, bool finish);
+	void end();
+	int compress_blocks (const unsigned char *buf, size_t n, buffer<unsigned char> *res,
+	                     bool finish);
+	int compress_batch (const unsigned char *p, size_t n, bool last,
+	                    std::vector<unsigned char> &out);
+	int change_level (buffer<unsigned char> *res, size_t &count);
+};
+
+
+// The size of the deflate window. Each block uses the last window_size bytes
+// before it as the dictionary.
+enum { window_size = 32768 };
+
+// Compress p[0..n[ as raw deflate data into out, using dict[0..dn[ as the
+// preset dictionary. The output ends with a sync flush, so that the
+// output of the next block can be appended, or with the final block if
+// last is set.
+static int deflate_block (const unsigned char *p, size_t n, const unsigned char *dict,
+                          size_t dn, bool last, int level, std::vector<unsigned char> &out)
 {
-	if (pimpl->mode == compressing) {
-		deflateEnd (&pimpl->zs);
-	} else if (pimpl->mode == expanding) {
-		inflateEnd (&pimpl->zs);
+	z_stream s;
+	memset (&s, 0, sizeof s);
+	int rc = deflateInit2 (&s, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);
+	if (rc != Z_OK) {
+		return rc;
 	}
-	delete pimpl;
+	if (dn != 0) {
+		rc = deflateSetDictionary (&s, dict, dn);
+		if (rc != Z_OK) {
+			deflateEnd (&s);
+			return rc;
+		}
+	}
+	out.resize (deflateBound (&s, n) + 16);
+	s.next_in = (Bytef*)p;
+	s.avail_in = n;
+	s.next_out = &out[0];
+	s.avail_out = out.size();
+	for (;;) {
+		rc = deflate (&s, last ? Z_FINISH : Z_SYNC_FLUSH);
+		if (rc != Z_OK && rc != Z_STREAM_END && rc != Z_BUF_ERROR) {
+			deflateEnd (&s);
+			return rc;
+		}
+		if (s.avail_out != 0) break;
+		size_t used = out.size();
+		out.resize (used * 2);
+		s.next_out = &out[used];
+		s.avail_out = out.size() - used;
+	}
+	out.resize (out.size() - s.avail_out);
+	deflateEnd (&s);
+	return 0;
+}
 
-	pimpl = new Data;
-	pimpl->level = rhs.pimpl->level;
-	pimpl->mode = none;
-	pimpl->length = rhs.pimpl->length;
-	pimpl->finished = rhs.pimpl->finished;
+// Compress p[0..n[, splitting it in blocks of block_size bytes that are
+// compressed by different threads. Append the compressed data to out.
+int ZWrapper::Deflate_data::compress_batch (const unsigned char *p, size_t n, bool last,
+                                            std::vector<unsigned char> &out)
+{
+	size_t nblocks = n == 0 ? 1 : (n + block_size - 1) / block_size;
+	std::vector<std::vector<unsigned char> > outs (nblocks);
+	std::vector<uLong> sums (nblocks);
+	std::vector<int> rcs (nblocks);
+	std::atomic<size_t> next (0);
 
-	return *this;
+	auto work = [&]() {
+		for (size_t i = next++; i < nblocks; i = next++) {
+			size_t beg = i * block_size;
+			size_t len = n - beg < block_size ? n - beg : block_size;
+			// block_size is at least window_size, therefore the dictionary
+			// of all the blocks but the first one is in p.
+			const unsigned char *d = i == 0 ? dict.data() : p + beg - window_size;
+			size_t dn = i == 0 ? dict.size() : size_t(window_size);
+			rcs[i] = deflate_block (p + beg, len, d, dn, last && i == nblocks - 1,
+			                        used_level, outs[i]);
+			sums[i] = adler32 (adler32 (0, Z_NULL, 0), p + beg, len);
+		}
+	};
+
+	if (nthreads > 1 && nblocks > 1) {
+		if (!pool) pool.reset (new Batch_pool);
+		pool->run (nthreads - 1 < nblocks - 1 ? nthreads - 1 : nblocks - 1, work);
+	} else {
+		work();
+	}
+
+	for (size_t i = 0; i < nblocks; ++i) {
+		if (rcs[i] != 0) {
+			return rcs[i];
+		}
+		size_t beg = i * block_size;
+		size_t len = n - beg < block_size ? n - beg : block_size;
+		out.insert (out.end(), outs[i].begin(), outs[i].end());
+		check = adler32_combine (check, sums[i], len);
+	}
+
+	if (n >= window_size) {
+		dict.assign (p + n - window_size, p + n);
+	} else {
+		dict.insert (dict.end(), p, p + n);
+		if (dict.size() > window_size) {
+			dict.erase (dict.begin(), dict.end() - window_size);
+		}
+	}
+	return 0;
 }
 
+// Like pigz, compress independent blocks in parallel. Each block is
+// compressed with the end of the previous one as dictionary and terminated
+// with a sync flush. The result is a single zlib stream that any inflater
+// can expand.
+int ZWrapper::Deflate_data::compress_blocks (const unsigned char *buf, size_t n,
+                                             buffer<unsigned char> *res, bool finish)
+{
+	std::vector<unsigned char> out;
+	if (mode == none) {
+		mode = compressing;
+		in_blocks = true;
+		pending.clear();
+		dict.clear();
+		check = adler32 (0, Z_NULL, 0);
+		used_level = level;
+		// The zlib header, with the same level bits that deflate uses.
+		int lflags = level == Z_DEFAULT_COMPRESSION ? 2 : level < 2 ? 0 : level < 6 ? 1
+		             : level == 6 ? 2 : 3;
+		unsigned header = (0x78 << 8) | (lflags << 6);
+		header += 31 - header % 31;
+		out.push_back (header >> 8);
+		out.push_back (header & 0xFF);
+	}
+	if (finished) {
+		res->resize (0);
+		return 0;
+	}
 
-int ZWrapper::compress(const unsigned char *buf, size_t n, buffer<unsigned char> *res, bool finish)
+	size_t beg = 0;
+	int rc = 0;
+	if (used_level != level) {
+		// The input given before set_level() is compressed on its own.
+		if (!pending.empty()) {
+			rc = compress_batch (pending.data(), pending.size(), false, out);
+			pending.clear();
+		}
+		used_level = level;
+	}
+	pending.insert (pending.end(), buf, buf + n);
+	size_t batch = nthreads * block_size;
+	// Keep some input until finish, because the last block must be
+	// compressed differently.
+	while (rc == 0 && pending.size() - beg > batch) {
+		rc = compress_batch (&pending[beg], batch, false, out);
+		beg += batch;
+	}
+	if (rc == 0 && finish) {
+		size_t len = pending.size() - beg;
+		rc = compress_batch (pending.data() + beg, len, true, out);
+		beg += len;
+		for (int i = 3; i >= 0; --i) {
+			out.push_back (check >> (i * 8));
+		}
+		finished = true;
+	}
+	pending.erase (pending.begin(), pending.begin() + beg);
+
+	res->resize (out.size());
+	if (!out.empty()) {
+		memcpy (&(*res)[0], &out[0], out.size());
+	}
+	return rc;
+}
+
+
+int ZWrapper::Deflate_data::compress(const unsigned char *buf, size_t n, buffer<unsigned char> *res, bool finish)
 {
-	if (pimpl->mode == expanding) {
-		throw std::logic_error ("ZWrapper::compress() called while in expanding mode");
+	if (in_blocks || (mode == none && blocks)) {
+		return compress_blocks (buf, n, res, finish);
 	}
-	if (pimpl->mode == none) {
-		memset (&pimpl->zs, 0, sizeof pimpl->zs);
-		ok = Z_OK == deflateInit (&pimpl->zs, pimpl->level);
-		pimpl->mode = compressing;
+	if (mode == none) {
+		memset (&zs, 0, sizeof zs);
+		int rc = deflateInit (&zs, level);
+		if (rc != Z_OK) {
+			return rc;
+		}
+		used_level = level;
+		mode = compressing;
 	}
 
 	res->resize(res->capacity());
@@ -115,47 +350,85 @@ int ZWrapper::compress(const unsigned char *buf, size_t n, buffer<unsigned char>
 
 	size_t cap = res->size();
 
-	pimpl->zs.next_in   = (Bytef*)buf;
-	pimpl->zs.avail_in  = n;
-	pimpl->zs.next_out  = (Bytef*)&(*res)[0];
-	pimpl->zs.avail_out = cap;
+	zs.next_out  = (Bytef*)&(*res)[0];
+	zs.avail_out = cap;
+	size_t count = 0;
+	if (used_level != level) {
+		int rc = change_level (res, count);
+		if (rc != 0) {
+			return rc;
+		}
+		cap = res->size() - count;
+	}
+
+	zs.next_in   = (Bytef*)buf;
+	zs.avail_in  = n;
 
-	int mode = finish ? Z_FINISH : Z_NO_FLUSH;
-	int count = 0;
+	int zflush = finish ? Z_FINISH : Z_NO_FLUSH;
 
 	for (;;) {
-		int rc = deflate(&pimpl->zs, mode);
+		int rc = deflate(&zs, zflush);
 		if (rc != Z_OK && rc != Z_STREAM_END && rc != Z_BUF_ERROR) {
-			ok = false;
 			return rc;
 		}
-		if (pimpl->zs.avail_out != 0) {
-			res->resize(count + cap - pimpl->zs.avail_out);
+		if (zs.avail_out != 0) {
+			res->resize(count + cap - zs.avail_out);
 			break;
 		}
 
 		count += cap;
 		size_t ncap = cap * 2;
 		res->resize(count + ncap);
-		pimpl->zs.next_out = (Bytef*) &(*res)[count];
-		pimpl->zs.avail_out = ncap;
+		zs.next_out = (Bytef*) &(*res)[count];
+		zs.avail_out = ncap;
 		cap = ncap;
 	}
 
 	return 0;
 }
 
-
-int ZWrapper::expand(const unsigned char *buf, size_t n,
-                     buffer<unsigned char> *res, bool finish)
+// Switch zs to the level given by set_level(). zlib first compresses the
+// input that it holds with the previous level. The output is put at
+// res[count..] and zs.next_out is left in the same state as compress()
+// expects, with count bytes of *res already full.
+int ZWrapper::Deflate_data::change_level (buffer<unsigned char> *res, size_t &count)
 {
-	if (pimpl->mode == compressing) {
-		throw std::logic_error ("ZWrapper::expand() called while in compressing mode");
+	for (;;) {
+		int rc = deflateParams (&zs, level, Z_DEFAULT_STRATEGY);
+		if (rc == Z_OK) {
+			break;
+		}
+		if (rc != Z_BUF_ERROR) {
+			return rc;
+		}
+		// Not enough room for the pending output.
+		size_t used = (unsigned char*)zs.next_out - &(*res)[0];
+		res->resize (res->size() * 2);
+		zs.next_out = &(*res)[used];
+		zs.avail_out = res->size() - used;
 	}
-	if (pimpl->mode == none) {
-		memset (&pimpl->zs, 0, sizeof pimpl->zs);
-		ok = Z_OK == inflateInit (&pimpl->zs);
-		pimpl->mode = expanding;
+	used_level = level;
+	// Leave a free area of the usual size.
+	count = (unsigned char*)zs.next_out - &(*res)[0];
+	if (zs.avail_out < res->size() / 2) {
+		res->resize (count + res->size() / 2 + 1);
+		zs.next_out = &(*res)[count];
+	}
+	zs.avail_out = res->size() - count;
+	return 0;
+}
+
+
+int ZWrapper::Deflate_data::expand(const unsigned char *buf, size_t n,
+                         buffer<unsigned char> *res, bool finish)
+{
+	if (mode == none) {
+		memset (&zs, 0, sizeof zs);
+		int rc = inflateInit (&zs);
+		if (rc != Z_OK) {
+			return rc;
+		}
+		mode = expanding;
 	}
 
 	res->resize(res->capacity());
@@ -164,40 +437,555 @@ int ZWrapper::expand(const unsigned char *buf, size_t n,
 	}
 	size_t cap = res->size();
 
-	pimpl->zs.next_in   = (unsigned char*) buf;
-	pimpl->zs.avail_in  = n;
-	pimpl->zs.next_out  = (Bytef*) &((*res)[0]);
-	pimpl->zs.avail_out = cap;
+	zs.next_in   = (unsigned char*) buf;
+	zs.avail_in  = n;
+	zs.next_out  = (Bytef*) &((*res)[0]);
+	zs.avail_out = cap;
 
-	int mode = finish ? Z_FINISH : Z_NO_FLUSH;
+	int zflush = finish ? Z_FINISH : Z_NO_FLUSH;
 	for (;;) {
-		int rc = inflate(&pimpl->zs, mode);
+		int rc = inflate(&zs, zflush);
 		if (rc != Z_OK && rc != Z_STREAM_END && rc != Z_BUF_ERROR) {
-			ok = false;
 			return rc;
 		}
 
-		if (pimpl->zs.avail_out != 0) {
-			res->resize(cap - pimpl->zs.avail_out);
-			pimpl->length += n - pimpl->zs.avail_in;
+		if (zs.avail_out != 0) {
+			res->resize(cap - zs.avail_out);
+			length += n - zs.avail_in;
 			if (rc == Z_STREAM_END) {
-				pimpl->finished = true;
+				finished = true;
 			}
 			break;
 		}
 
 		size_t ncap = cap * 2;
 		res->resize(ncap);
-		pimpl->zs.next_out = (Bytef*) &(*res)[cap];
-		pimpl->zs.avail_out = cap;
+		zs.next_out = (Bytef*) &(*res)[cap];
+		zs.avail_out = cap;
 		cap = ncap;
 	}
 
 	return 0;
 }
 
+void ZWrapper::Deflate_data::end()
+{
+	if (in_blocks) {
+		pending.clear();
+		dict.clear();
+		pool.reset();
+		in_blocks = false;
+	} else if (mode == compressing) {
+		deflateEnd (&zs);
+	} else if (mode == expanding) {
+		inflateEnd (&zs);
+	}
+	mode = none;
+}
+
+
+
+// A fast LZ77 codec in the style of LZ4. The input is split into blocks of
+// at most lz_block bytes, which are compressed independently. Each block
+// starts with an 8 byte header with the expanded size and the stored size,
+// both in little endian order. If the top bit of the stored size is set
+// then the block is stored without compression. A header with an expanded
+// size of 0 and a stored size of 4 ends the stream. It is followed by the
+// Adler-32 of the expanded data in little endian order.
+//
+// A compressed block is a sequence of matches. Each one starts with a token
+// byte. Its high nibble is the number of literals and the low nibble is the
+// length of the match minus lz_min_match. A nibble of 15 means that more
+// bytes follow, each one adding up to 255. Then come the literals, the
+// offset of the match in two little endian bytes and the rest of the match
+// length. The last sequence has only literals. The last lz_last_literals
+// bytes of a block are always literals.
+
+enum { lz_block = 65536, lz_hash_bits = 14, lz_min_match = 4, lz_last_literals = 5,
+       lz_match_limit = 12, lz_raw = 0x80000000, lz_trailer = 12, lz_slack = 32 };
+
+static inline uint32_t lz_read32 (const uint8_t *p)
+{
+	uint32_t v;
+	memcpy (&v, p, 4);
+	return v;
+}
+
+static inline uint8_t * lz_put_length (uint8_t *op, size_t len)
+{
+	while (len >= 255) {
+		*op++ = 255;
+		len -= 255;
+	}
+	*op++ = len;
+	return op;
+}
+
+static inline uint8_t * lz_literals (uint8_t *op, const uint8_t *lit, size_t nlit, size_t mlen)
+{
+	size_t ml = mlen - lz_min_match;
+	uint8_t token = (nlit >= 15 ? 15 : nlit) << 4;
+	if (mlen != 0) token |= ml >= 15 ? 15 : ml;
+	*op++ = token;
+	if (nlit >= 15) op = lz_put_length (op, nlit - 15);
+	memcpy (op, lit, nlit);
+	return op + nlit;
+}
+
+// The maximum size of a compressed block of n bytes.
+static inline size_t lz_bound (size_t n)
+{
+	return n + n / 255 + 16;
+}
+
+// Compress src[0..n[ into dst, which has room for lz_bound(n) bytes, and
+// return the compressed size. table has 1 << lz_hash_bits entries.
+static size_t lz_compress_block (const uint8_t *src, size_t n, uint8_t *dst, uint32_t *table)
+{
+	memset (table, 0, sizeof(uint32_t) << lz_hash_bits);
+	const uint8_t *ip = src, *anchor = src, *end = src + n;
+	const uint8_t *limit = n > lz_match_limit ? end - lz_match_limit : src;
+	const uint8_t *match_end = end - lz_last_literals;
+	uint8_t *op = dst;
+
+	while (ip < limit) {
+		uint32_t seq = lz_read32 (ip);
+		uint32_t h = (seq * 2654435761u) >> (32 - lz_hash_bits);
+		const uint8_t *ref = src + table[h];
+		table[h] = ip - src;
+		if (ref >= ip || ip - ref > 65535 || lz_read32 (ref) != seq) {
+			// Skip faster over data that does not match.
+			ip += 1 + ((ip - anchor) >> 6);
+			continue;
+		}
+		while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+			--ip;
+			--ref;
+		}
+		const uint8_t *p = ip + lz_min_match, *q = ref + lz_min_match;
+		while (p + 8 <= match_end) {
+			uint64_t a, b;
+			memcpy (&a, p, 8);
+			memcpy (&b, q, 8);
+			if (a != b) break;
+			p += 8;
+			q += 8;
+		}
+		while (p < match_end && *p == *q) {
+			++p;
+			++q;
+		}
+		size_t mlen = p - ip;
+		op = lz_literals (op, anchor, ip - anchor, mlen);
+		size_t off = ip - ref;
+		*op++ = off & 0xFF;
+		*op++ = off >> 8;
+		if (mlen - lz_min_match >= 15) op = lz_put_length (op, mlen - lz_min_match - 15);
+		ip = anchor = p;
+	}
+	op = lz_literals (op, anchor, end - anchor, 0);
+	return op - dst;
+}
+
+static inline bool lz_get_length (const uint8_t *&ip, const uint8_t *iend, size_t &len)
+{
+	unsigned b;
+	do {
+		if (ip >= iend) return false;
+		b = *ip++;
+		len += b;
+	} while (b == 255);
+	return true;
+}
+
+// Copy n bytes in pieces of 8 or 16 bytes. They may write up to 15 bytes
+// after d + n and read up to 15 bytes after s + n. The pieces are copied in
+// order, so s may overlap d if s is at least one piece behind d.
+static inline void lz_copy8 (uint8_t *d, const uint8_t *s, size_t n)
+{
+	uint8_t *e = d + n;
+	do {
+		memcpy (d, s, 8);
+		d += 8;
+		s += 8;
+	} while (d < e);
+}
+
+static inline void lz_copy16 (uint8_t *d, const uint8_t *s, size_t n)
+{
+	uint8_t *e = d + n;
+	do {
+		memcpy (d, s, 16);
+		d += 16;
+		s += 16;
+	} while (d < e);
+}
+
+// Expand src[0..n[ into exactly dn bytes at dst. Return false if the block
+// is not valid. There must be room for lz_slack bytes after dst + dn. They
+// may be overwritten even if the block is valid.
+static bool lz_expand_block (const uint8_t *src, size_t n, uint8_t *dst, size_t dn)
+{
+	const uint8_t *ip = src, *iend = src + n;
+	uint8_t *op = dst, *oend = dst + dn;
+	for (;;) {
+		if (ip >= iend) return false;
+		unsigned token = *ip++;
+		size_t nlit = token >> 4;
+
+		// Short literals and matches, far from the ends of the block.
+		if (nlit < 15 && (token & 15) < 15 && iend - ip >= 18 && oend - op >= 34) {
+			memcpy (op, ip, 16);
+			op += nlit;
+			ip += nlit;
+			size_t off = ip[0] | (ip[1] << 8);
+			ip += 2;
+			if (off >= 8 && off <= size_t(op - dst)) {
+				const uint8_t *m = op - off;
+				memcpy (op, m, 8);
+				memcpy (op + 8, m + 8, 8);
+				memcpy (op + 16, m + 16, 8);
+				op += (token & 15) + lz_min_match;
+				continue;
+			}
+			ip -= 2;
+			token &= 15;
+			nlit = 0;
+		}
+
+		if (nlit == 15 && !lz_get_length (ip, iend, nlit)) return false;
+		if (size_t(iend - ip) < nlit || size_t(oend - op) < nlit) return false;
+		if (size_t(iend - ip) >= nlit + 16) {
+			lz_copy16 (op, ip, nlit);
+		} else {
+			memcpy (op, ip, nlit);
+		}
+		op += nlit;
+		ip += nlit;
+		if (ip == iend) {
+			return op == oend;
+		}
+		if (iend - ip < 2) return false;
+		size_t off = ip[0] | (ip[1] << 8);
+		ip += 2;
+		if (off == 0 || off > size_t(op - dst)) return false;
+		size_t mlen = token & 15;
+		if (mlen == 15 && !lz_get_length (ip, iend, mlen)) return false;
+		mlen += lz_min_match;
+		if (size_t(oend - op) < mlen) return false;
+		const uint8_t *m = op - off;
+		if (off >= 16) {
+			lz_copy16 (op, m, mlen);
+		} else if (off >= 8) {
+			lz_copy8 (op, m, mlen);
+		} else {
+			// The match repeats a pattern of off bytes. Copy the first
+			// 8 bytes one by one and the rest from a multiple of off
+			// that is at least 8 bytes behind.
+			for (unsigned i = 0; i < 8; ++i) op[i] = m[i];
+			if (mlen > 8) {
+				size_t d = off;
+				while (d < 8) d += off;
+				lz_copy8 (op + 8, op + 8 - d, mlen - 8);
+			}
+		}
+		op += mlen;
+	}
+}
+
+// Return the size of the record that starts with the 8 byte header at p and
+// set exp to its expanded size. The record of an invalid header is the
+// header alone and its expanded size is 0.
+static size_t lz_record (const uint8_t *p, size_t &exp)
+{
+	uint32_t e = leget32 (p);
+	uint32_t stored = leget32 (p + 4);
+	exp = 0;
+	if (e == 0) {
+		return stored == 4 ? size_t(lz_trailer) : 8;
+	}
+	bool raw = stored & lz_raw;
+	stored &= ~uint32_t(lz_raw);
+	if (e > lz_block || (raw && stored != e) || (!raw && stored >= e)) {
+		return 8;
+	}
+	exp = e;
+	return 8 + stored;
+}
+
+
+struct ZWrapper::Lz_data : ZWrapper::Data {
+	std::vector<uint8_t>  pending;   // Input not yet processed.
+	std::vector<uint8_t>  out;
+	std::vector<uint32_t> table;
+	uLong                 check;     // Adler-32 of the expanded data so far.
+
+	Lz_data (int lev) : Data(lev) {}
+	Zcodec codec() const { return zcodec_lz; }
+	int compress (const unsigned char *buf, size_t n, buffer<unsigned char> *res, bool finish);
+	int expand (const unsigned char *buf, size_t n, buffer<unsigned char> *res, bool finish);
+	void end();
+	void put_block (const uint8_t *p, size_t n);
+	void put_out (buffer<unsigned char> *res);
+	int expand_records (const uint8_t *p, size_t n, uint8_t *&op);
+};
+
+void ZWrapper::Lz_data::put_block (const uint8_t *p, size_t n)
+{
+	size_t hdr = out.size();
+	out.resize (hdr + 8 + lz_bound (n));
+	size_t stored = lz_compress_block (p, n, &out[hdr + 8], &table[0]);
+	if (stored >= n) {
+		memcpy (&out[hdr + 8], p, n);
+		stored = n | lz_raw;
+	}
+	out.resize (hdr + 8 + (stored & ~uint32_t(lz_raw)));
+	leput32 (&out[hdr], n);
+	leput32 (&out[hdr + 4], stored);
+	check = adler32 (check, p, n);
+}
+
+void ZWrapper::Lz_data::put_out (buffer<unsigned char> *res)
+{
+	res->resize (out.size());
+	if (!out.empty()) {
+		memcpy (&(*res)[0], &out[0], out.size());
+	}
+	out.clear();
+}
+
+int ZWrapper::Lz_data::compress (const unsigned char *buf, size_t n, buffer<unsigned char> *res, bool finish)
+{
+	if (mode == none) {
+		table.resize (size_t(1) << lz_hash_bits);
+		check = adler32 (0, Z_NULL, 0);
+		mode = compressing;
+	}
+	if (finished) {
+		res->resize (0);
+		return 0;
+	}
+
+	// Compress whole blocks straight from buf and keep the rest.
+	if (!pending.empty()) {
+		size_t take = lz_block - pending.size();
+		if (take > n) take = n;
+		pending.insert (pending.end(), buf, buf + take);
+		buf += take;
+		n -= take;
+		if (pending.size() == lz_block) {
+			put_block (&pending[0], lz_block);
+			pending.clear();
+		}
+	}
+	while (n >= lz_block) {
+		put_block (buf, lz_block);
+		buf += lz_block;
+		n -= lz_block;
+	}
+	pending.insert (pending.end(), buf, buf + n);
+
+	if (finish) {
+		if (!pending.empty()) {
+			put_block (&pending[0], pending.size());
+			pending.clear();
+		}
+		size_t hdr = out.size();
+		out.resize (hdr + lz_trailer);
+		leput32 (&out[hdr], 0);
+		leput32 (&out[hdr + 4], 4);
+		leput32 (&out[hdr + 8], check);
+		finished = true;
+	}
+	put_out (res);
+	return 0;
+}
+
+// Expand the whole records in p[0..n[ into op and advance op.
+int ZWrapper::Lz_data::expand_records (const uint8_t *p, size_t n, uint8_t *&op)
+{
+	size_t beg = 0;
+	while (beg < n) {
+		uint32_t exp = leget32 (p + beg);
+		uint32_t stored = leget32 (p + beg + 4);
+		if (exp == 0) {
+			if (stored != 4 || leget32 (p + beg + 8) != (check & 0xFFFFFFFF)) {
+				return Z_DATA_ERROR;
+			}
+			length += lz_trailer;
+			finished = true;
+			return 0;
+		}
+		bool raw = stored & lz_raw;
+		stored &= ~uint32_t(lz_raw);
+		if (exp > lz_block || (raw && stored != exp) || (!raw && stored >= exp)) {
+			return Z_DATA_ERROR;
+		}
+		if (raw) {
+			memcpy (op, p + beg + 8, exp);
+		} else if (!lz_expand_block (p + beg + 8, stored, op, exp)) {
+			return Z_DATA_ERROR;
+		}
+		check = adler32 (check, op, exp);
+		op += exp;
+		beg += 8 + stored;
+		length += 8 + stored;
+	}
+	return 0;
+}
+
+// The whole records are expanded straight from buf into res. Only a record
+// that is cut at the end of buf is kept in pending.
+int ZWrapper::Lz_data::expand (const unsigned char *buf, size_t n, buffer<unsigned char> *res, bool finish)
+{
+	if (mode == none) {
+		check = adler32 (0, Z_NULL, 0);
+		mode = expanding;
+	}
+	if (finished) {
+		n = 0;
+	}
+
+	// Complete the record that was cut in the previous call.
+	size_t exp, total = 0;
+	bool head = false;
+	if (!pending.empty()) {
+		size_t take = pending.size() < 8 ? 8 - pending.size() : 0;
+		if (take > n) take = n;
+		pending.insert (pending.end(), buf, buf + take);
+		buf += take;
+		n -= take;
+		if (pending.size() >= 8) {
+			take = lz_record (&pending[0], exp) - pending.size();
+			if (take > n) take = n;
+			pending.insert (pending.end(), buf, buf + take);
+			buf += take;
+			n -= take;
+			head = pending.size() == lz_record (&pending[0], exp);
+			total = exp;
+		}
+	}
+
+	// Find the whole records in buf and the size of their expansion.
+	size_t used = 0;
+	if (pending.empty() || head) {
+		while (n - used >= 8) {
+			size_t rec = lz_record (buf + used, exp);
+			if (n - used < rec) break;
+			used += rec;
+			total += exp;
+			if (leget32 (buf + used - rec) == 0) break;
+		}
+	}
+
+	res->resize (total + lz_slack, false);
+	uint8_t *op = &(*res)[0];
+	int rc = 0;
+	if (head) {
+		rc = expand_records (&pending[0], pending.size(), op);
+		pending.clear();
+	}
+	if (rc == 0 && !finished) {
+		rc = expand_records (buf, used, op);
+	}
+	res->resize (op - &(*res)[0]);
+
+	if (finished || rc != 0) {
+		pending.clear();
+	} else if (used < n) {
+		pending.insert (pending.end(), buf + used, buf + n);
+	}
+	if (!finished && finish && rc == 0) {
+		// The stream was cut before its end.
+		rc = Z_DATA_ERROR;
+	}
+	return rc;
+}
+
+void ZWrapper::Lz_data::end()
+{
+	pending.clear();
+	out.clear();
+	mode = none;
+}
+
+
+ZWrapper::Data * ZWrapper::new_data (Zcodec codec, int level)
+{
+	switch (codec) {
+	case zcodec_deflate:
+		return new Deflate_data (level);
+	case zcodec_lz:
+		return new Lz_data (level);
+	}
+	throw std::invalid_argument ("Unknown ZWrapper codec");
+}
+
+
+ZWrapper::ZWrapper(int lev, Zcodec codec)
+	: ok(true)
+{
+	pimpl = new_data (codec, lev);
+}
+
+ZWrapper::ZWrapper (const ZWrapper &rhs)
+{
+	pimpl = new_data (rhs.pimpl->codec(), rhs.pimpl->level);
+	pimpl->nthreads = rhs.pimpl->nthreads;
+	pimpl->blocks = rhs.pimpl->blocks;
+	pimpl->block_size = rhs.pimpl->block_size;
+	pimpl->length = rhs.pimpl->length;
+	pimpl->finished = rhs.pimpl->finished;
+	ok = rhs.ok;
+}
+
+ZWrapper::~ZWrapper()
+{
+	delete pimpl;
+}
+
+ZWrapper & ZWrapper::operator= (const ZWrapper &rhs)
+{
+	Data *d = new_data (rhs.pimpl->codec(), rhs.pimpl->level);
+	delete pimpl;
+	pimpl = d;
+	pimpl->nthreads = rhs.pimpl->nthreads;
+	pimpl->blocks = rhs.pimpl->blocks;
+	pimpl->block_size = rhs.pimpl->block_size;
+	pimpl->length = rhs.pimpl->length;
+	pimpl->finished = rhs.pimpl->finished;
+	ok = rhs.ok;
+
+	return *this;
+}
+
+
+int ZWrapper::compress(const unsigned char *buf, size_t n, buffer<unsigned char> *res, bool finish)
+{
+	if (pimpl->mode == expanding) {
+		throw std::logic_error ("ZWrapper::compress() called while in expanding mode");
+	}
+	int rc = pimpl->compress (buf, n, res, finish);
+	if (rc != 0) {
+		ok = false;
+	}
+	return rc;
+}
 
 
+int ZWrapper::expand(const unsigned char *buf, size_t n,
+                     buffer<unsigned char> *res, bool finish)
+{
+	if (pimpl->mode == compressing) {
+		throw std::logic_error ("ZWrapper::expand() called while in compressing mode");
+	}
+	int rc = pimpl->expand (buf, n, res, finish);
+	if (rc != 0) {
+		ok = false;
+	}
+	return rc;
+}
+
 int ZWrapper::flush (buffer<unsigned char> *res)
 {
 	if (pimpl->mode == expanding) {
@@ -210,12 +998,7 @@ int ZWrapper::flush (buffer<unsigned char> *res)
 
 void ZWrapper::reset()
 {
-	if (pimpl->mode == compressing) {
-		deflateEnd (&pimpl->zs);
-	} else if (pimpl->mode == expanding) {
-		inflateEnd (&pimpl->zs);
-	}
-	pimpl->mode = none;
+	pimpl->end();
 	pimpl->length = 0;
 	pimpl->finished = false;
 	ok = true;
@@ -231,6 +1014,37 @@ bool ZWrapper::finished() const
 	return pimpl->finished;
 }
 
+Zcodec ZWrapper::codec() const
+{
+	return pimpl->codec();
+}
+
+void ZWrapper::set_level (int level)
+{
+	pimpl->level = level;
+}
+
+void ZWrapper::set_threads (unsigned nthreads, size_t block_size)
+{
+	if (nthreads == 0) {
+		nthreads = std::thread::hardware_concurrency();
+		if (nthreads == 0) nthreads = 1;
+	}
+	if (block_size < window_size) block_size = window_size;
+	if (block_size > (1 << 30)) block_size = 1 << 30;
+	if (pimpl->mode == none) {
+		pimpl->blocks = pimpl->blocks || nthreads > 1;
+	} else if (pimpl->mode == compressing) {
+		// The blocks may change size, but a stream that was started
+		// without blocks cannot switch to them.
+		if (!pimpl->blocks) {
+			throw std::logic_error ("ZWrapper::set_threads() called in the middle of a stream");
+		}
+	}
+	pimpl->nthreads = nthreads;
+	pimpl->block_size = block_size;
+}
+
 
 
 }}
@@ -37,7 +37,12 @@
 namespace amber {  namespace AMBER_SONAME {
 
 
-// Wrappers around the zlib or miniz library. Just create a ZWrapper object.
+// The codecs supported by ZWrapper. zcodec_deflate uses the zlib or miniz
+// library. zcodec_lz is a fast LZ77 codec that is part of amber. It
+// compresses less than deflate but it is much faster. It has no levels.
+enum Zcodec { zcodec_deflate, zcodec_lz };
+
+// Wrappers around the compression codecs. Just create a ZWrapper object.
 // Pass chunks of input to either compress or expand. They will put the
 // compressed or expanded data in *res. When all input data has been passed
 // through compress() or expand() call flush() or the corresponding function
@@ -47,9 +52,9 @@ namespace amber {  namespace AMBER_SONAME {
 // The library initializes and frees the zlib correctly and takes care of
 // managing the buffers.
 
-// If there are errors the functions will return a zlib error code and will
-// set the state so that bad() will return true. You must call reset() to
-// clear the error condition.
+// If there are errors the functions will return a zlib error code, also with
+// zcodec_lz, and will set the state so that bad() will return true. You must
+// call reset() to clear the error condition.
 
 // The library supports compressing or expanding a single stream at a time.
 // To process a new stream you must call reset() between the streams. If you
@@ -60,13 +65,18 @@ namespace amber {  namespace AMBER_SONAME {
 
 
 class EXPORTFN ZWrapper {
+	// Each codec is a class derived from Data.
 	struct Data;
+	struct Deflate_data;
+	struct Lz_data;
 	struct Data *pimpl;
 	bool ok;
 
+	static Data * new_data (Zcodec codec, int level);
+
 public:
 
-	ZWrapper(int level = 9);
+	ZWrapper(int level = 9, Zcodec codec = zcodec_deflate);
 	ZWrapper (const ZWrapper &rhs);
 	~ZWrapper();
 	ZWrapper & operator= (const ZWrapper &rhs);
@@ -123,6 +133,23 @@ public:
 	bool bad() const  { return !ok; }
 	std::streamoff tail_offset() const;
 	bool finished() const;
+	Zcodec codec() const;
+
+	// Compress the input that follows with the given level. The output
+	// remains a single stream. Only zcodec_deflate has levels. Level 0
+	// stores the input in deflate blocks without compressing it.
+	void set_level (int level);
+
+	// Compress with nthreads threads, or as many as the hardware supports if
+	// it is 0. The input is split in blocks of block_size bytes that are
+	// compressed in parallel and the output is still a single zlib stream.
+	// The blocks cost some compression, therefore this is worth it only
+	// for large inputs. Only the compression with zcodec_deflate uses the
+	// threads. Once it has been called with more than one thread the
+	// streams are compressed in blocks, even if the number of threads is
+	// later lowered to 1. In the middle of a stream compressed in blocks it
+	// changes the threads and the size of the blocks that follow.
+	void set_threads (unsigned nthreads, size_t block_size = 1 << 20);
 };
 
 
@@ -268,6 +268,56 @@ void measure(int n)
 	t2 = Clock::now();
 	std::cout << "scalarbase: " << (t2 - t1)/n << '\n';
 
+	static const int widths[] = { 4, 5, 6, 8 };
+	for (int w : widths) {
+		scalarbase_window (e2, x2s.b, w);   // Build the table.
+		t1 = Clock::now();
+		for (int i = 0; i < n; ++i) {
+			scalarbase_window (e2, x2s.b, w);
+		}
+		t2 = Clock::now();
+		format (std::cout, "scalarbase with %d bit windows: %s, table of %d bytes\n",
+		        w, (t2 - t1)/n, base_table_size (w));
+	}
+
+	Edwards e4[4];
+	const uint8_t *sc4[4] = { x1s.b, x2s.b, x3s.b, x1s.b };
+	t1 = Clock::now();
+	for (int i = 0; i < n; ++i) {
+		scalarbase_x4 (e4, sc4);
+	}
+	t2 = Clock::now();
+	std::cout << "scalarbase_x4 (per point): " << (t2 - t1)/n/4 << '\n';
+
+	uint8_t sh4[4][32];
+	uint8_t *sh4p[4] = { sh4[0], sh4[1], sh4[2], sh4[3] };
+	const uint8_t *pt4[4] = { x1m.b, x2m.b, x3m.b, x1m.b };
+	int err4[4];
+	t1 = Clock::now();
+	for (int i = 0; i < n; ++i) {
+		montgomery_ladder_checked_x4 (err4, sh4p, pt4, sc4);
+	}
+	t2 = Clock::now();
+	std::cout << "montgomery_ladder_checked_x4 (per ladder): " << (t2 - t1)/n/4 << '\n';
+
+	t1 = Clock::now();
+	for (int i = 0; i < n; ++i) {
+		montgomery_ladder_unchecked_x4 (sh4p, pt4, sc4);
+	}
+	t2 = Clock::now();
+	std::cout << "montgomery_ladder_unchecked_x4 (per ladder): " << (t2 - t1)/n/4 << '\n';
+
+	uint8_t shb[8][32];
+	Cu25519Ris ptb[8] = { x1r, x2r, x1r, x2r, x1r, x2r, x1r, x2r };
+	Cu25519Sec scb[8] = { x1s, x2s, x3s, x1s, x2s, x3s, x1s, x2s };
+	int errb[8];
+	t1 = Clock::now();
+	for (int i = 0; i < n; ++i) {
+		cu25519_shared_secret_batch (shb, ptb, scb, 8, errb, 1);
+	}
+	t2 = Clock::now();
+	std::cout << "cu25519_shared_secret_batch (per element): " << (t2 - t1)/n/8 << '\n';
+
 	Fe ru, rv, rz;
 	t1 = Clock::now();
 	for (int i = 0; i < n; ++i) {
@@ -578,6 +628,24 @@ void measure(int n)
 		t2 = Clock::now();
 		std::cout << "cu25519_verify (ris): " << (t2 - t1)/n << '\n';
 
+		t1 = Clock::now();
+		for (int i = 0; i < n; ++i) {
+			Cu25519_verifier tmp (ris);
+		}
+		t2 = Clock::now();
+		std::cout << "Cu25519_verifier setup: " << (t2 - t1)/n << '\n';
+		Cu25519_verifier ver (ris);
+
+		t1 = Clock::now();
+		for (int i = 0; i < n; ++i) {
+			if (ver.verify ("ristretto", &item[0], item.size(), rissig) != 0) {
+				std::cout << "error in Cu25519_verifier\n";
+				break;
+			}
+		}
+		t2 = Clock::now();
+		std::cout << "Cu25519_verifier::verify: " << (t2 - t1)/n << '\n';
+
 		t1 = Clock::now();
 		for (int i = 0; i < n; ++i) {
 			if (ristretto_qdsa_verify ("ristretto", &item[0], item.size(), rissig, ris) != 0) {
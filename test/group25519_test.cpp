@@ -33,6 +33,7 @@
 #include <fstream>
 #include <iomanip>
 #include <assert.h>
+#include <vector>
 
 using namespace amber;
 
@@ -356,6 +357,27 @@ void test_scalarmult()
 		format (std::cout, "Error in scalarmult_fw().\n");
 	}
 
+	static const int widths[] = { 4, 5, 6, 8 };
+	for (int w : widths) {
+		scalarbase_window (e1, xs.b, w);
+		edwards_to_mxs (mx, e1);
+		if (memcmp (xp.b, mx, 32) != 0) {
+			format (std::cout, "Error in scalarbase_window(%d).\n", w);
+		}
+		// All bits set requires the final carry.
+		uint8_t ones[32];
+		Edwards e2;
+		memset (ones, 0xFF, 32);
+		scalarbase_window (e1, ones, w);
+		scalarmult (e2, edwards_base_point, ones);
+		uint8_t mx2[32];
+		edwards_to_mxs (mx, e1);
+		edwards_to_mxs (mx2, e2);
+		if (memcmp (mx, mx2, 32) != 0) {
+			format (std::cout, "Error in scalarbase_window(%d) with 256 bits.\n", w);
+		}
+	}
+
 	montgomery_base (e1, xs.b);
 	edwards_to_mxs (mx, e1);
 	if (memcmp (xp.b, mx, 32) != 0) {
@@ -628,6 +650,18 @@ void test_ristretto_sign (int count)
 		if (errc != 0) {
 			format (std::cout, "error in ristretto_qdsa_verify\n");
 		}
+		Cu25519_verifier ver (rsp);
+		if (ver.verify ("ristretto", rss.b, 32, sig) != 0) {
+			format (std::cout, "Cu25519_verifier failed\n");
+		}
+		if (cu25519_verify_cached ("ristretto", rss.b, 32, sig, rsp) != 0) {
+			format (std::cout, "cu25519_verify_cached failed\n");
+		}
+		sig[i & 31] ^= 1;
+		if (ver.verify ("ristretto", rss.b, 32, sig) == 0
+		    || cu25519_verify_cached ("ristretto", rss.b, 32, sig, rsp) == 0) {
+			format (std::cout, "Cu25519_verifier accepted a bad signature\n");
+		}
 	}
 	format (std::cout, "Checked %d ristretto signatures\n", count);
 }
@@ -856,6 +890,98 @@ void test_curve_point (int count)
 }
 
 
+void test_x4 (int count)
+{
+	int nwrong = 0;
+	for (int n = 0; n < count; ++n) {
+		uint8_t sc[4][32], px[4][32], r1[4][32], r4[4][32];
+		const uint8_t *scp[4], *pxp[4];
+		uint8_t *r4p[4];
+		Edwards e1, e4[4];
+		for (int i = 0; i < 4; ++i) {
+			randombytes_buf (sc[i], 32);
+			randombytes_buf (px[i], 32);
+			px[i][31] &= 0x7F;
+			scp[i] = sc[i];
+			pxp[i] = px[i];
+			r4p[i] = r4[i];
+		}
+		int err1[4], err4[4];
+		montgomery_ladder_checked_x4 (err4, r4p, pxp, scp);
+		for (int i = 0; i < 4; ++i) {
+			err1[i] = montgomery_ladder_checked (r1[i], px[i], sc[i]);
+			if (err1[i] != err4[i] || crypto_neq (r1[i], r4[i], 32)) {
+				nwrong++;
+			}
+		}
+		montgomery_ladder_unchecked_x4 (r4p, pxp, scp);
+		for (int i = 0; i < 4; ++i) {
+			montgomery_ladder_unchecked (r1[i], px[i], sc[i]);
+			if (crypto_neq (r1[i], r4[i], 32)) {
+				nwrong++;
+			}
+		}
+		scalarbase_x4 (e4, scp);
+		for (int i = 0; i < 4; ++i) {
+			scalarbase (e1, sc[i]);
+			edwards_to_eys (r1[i], e1);
+			edwards_to_eys (r4[i], e4[i]);
+			if (crypto_neq (r1[i], r4[i], 32)) {
+				nwrong++;
+			}
+		}
+	}
+	format (std::cout, "Checking the four lane functions, %d wrong out of %d cases\n", nwrong, count*12);
+}
+
+
+void test_shared_secret_batch (int count)
+{
+	int nwrong = 0, ncases = 0;
+	for (int n = 0; n < count; ++n) {
+		// Sizes that exercise full groups, the padded group of three and the
+		// single lane tail, with one and several threads.
+		size_t sz = n % 10;
+		std::vector<Cu25519Ris> pts (sz);
+		std::vector<Cu25519Sec> scs (sz);
+		for (size_t i = 0; i < sz; ++i) {
+			Cu25519Sec tmp;
+			randombytes_buf (tmp.b, 32);
+			cu25519_generate (&tmp, &pts[i]);
+			randombytes_buf (scs[i].b, 32);
+			mask_scalar (scs[i].b);
+			if (i == 2) {
+				randombytes_buf (pts[i].b, 32);    // Probably not a point.
+			}
+		}
+		std::vector<uint8_t> shv (sz*32 + 1);
+		uint8_t (*sh)[32] = (uint8_t (*)[32]) &shv[0];
+		std::vector<int> err (sz + 1);
+		uint8_t r1[32];
+		int nfail = cu25519_shared_secret_batch (sh, pts.data(), scs.data(), sz, &err[0], n & 1 ? 2 : 1);
+		for (size_t i = 0; i < sz; ++i) {
+			int e1 = cu25519_shared_secret_checked (r1, pts[i], scs[i]);
+			if (e1 != err[i] || (e1 == 0 && crypto_neq (r1, sh[i], 32))) {
+				nwrong++;
+			}
+			if (err[i] != 0) --nfail;
+			ncases++;
+		}
+		if (nfail != 0) nwrong++;
+		cu25519_shared_secret_batch (sh, pts.data(), scs.data(), sz, NULL, n & 1 ? 1 : 3);
+		for (size_t i = 0; i < sz; ++i) {
+			cu25519_shared_secret_unchecked (r1, pts[i], scs[i]);
+			if (crypto_neq (r1, sh[i], 32)) {
+				nwrong++;
+			}
+			ncases++;
+		}
+	}
+	format (std::cout, "Checking cu25519_shared_secret_batch, %d wrong out of %d cases\n", nwrong, ncases);
+}
+
+
+
 int main()
 {
 	test_ristretto(200);
@@ -870,5 +996,7 @@ int main()
 	test_scalarmult();
 	test_sqrt_m1(5);
 	test_curve_point (1000);
+	test_x4 (100);
+	test_shared_secret_batch (100);
 }
 
@@ -0,0 +1,118 @@
+/*
+ * Copyright (c) 2015-2018, Pelayo Bernedo
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "keys.hpp"
+#include "misc.hpp"
+#include <iostream>
+#include <fstream>
+#include <string.h>
+#include <stdio.h>
+
+using namespace amber;
+
+static void make_key (const char *name, int seed, Key *k)
+{
+	uint8_t priv[32];
+	for (int i = 0; i < 32; ++i) priv[i] = seed * 31 + i;
+	generate_master_from_secret (priv, name, k);
+}
+
+static size_t count_selected (const Key_list &kl, const char *name)
+{
+	Key_list sel;
+	select_keys (kl, name, sel);
+	return sel.size();
+}
+
+// A forced insert may rename a key. The names must be found afterwards.
+void test_forced_rename()
+{
+	Key_list kl;
+	Key alice, carol, bob;
+	make_key ("alice", 1, &alice);
+	make_key ("carol", 2, &carol);
+	insert_key (kl, alice, false);
+	insert_key (kl, carol, false);
+	bool ok = count_selected (kl, "alice") == 1;
+
+	bob = alice;
+	bob.name = "bob";
+	insert_key (kl, bob, true);
+	ok = ok && kl.size() == 2 && count_selected (kl, "bob") == 1
+	     && count_selected (kl, "alice") == 0 && count_selected (kl, "carol") == 1;
+	std::cout << "forced rename: " << (ok ? "ok" : "MISMATCH") << '\n';
+}
+
+
+// New keys and new certifications are appended to the ring. Other changes
+// require writing it again.
+void test_append()
+{
+	const char name[] = "keys_test.keys";
+	Key_list kl;
+	Key alice, carol, dave;
+	make_key ("alice", 1, &alice);
+	make_key ("carol", 2, &carol);
+	make_key ("dave", 3, &dave);
+	kl.push_back (alice);
+	kl.push_back (carol);
+	{
+		std::ofstream os (name, os.binary);
+		write_keys (os, kl, false);
+	}
+	std::streamoff before = keys_size (kl);
+
+	sign_keys (kl, carol, std::vector<std::string> (1, "alice"));
+	kl.push_back (dave);
+	std::streamoff size = append_key_changes (name, kl, "");
+
+	Key_list back;
+	std::ifstream is (name, is.binary);
+	read_keys (is, back, true, false);
+	is.close();
+	const Key *a = back.find (alice.pair.xp);
+	// Less is written than when writing the ring again.
+	bool ok = size > before && size - before < keys_size (kl)
+	          && back.size() == 3 && a && a->sigs.size() == 1
+	          && memcmp (a->sigs[0].signer.b, carol.pair.xp.b, 32) == 0
+	          && back.find (dave.pair.xp) != NULL;
+
+	// Appending again without changes does not write anything.
+	ok = ok && append_key_changes (name, kl, "") == 0;
+
+	kl.find (dave.pair.xp)->alias = "d";
+	ok = ok && append_key_changes (name, kl, "") == -1;
+	std::cout << "append to the ring: " << (ok ? "ok" : "MISMATCH") << '\n';
+	remove (name);
+}
+
+
+int main()
+{
+	test_forced_rename();
+	test_append();
+}
@@ -27,6 +27,8 @@
 
 #include "protobuf.hpp"
 #include <fstream>
+#include <sstream>
+#include <iterator>
 #include "hasopt.hpp"
 
 using namespace amber;
@@ -181,6 +183,277 @@ void protohead()
 	}
 }
 
+// Round trip varints of every length, both one by one and as packed
+// arrays, reading from memory and from a stream.
+void packed()
+{
+	std::vector<uint64_t> uv;
+	std::vector<int64_t> iv;
+	for (unsigned i = 0; i < 64; ++i) {
+		uv.push_back ((uint64_t(1) << i) - 1);
+		uv.push_back (uint64_t(1) << i);
+		iv.push_back (-(int64_t(1) << i) / 2);
+		iv.push_back ((int64_t(1) << i) / 2 - 1);
+	}
+	uv.push_back (-1);
+
+	Protobuf_writer pw (NULL, pw.seek, -1);
+	for (auto u : uv) pw.write_uint (1, u);
+	pw.write_packed_uint (2, uv.begin(), uv.end());
+	pw.write_packed_int (3, iv.begin(), iv.end());
+	const std::vector<char> &buf (pw.get_buffer());
+	std::string sbuf (buf.begin(), buf.end());
+	std::istringstream is (sbuf);
+
+	for (int mode = 0; mode < 2; ++mode) {
+		Protobuf_reader pr;
+		if (mode == 0) {
+			pr.set_input (&buf[0], buf.size());
+		} else {
+			pr.set_input (&is);
+		}
+		std::vector<uint64_t> ru, rp;
+		std::vector<int64_t> ri;
+		uint32_t tagwt;
+		uint64_t val;
+		while (pr.read_tagval (&tagwt, &val, true)) {
+			switch (tagwt) {
+			case maketag (1, varint):
+				ru.push_back (val);
+				break;
+			case maketag (2, length_val):
+				pr.read_packed_uint (std::back_inserter(rp), val);
+				break;
+			case maketag (3, length_val):
+				pr.read_packed_int (std::back_inserter(ri), val);
+				break;
+			default:
+				pr.skip (tagwt, val);
+			}
+		}
+		bool ok = ru == uv && rp == uv && ri == iv;
+		std::cout << (mode == 0 ? "memory" : "stream")
+		          << " packed varints: " << (ok ? "ok" : "MISMATCH") << '\n';
+	}
+}
+
+
+// Write nested groups whose contents are much bigger than the buffer of the
+// writer, so that their headers must be written by seeking back in the
+// stream. Describe in desc what has been written.
+static void write_nested (Protobuf_writer &pw, int depth, int &counter, std::string &desc)
+{
+	std::vector<char> bytes;
+	for (int i = 0; i < 3; ++i) {
+		int c = counter++;
+		pw.write_uint (1, c);
+		bytes.assign (300 + c % 7 * 50, char('a' + c % 26));
+		pw.write_bytes (2, &bytes[0], bytes.size());
+		desc += "u" + std::to_string (c) + " b" + std::to_string (bytes.size()) + bytes[0] + " ";
+		if (depth > 0) {
+			pw.start_group (3 + i % 2);
+			desc += "{";
+			write_nested (pw, depth - 1, counter, desc);
+			if (pw.end_group (i % 2) == group_end) {
+				desc += "!";
+			}
+			desc += "}";
+		}
+	}
+}
+
+static void read_nested (Protobuf_reader &pr, bool top, std::string &desc)
+{
+	uint32_t tagwt;
+	uint64_t val;
+	std::string s;
+	while (pr.read_tagval (&tagwt, &val, top)) {
+		switch (tagwt) {
+		case maketag (1, varint):
+			desc += "u" + std::to_string (val) + " ";
+			break;
+		case maketag (2, length_val):
+			s.resize (val);
+			pr.get_bytes (&s[0], val);
+			desc += "b" + std::to_string (val) + s[0] + " ";
+			break;
+		case maketag (3, group_len):
+		case maketag (3, length_val):
+		case maketag (4, group_len):
+		case maketag (4, length_val):
+			desc += "{";
+			read_nested (pr, false, desc);
+			desc += "}";
+			break;
+		default:
+			// A group_start means that the header was not written back.
+			desc += "?";
+			pr.skip (tagwt, val);
+		}
+	}
+}
+
+// Round trip nested groups bigger than the buffer through a seekable stream.
+void nested_seek()
+{
+	std::stringstream ss;
+	std::string wdesc;
+	int counter = 0;
+	{
+		Protobuf_writer pw (&ss, pw.seek, 1000);
+		write_nested (pw, 3, counter, wdesc);
+		pw.flush();
+	}
+	std::string buf = ss.str();
+
+	for (int mode = 0; mode < 2; ++mode) {
+		Protobuf_reader pr;
+		if (mode == 0) {
+			pr.set_input (buf.data(), buf.size());
+		} else {
+			ss.seekg (0);
+			pr.set_input (&ss);
+		}
+		std::string rdesc;
+		read_nested (pr, true, rdesc);
+		bool ok = rdesc == wdesc;
+		std::cout << (mode == 0 ? "memory" : "stream") << " nested groups of "
+		          << buf.size() << " bytes: " << (ok ? "ok" : "MISMATCH") << '\n';
+	}
+}
+
+
+struct Point {
+	uint32_t x;
+	int64_t y;
+	std::string label;
+	std::vector<uint32_t> tags;
+};
+
+typedef Pb_schema<Point,
+	Pb_uint<1, Protobuf_reader::needed_once, Point, uint32_t, &Point::x>,
+	Pb_uint<2, Protobuf_reader::optional_once, Point, int64_t, &Point::y>,
+	Pb_string<3, Protobuf_reader::needed_once, Point, &Point::label>,
+	Pb_uint_list<4, Protobuf_reader::optional_many, Point, uint32_t, &Point::tags>
+> Point_schema;
+
+struct Shape {
+	std::string name;
+	std::vector<Point> points;
+};
+
+typedef Pb_schema<Shape,
+	Pb_string<1, Protobuf_reader::needed_once, Shape, &Shape::name>,
+	Pb_group_list<2, Protobuf_reader::needed_many, Shape, Point, &Shape::points, Point_schema>
+> Shape_schema;
+
+// Write a shape with the schema, read it back and check that missing and
+// repeated fields are reported.
+void schema()
+{
+	Shape sh;
+	sh.name = "triangle";
+	for (uint32_t i = 0; i < 3; ++i) {
+		Point p;
+		p.x = i;
+		p.y = i * 1000;
+		p.label = "p" + std::to_string (i);
+		p.tags.assign (i, i + 7);
+		sh.points.push_back (p);
+	}
+
+	Protobuf_writer pw (NULL, pw.seek, -1);
+	pw.start_group (5);
+	Shape_schema::write (pw, sh);
+	pw.end_group();
+	pw.write_uint (6, 1);   // Unknown field.
+	pw.start_group (5);
+	pw.write_string (1, "empty");
+	pw.end_group();
+	pw.start_group (5);
+	pw.write_string (1, "twice");
+	pw.write_string (1, "twice");
+	pw.end_group();
+
+	const std::vector<char> &buf (pw.get_buffer());
+	Protobuf_reader pr (&buf[0], buf.size());
+	uint32_t tagwt;
+	uint64_t val;
+	while (pr.read_tagval (&tagwt, &val, true)) {
+		if (tagwt != maketag (5, group_len)) {
+			pr.skip (tagwt, val);
+			continue;
+		}
+		Shape rd;
+		try {
+			Shape_schema::read (pr, rd);
+		} catch (std::exception &e) {
+			std::cout << "schema: " << e.what() << '\n';
+			continue;
+		}
+		bool ok = rd.name == sh.name && rd.points.size() == sh.points.size();
+		for (size_t i = 0; ok && i < rd.points.size(); ++i) {
+			ok = rd.points[i].x == sh.points[i].x && rd.points[i].y == sh.points[i].y &&
+			     rd.points[i].label == sh.points[i].label &&
+			     rd.points[i].tags == sh.points[i].tags;
+		}
+		std::cout << "schema round trip: " << (ok ? "ok" : "MISMATCH") << '\n';
+	}
+}
+
+
+// Skipping a group must leave the reader at the next field, both at the
+// top level and inside an enclosing group.
+void skip_group()
+{
+	Protobuf_writer pw (NULL, pw.seek, -1);
+	pw.start_group (1);
+	pw.write_uint (1, 10);
+	pw.end_group();
+	pw.write_uint (2, 20);
+	pw.start_group (3);
+	pw.start_group (4);
+	pw.write_uint (1, 30);
+	pw.end_group();
+	pw.write_uint (5, 40);
+	pw.end_group();
+	pw.write_uint (6, 50);
+	const std::vector<char> &buf (pw.get_buffer());
+	std::string sbuf (buf.begin(), buf.end());
+	std::istringstream is (sbuf);
+
+	for (int mode = 0; mode < 2; ++mode) {
+		Protobuf_reader pr;
+		if (mode == 0) {
+			pr.set_input (&buf[0], buf.size());
+		} else {
+			pr.set_input (&is);
+		}
+		std::string seen;
+		uint32_t tagwt;
+		uint64_t val;
+		while (pr.read_tagval (&tagwt, &val, true)) {
+			if (tagwt == maketag (3, group_len)) {
+				while (pr.read_tagval (&tagwt, &val)) {
+					if (tagwt == maketag (5, varint)) {
+						seen += std::to_string (val) + ' ';
+					} else {
+						pr.skip (tagwt, val);
+					}
+				}
+			} else if ((tagwt & 7) == varint) {
+				seen += std::to_string (val) + ' ';
+			} else {
+				pr.skip (tagwt, val);
+			}
+		}
+		bool ok = seen == "20 40 50 ";
+		std::cout << (mode == 0 ? "memory" : "stream")
+		          << " skip group: " << (ok ? "ok" : "MISMATCH") << '\n';
+	}
+}
+
+
 int main()
 {
 	const char name[] = "foo.gpb";
@@ -193,6 +466,10 @@ int main()
 	protohead();
 	test_conv();
 	combined();
+	packed();
+	nested_seek();
+	schema();
+	skip_group();
 }
 
 
@@ -26,6 +26,7 @@
  */
 
 #include "symmetric.hpp"
+#include "noise.hpp"
 #include "misc.hpp"
 #include <iostream>
 #include <string.h>
@@ -277,6 +278,128 @@ void test_packets()
 }
 
 
+// chacha20_x4() must give the same blocks as four calls to chacha20().
+void test_chacha20_x4()
+{
+	uint8_t kb[32];
+	for (unsigned i = 0; i < 32; ++i) kb[i] = i * 7 + 3;
+	Chakey key;
+	load (&key, kb);
+
+	// Include block numbers that carry into the upper 32 bits.
+	const uint64_t n64[4] = { 0, 1, 0x0123456789ABCDEFULL, uint64_t(-1) };
+	const uint64_t bn[4][4] = {
+		{ 0, 1, 2, 3 },
+		{ 0xFFFFFFFF, 0x100000000ULL, 7, 0 },
+		{ uint64_t(-1), 0, 0xFFFFFFFE, 1234567 },
+		{ 5, 5, 5, 5 }
+	};
+	for (unsigned i = 0; i < 4; ++i) {
+		uint8_t x4[256], one[64];
+		chacha20_x4 (x4, key, n64, bn[i]);
+		for (unsigned j = 0; j < 4; ++j) {
+			chacha20 (one, key, n64[j], bn[i][j]);
+			if (memcmp (one, x4 + 64*j, 64) != 0) {
+				format (std::cout, "error in chacha20_x4, case %d, lane %d\n", i, j);
+			}
+		}
+	}
+	format (std::cout, "ChaCha20 x4 tested\n");
+}
+
+
+// Cipher::encrypt_batch() and decrypt_batch() must give the same results as
+// calling encrypt_with_ad() and decrypt_with_ad() for each packet.
+void test_batch()
+{
+	enum { count = 13 };
+	const size_t lens[count] = { 0, 1, 15, 16, 17, 63, 64, 65, 127, 128, 200, 1000, 3 };
+
+	uint8_t kb[32];
+	for (unsigned i = 0; i < 32; ++i) kb[i] = i;
+	Cipher single, batch;
+	single.initialize_key (kb);
+	batch.initialize_key (kb);
+	single.set_nonce (62);
+	batch.set_nonce (62);
+
+	std::vector<uint8_t> pt[count], ad[count], ct1[count], ct2[count];
+	Cipher_packet p[count];
+	for (unsigned i = 0; i < count; ++i) {
+		pt[i].resize (lens[i]);
+		for (size_t j = 0; j < lens[i]; ++j) pt[i][j] = j * 13 + i;
+		ad[i].assign (i % 3 * 5, uint8_t(i));
+		ct1[i].resize (lens[i] + 16);
+		ct2[i].resize (lens[i] + 16);
+		single.encrypt_with_ad (ad[i].data(), ad[i].size(), pt[i].data(), lens[i], ct1[i].data());
+		p[i].ad = ad[i].data();
+		p[i].alen = ad[i].size();
+		p[i].in = pt[i].data();
+		p[i].len = lens[i];
+		p[i].out = ct2[i].data();
+		p[i].status = 1;
+	}
+	batch.encrypt_batch (p, count);
+	for (unsigned i = 0; i < count; ++i) {
+		if (ct1[i] != ct2[i] || p[i].status != 0) {
+			format (std::cout, "error in encrypt_batch, packet %d\n", i);
+		}
+	}
+	if (single.get_nonce() != batch.get_nonce()) {
+		format (std::cout, "encrypt_batch left the nonce at %d instead of %d\n",
+		        batch.get_nonce(), single.get_nonce());
+	}
+
+	// Damage some tags and make one packet shorter than a tag.
+	ct1[2].back() ^= 1;
+	ct1[5][0] ^= 0x80;
+	ct1[12].resize (10);
+	ct2[2] = ct1[2];
+	ct2[5] = ct1[5];
+	ct2[12] = ct1[12];
+
+	single.set_nonce (62);
+	batch.set_nonce (62);
+	std::vector<uint8_t> dec1[count], dec2[count];
+	size_t failed = 0;
+	int res[count];
+	for (unsigned i = 0; i < count; ++i) {
+		size_t mlen = ct1[i].size() < 16 ? 0 : ct1[i].size() - 16;
+		dec1[i].assign (mlen, 0xAA);
+		dec2[i].assign (mlen, 0xAA);
+		res[i] = single.decrypt_with_ad (ad[i].data(), ad[i].size(), ct1[i].data(), ct1[i].size(), dec1[i].data());
+		if (res[i] != 0) ++failed;
+		p[i].in = ct2[i].data();
+		p[i].len = ct2[i].size();
+		p[i].out = dec2[i].data();
+		p[i].status = 1;
+	}
+	if (failed != 3) {
+		format (std::cout, "decrypt_with_ad failed %d packets instead of 3\n", failed);
+	}
+	size_t bfailed = batch.decrypt_batch (p, count);
+	if (bfailed != failed) {
+		format (std::cout, "decrypt_batch failed %d packets, decrypt_with_ad %d\n", bfailed, failed);
+	}
+	for (unsigned i = 0; i < count; ++i) {
+		if ((p[i].status != 0) != (res[i] != 0)) {
+			format (std::cout, "decrypt_batch gave status %d to packet %d\n", p[i].status, i);
+		}
+		if (res[i] == 0 && dec2[i] != pt[i]) {
+			format (std::cout, "error in decrypt_batch, packet %d\n", i);
+		}
+		if (res[i] != 0 && dec2[i] != std::vector<uint8_t> (dec2[i].size(), 0xAA)) {
+			format (std::cout, "decrypt_batch wrote the failed packet %d\n", i);
+		}
+	}
+	if (single.get_nonce() != batch.get_nonce()) {
+		format (std::cout, "decrypt_batch left the nonce at %d instead of %d\n",
+		        batch.get_nonce(), single.get_nonce());
+	}
+	format (std::cout, "Batch packets tested\n");
+}
+
+
 int main()
 {
 	enum { num_vecs = sizeof(chv)/sizeof(chv[0]) };
@@ -288,6 +411,8 @@ int main()
 	test (ccc[0]);
 	test_hchacha();
 	test_packets();
+	test_chacha20_x4();
+	test_batch();
 }
 
 
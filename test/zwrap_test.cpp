@@ -0,0 +1,194 @@
+/*
+ * Copyright (c) 2015-2018, Pelayo Bernedo
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "zwrap.hpp"
+#include "hasopt.hpp"
+#include "misc.hpp"
+#include <iostream>
+#include <vector>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+
+using namespace amber;
+
+// Samples of different kinds: random bytes, text with repetitions, long
+// runs and a mix of them.
+static void make_sample (int kind, size_t n, std::vector<char> &v)
+{
+	static const char *words[] = { "packed ", "archive ", "amber ", "the ", "chunk ",
+	                               "compress\n", "expand ", "a ", "key ", "0123 " };
+	v.clear();
+	while (v.size() < n) {
+		switch (kind) {
+		case 0:
+			v.push_back (rand());
+			break;
+		case 1: {
+			const char *w = words[rand() % 10];
+			v.insert (v.end(), w, w + strlen(w));
+			break;
+		}
+		case 2:
+			v.insert (v.end(), 1 + rand() % 1000, char(rand() % 3));
+			break;
+		default:
+			if (rand() % 2) {
+				v.insert (v.end(), 1 + rand() % 100, char(rand()));
+			} else {
+				v.push_back (rand());
+			}
+		}
+	}
+	v.resize (n);
+}
+
+// Compress and expand v passing pieces of random sizes. If nthreads is not 1
+// compress in blocks of 32 KiB with nthreads threads. If levels is set then
+// switch between levels 0 and 6 before each piece, and between 1 and
+// nthreads threads if nthreads is not 1.
+static bool round_trip (Zcodec codec, const std::vector<char> &v, unsigned nthreads,
+                        bool levels)
+{
+	ZWrapper zc (6, codec), ze (6, codec);
+	if (nthreads != 1) zc.set_threads (nthreads, 32768);
+	buffer<char> out;
+	std::vector<char> packed, expanded;
+
+	size_t pos = 0;
+	do {
+		size_t n = rand() % 150000;
+		if (n > v.size() - pos) n = v.size() - pos;
+		if (levels) zc.set_level (rand() % 2 ? 6 : 0);
+		if (levels && nthreads != 1) zc.set_threads (1 + rand() % nthreads, 32768);
+		zc.compress (v.data() + pos, n, &out);
+		packed.insert (packed.end(), &out[0], &out[0] + out.size());
+		pos += n;
+	} while (pos < v.size());
+	zc.flush (&out);
+	packed.insert (packed.end(), &out[0], &out[0] + out.size());
+
+	pos = 0;
+	while (pos < packed.size()) {
+		size_t n = 1 + rand() % 70000;
+		if (n > packed.size() - pos) n = packed.size() - pos;
+		if (ze.expand (&packed[0] + pos, n, &out) != 0) return false;
+		expanded.insert (expanded.end(), &out[0], &out[0] + out.size());
+		pos += n;
+	}
+	if (ze.flush (&out) != 0) return false;
+	expanded.insert (expanded.end(), &out[0], &out[0] + out.size());
+	return expanded == v && ze.finished() && ze.good();
+}
+
+static void test_round_trips (Zcodec codec, const char *name, unsigned nthreads = 1,
+                              bool levels = false)
+{
+	static const size_t sizes[] = { 0, 1, 5, 12, 13, 100, 65535, 65536, 65537,
+	                                200000, 1000000 };
+	int nwrong = 0, count = 0;
+	std::vector<char> v;
+	for (unsigned i = 0; i < sizeof sizes / sizeof sizes[0]; ++i) {
+		for (int kind = 0; kind < 4; ++kind) {
+			make_sample (kind, sizes[i], v);
+			if (!round_trip (codec, v, nthreads, levels)) {
+				format (std::cout, "%s failed for size %d kind %d\n", name, sizes[i], kind);
+				++nwrong;
+			}
+			++count;
+		}
+	}
+	format (std::cout, "Checking %s round trips, %d wrong out of %d cases\n", name, nwrong, count);
+}
+
+// Damaged or truncated streams must be expanded without reading or writing
+// out of bounds and the damage must be reported.
+static void test_damaged()
+{
+	std::vector<char> v;
+	int ndetected = 0, count = 0;
+	for (int i = 0; i < 200; ++i) {
+		make_sample (1 + i % 3, 1000 + rand() % 100000, v);
+		ZWrapper zc (9, zcodec_lz);
+		buffer<char> packed, out;
+		zc.compress (&v[0], v.size(), &packed, true);
+
+		// Change a byte, cut the stream anywhere or cut it at the end of
+		// the first block.
+		size_t len = packed.size();
+		if (i % 3 == 0) {
+			packed[rand() % packed.size()] ^= 1 + rand() % 255;
+		} else if (i % 3 == 1) {
+			len = rand() % packed.size();
+		} else {
+			len = 8 + (leget32 (&packed[4]) & 0x7FFFFFFF);
+		}
+
+		ZWrapper ze (9, zcodec_lz);
+		if (ze.expand (&packed[0], len, &out, true) != 0) ++ndetected;
+		++count;
+	}
+	format (std::cout, "Checking damaged lz streams, %d detected out of %d cases\n", ndetected, count);
+}
+
+static double seconds (const timespec &a, const timespec &b)
+{
+	return b.tv_sec - a.tv_sec + (b.tv_nsec - a.tv_nsec) * 1e-9;
+}
+
+// Wall clock speed, because the compression may use several threads.
+static void speed (Zcodec codec, const char *name, unsigned nthreads = 1)
+{
+	std::vector<char> v;
+	make_sample (3, 16 << 20, v);
+	buffer<char> packed, out;
+	timespec t0, t1, t2;
+	clock_gettime (CLOCK_MONOTONIC, &t0);
+	ZWrapper zc (6, codec);
+	if (nthreads != 1) zc.set_threads (nthreads);
+	zc.compress (&v[0], v.size(), &packed, true);
+	clock_gettime (CLOCK_MONOTONIC, &t1);
+	ZWrapper ze (6, codec);
+	ze.expand (&packed[0], packed.size(), &out, true);
+	clock_gettime (CLOCK_MONOTONIC, &t2);
+	double mb = v.size() / 1e6;
+	format (std::cout, "%s: ratio %.3f, compress %.1f MB/s, expand %.1f MB/s\n", name,
+	        double(packed.size()) / v.size(), mb / seconds (t0, t1), mb / seconds (t1, t2));
+}
+
+int main()
+{
+	test_round_trips (zcodec_deflate, "deflate");
+	test_round_trips (zcodec_lz, "lz");
+	test_round_trips (zcodec_deflate, "parallel deflate", 4);
+	test_round_trips (zcodec_deflate, "deflate with level changes", 1, true);
+	test_round_trips (zcodec_deflate, "parallel deflate with level changes", 4, true);
+	test_damaged();
+	speed (zcodec_deflate, "deflate");
+	speed (zcodec_deflate, "parallel deflate", 0);
+	speed (zcodec_lz, "lz");
+}